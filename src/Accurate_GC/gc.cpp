@@ -1,16 +1,27 @@
-// TODO: include these properly
-#include "llvm/CodeGen/GCStrategy.h"
 #include "llvm/CodeGen/GCMetadata.h"
+#include "llvm/IR/GCStrategy.h"
 #include "llvm/Support/Compiler.h"
 
 using namespace llvm;
 
 namespace {
+  /*
+   * The strategy of churf's precise roots without a shadow stack.
+   * The roots are the llvm.gcroot slots, which stay on the stack,
+   * and every call is a safe point. The printer in gc_printer.cpp
+   * writes down the offsets of the slots for every return address,
+   * so the runtime finds the roots of a frame from the address its
+   * callee returns to. Functions need "frame-pointer"="all" for the
+   * runtime to walk their frames.
+   */
   class LLVM_LIBRARY_VISIBILITY GC : public GCStrategy {
   public:
-    GC() {}
+    GC() {
+      NeededSafePoints = true;
+      UsesMetadata = true;
+    }
   };
 
   GCRegistry::Add<GC>
   X("gc", "The bespoken garbage collector.");
-}
\ No newline at end of file
+}
@@ -1,16 +1,56 @@
+#include "llvm/BinaryFormat/ELF.h"
+#include "llvm/CodeGen/AsmPrinter.h"
+#include "llvm/CodeGen/GCMetadata.h"
 #include "llvm/CodeGen/GCMetadataPrinter.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCSectionELF.h"
+#include "llvm/MC/MCStreamer.h"
 #include "llvm/Support/Compiler.h"
 
 using namespace llvm;
 
 namespace {
+  /*
+   * Prints the frame table of the "gc" strategy into the section
+   * churf_frametable, which the linker concatenates over all the
+   * objects of a program. There is a descriptor per safe point:
+   *
+   *   uint64_t return_address;   // the label after the call
+   *   uint32_t num_roots;
+   *   int32_t  offsets[num_roots];  // of the slots from the frame pointer
+   *
+   * padded to 8 bytes. The runtime reads it as FrameDescriptor in
+   * src/GC/include/frame_table.hpp. The section is writable, since
+   * the return addresses are relocated when the program is loaded.
+   */
   class LLVM_LIBRARY_VISIBILITY GCPrinter : public GCMetadataPrinter {
   public:
-    virtual void beginAssembly(AsmPrinter &AP);
-
-    virtual void finishAssembly(AsmPrinter &AP);
+    void finishAssembly(Module &M, GCModuleInfo &Info, AsmPrinter &AP) override;
   };
 
-  GCMetadataPrinterRegistry::Add<MyGCPrinter>
+  GCMetadataPrinterRegistry::Add<GCPrinter>
   X("gc", "The bespoken garbage collector.");
-}
\ No newline at end of file
+}
+
+void GCPrinter::finishAssembly(Module &M, GCModuleInfo &Info, AsmPrinter &AP) {
+  MCStreamer &OS = *AP.OutStreamer;
+  OS.SwitchSection(AP.OutContext.getELFSection(
+      "churf_frametable", ELF::SHT_PROGBITS, ELF::SHF_ALLOC | ELF::SHF_WRITE));
+  OS.emitValueToAlignment(8);
+
+  for (auto I = Info.funcinfo_begin(), E = Info.funcinfo_end(); I != E; ++I) {
+    GCFunctionInfo &FI = **I;
+    if (&FI.getStrategy() != &getStrategy())
+      continue;
+
+    // The gcroot slots are live in the whole function, so every
+    // safe point has the same roots.
+    for (auto P = FI.begin(), PE = FI.end(); P != PE; ++P) {
+      OS.emitSymbolValue(P->Label, 8);
+      OS.emitInt32(FI.live_size(P));
+      for (auto R = FI.live_begin(P), RE = FI.live_end(P); R != RE; ++R)
+        OS.emitInt32(R->StackOffset);
+      OS.emitValueToAlignment(8);
+    }
+  }
+}
@@ -1,4 +1,13 @@
-define void @f() gc "gc" {
+declare void @llvm.gcroot(ptr, ptr)
+declare ptr @cheap_alloc(i64)
+
+define ptr @f() "frame-pointer"="all" gc "gc" {
 entry:
-  ret void
-}
\ No newline at end of file
+  %root = alloca ptr
+  call void @llvm.gcroot(ptr %root, ptr null)
+  %object = call ptr @cheap_alloc(i64 16)
+  store ptr %object, ptr %root
+  %next = call ptr @cheap_alloc(i64 16)
+  store ptr %object, ptr %next
+  ret ptr %next
+}
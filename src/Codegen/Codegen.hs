@@ -1,12 +1,13 @@
 {-# LANGUAGE OverloadedRecordDot #-}
 {-# LANGUAGE OverloadedStrings   #-}
 
-module Codegen.Codegen (generateCode) where
+module Codegen.Codegen (generateCode, Roots (..)) where
 
 import           Codegen.CompilerState         (CodeGenerator (..),
+                                                Roots (..),
                                                 StructType (inst),
                                                 initCodeGenerator)
-import           Codegen.Emits                 (compileScs)
+import           Codegen.Emits                 (compileScs, typeLayouts)
 import           Codegen.LlvmIr                as LIR (LLVMIr (UnsafeRaw),
                                                        llvmIrToString)
 import           Control.Monad.State           (execStateT)
@@ -24,16 +25,18 @@ import           TypeChecker.TypeCheckerIr     (Ident (..))
   An easy way to actually "compile" this output is to
   Simply pipe it to LLI
 -}
-generateCode :: MIR.Program -> Bool -> Err String
-generateCode (MIR.Program scs) addGc = do
+generateCode :: MIR.Program -> Bool -> Maybe Roots -> Err String
+generateCode (MIR.Program scs) addGc precise = do
   let tree    = filter (not . detectPrelude) (sortBy lowData scs)
-      codegen = initCodeGenerator addGc tree
+      codegen = initCodeGenerator addGc precise tree
 
   -- Append instructions
   execStateT (compileScs tree) codegen <&> \state ->
     llvmIrToString $  defaultStart
                    ++ (if addGc then gcStart else [])
+                   ++ maybe [] preciseStart precise
                    ++ map inst (Map.elems state.structTypes)
+                   ++ (if addGc then typeLayouts state else [])
                    ++ state.instructions
 
 -- | Detects certain types and functions.
@@ -68,8 +71,71 @@ gcStart :: [LLVMIr]
 gcStart =
     [ UnsafeRaw "declare external void @cheap_init()\n"
     , UnsafeRaw "declare external ptr @cheap_alloc(i64)\n"
+    , UnsafeRaw "declare external ptr @cheap_alloc_typed(i64, i64)\n"
+    , UnsafeRaw "declare external void @cheap_set_types(ptr, i64)\n"
     , UnsafeRaw "declare external void @cheap_dispose()\n"
     , UnsafeRaw "declare external ptr @cheap_the()\n"
     , UnsafeRaw "declare external void @cheap_set_profiler(ptr, i1)\n"
     , UnsafeRaw "declare external void @cheap_profiler_log_options(ptr, i64)\n"
+    ] ++ allocInline
+
+{- | The declarations for precise roots. The shadow-stack strategy
+  links the frames of the functions with roots into llvm_gc_root_chain,
+  which the GC defines per thread. It is marked as used, since opt
+  would otherwise drop the declaration and the strategy would create
+  a global of its own. The frame table needs no declarations, it is
+  printed by the "gc" strategy.
+-}
+preciseStart :: Roots -> [LLVMIr]
+preciseStart ShadowStack =
+    [ UnsafeRaw "declare void @llvm.gcroot(ptr, ptr)\n"
+    , UnsafeRaw "declare external void @cheap_set_precise_roots(i1)\n"
+    , UnsafeRaw "@llvm_gc_root_chain = external thread_local(initialexec) global ptr\n"
+    , UnsafeRaw "@llvm.compiler.used = appending global [1 x ptr] [ptr @llvm_gc_root_chain], section \"llvm.metadata\"\n"
+    ]
+preciseStart FrameTable =
+    [ UnsafeRaw "declare void @llvm.gcroot(ptr, ptr)\n"
+    , UnsafeRaw "declare external void @cheap_set_frame_roots(i1)\n"
+    ]
+
+{- | The allocation fast path of cheap.h in LLVM IR. It bumps the
+  thread-local allocation buffer of the GC after writing the header
+  of the chunk, and it only calls cheap_alloc_typed when the buffer is full. A chunk of
+  the fast path is its size plus the 8 byte header rounded up to 8
+  bytes, at most 64 bytes (CHEAP_INLINE_MAX). The header also holds
+  the index of the layout of the object from typeLayouts, at bit 50
+  (CHEAP_TYPE_SHIFT). Every allocation has a constant size and type,
+  so opt inlines this and folds the checks away.
+-}
+allocInline :: [LLVMIr]
+allocInline =
+    [ UnsafeRaw "@cheap_alloc_cursor = external thread_local(initialexec) global ptr\n"
+    , UnsafeRaw "@cheap_alloc_limit = external thread_local(initialexec) global ptr\n"
+    , UnsafeRaw $ unlines
+        [ "define private ptr @cheap_alloc_inline(i64 %size, i64 %type) alwaysinline {"
+        , "entry:"
+        , "    %size_less = add i64 %size, -1"
+        , "    %small = icmp ult i64 %size_less, 56"
+        , "    br i1 %small, label %fast, label %slow"
+        , "fast:"
+        , "    %size_header = add i64 %size, 15"
+        , "    %chunk_size = and i64 %size_header, -8"
+        , "    %chunk = load ptr, ptr @cheap_alloc_cursor"
+        , "    %limit = load ptr, ptr @cheap_alloc_limit"
+        , "    %next = getelementptr i8, ptr %chunk, i64 %chunk_size"
+        , "    %fits = icmp ule ptr %next, %limit"
+        , "    br i1 %fits, label %bump, label %slow"
+        , "bump:"
+        , "    %type_bits = shl i64 %type, 50"
+        , "    %header = or i64 %chunk_size, %type_bits"
+        , "    store i64 %header, ptr %chunk"
+        , "    fence syncscope(\"singlethread\") release"
+        , "    store ptr %next, ptr @cheap_alloc_cursor"
+        , "    %object = getelementptr i8, ptr %chunk, i64 8"
+        , "    ret ptr %object"
+        , "slow:"
+        , "    %result = call ptr @cheap_alloc_typed(i64 %size, i64 %type)"
+        , "    ret ptr %result"
+        , "}"
+        ]
     ]
@@ -30,6 +30,10 @@ data CodeGenerator = CodeGenerator
     , variableCount :: Integer
     , labelCount    :: Integer
     , gcEnabled     :: Bool
+    , preciseRoots  :: Maybe Roots
+    -- ^ How the GC finds the root slots, or Nothing to scan the stack
+    , gcRoots       :: [Ident]
+    -- ^ The root slots of the current function
     , structTypes   :: Map Ident StructType
     -- ^ Custom stucture types
     , locals        :: [(Ident, LocalElem)]
@@ -37,6 +41,14 @@ data CodeGenerator = CodeGenerator
     , globals       :: Map Ident (LLVMType, LLVMValue)
     }
 
+-- | Where the GC finds the root slots of the functions
+data Roots
+    = ShadowStack
+    -- ^ On LLVM's shadow stack, which functions push their slots onto
+    | FrameTable
+    -- ^ In the frame table of the "gc" strategy in src/Accurate_GC
+    deriving (Show, Eq)
+
 data StructType = StructType
     { ptr  :: LLVMType
     , typs :: [LLVMType]
@@ -194,8 +206,8 @@ getGlobals scs = Map.fromList [ go b | MIR.DBind b <- scs ]
 
 
 
-initCodeGenerator :: Bool -> [MIR.Def] -> CodeGenerator
-initCodeGenerator addGc scs =
+initCodeGenerator :: Bool -> Maybe Roots -> [MIR.Def] -> CodeGenerator
+initCodeGenerator addGc precise scs =
     CodeGenerator
         { instructions = []
         , functions = getFunctions scs
@@ -205,6 +217,8 @@ initCodeGenerator addGc scs =
         , variableCount = 0
         , labelCount = 0
         , gcEnabled = addGc
+        , preciseRoots = precise
+        , gcRoots = mempty
         , locals = mempty
         , globals = getGlobals scs
         }
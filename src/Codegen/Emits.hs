@@ -11,15 +11,18 @@ import           Codegen.Auxillary
 import           Codegen.CompilerState
 import           Codegen.LlvmIr                as LIR
 import           Control.Applicative           (Applicative (liftA2), (<|>))
-import           Control.Monad                 (forM_, when, zipWithM_)
+import           Control.Monad                 (forM_, unless, when, zipWithM_)
 import           Control.Monad.Extra           (whenJust)
 import           Control.Monad.State           (gets, modify)
+import           Data.Bits                     (setBit)
 import           Data.Char                     (ord)
 import           Data.Coerce                   (coerce)
 import           Data.Foldable.Extra           (notNull)
-import           Data.List                     (isPrefixOf)
+import           Data.List                     (foldl', intercalate, isPrefixOf,
+                                                nub)
 import qualified Data.Map                      as Map
-import           Data.Maybe                    (fromJust, fromMaybe, isNothing)
+import           Data.Maybe                    (fromJust, fromMaybe, isJust,
+                                                isNothing)
 import           Data.Tuple.Extra              (second)
 import           Debug.Trace                   (traceShow)
 import           Grammar.Print                 (printTree)
@@ -39,7 +42,9 @@ compileScs [] = do
             let t  = returnTypeCI ci
                 t' = type2LlvmType t
                 x  = (mkCxtName, Ptr) :  map (second type2LlvmType) ci.argumentsCI
-            emit $ Define FastCC t' id x
+            strategy <- gcStrategy
+            emit $ Define FastCC t' id x strategy
+            entry <- gets (length . instructions)
             top <- getNewVar
             ptr <- getNewVar
             -- allocated the primary type
@@ -85,7 +90,9 @@ compileScs [] = do
                             emit $ Comment "Malloc and store"
                             heapPtr <- getNewVar
                             useGc <- gets gcEnabled
-                            emit $ SetVariable heapPtr (if useGc then GcMalloc s else Malloc s)
+                            idx <- typeIndex arg_t'
+                            emit $ SetVariable heapPtr (if useGc then GcMalloc s idx else Malloc s)
+                            rootPointer (VIdent heapPtr Ptr)
                             emit $ Store arg_t' (VIdent (Ident arg_n) arg_t') Ptr heapPtr
                             emit $ Store (Ref arg_t') (VIdent heapPtr arg_t') Ptr elemPtr
                         Nothing -> do
@@ -99,6 +106,7 @@ compileScs [] = do
             load <- getNewVar
             emit $ SetVariable load (Load t' Ptr top)
             emit $ Ret t' (VIdent load t')
+            declareRoots entry
             emit DefineEnd
             emit $ UnsafeRaw "\n"
 
@@ -116,7 +124,9 @@ compileScs (DBind bind : xs) = do
     let args' | isMain    = []
               | otherwise = zip (mkCxtName : map fst args) t_args
 
-    emit $ Define FastCC (if isMain then I64 else t_return) name args'
+    strategy <- gcStrategy
+    emit $ Define FastCC (if isMain then I64 else t_return) name args' strategy
+    entry <- gets (length . instructions)
     modify $ \s -> s  { locals = foldr insertArg s.locals args' }
 
     -- Dereference ptr arguments
@@ -134,7 +144,9 @@ compileScs (DBind bind : xs) = do
     whenJust mcxt loadFreeVars
 
     gcEnabled <- gets gcEnabled
-    when isMain $ mapM_ emit (firstMainContent gcEnabled)
+    precise <- gets preciseRoots
+    types <- gets $ Map.size . customTypes
+    when isMain $ mapM_ emit (firstMainContent gcEnabled precise types)
 
     result <- exprToValue exp
 
@@ -155,6 +167,7 @@ compileScs (DBind bind : xs) = do
         else emit $ Ret t_return result
 
 
+    declareRoots entry
     emit DefineEnd
     -- Reset variable count and empty locals
     modify $ \s -> s { variableCount = 0, locals = mempty }
@@ -199,14 +212,18 @@ compileScs (DData (Data typ ts) : xs) = do
     compileScs xs
 
 -- | The first content of the main function
-firstMainContent :: Bool -> [LLVMIr]
-firstMainContent True =
+firstMainContent :: Bool -> Maybe Roots -> Int -> [LLVMIr]
+firstMainContent True precise types =
     [ -- UnsafeRaw "%prof = call ptr @cheap_the()\n"
       --     , UnsafeRaw "call void @cheap_set_profiler(ptr %prof, i1 true)\n"
       -- , UnsafeRaw "call void @cheap_profiler_log_options(ptr %prof, i64 30)\n"
       UnsafeRaw "call void @cheap_init()\n"
-    ]
-firstMainContent False = []
+    ] ++ case precise of
+        Just ShadowStack -> [UnsafeRaw "call void @cheap_set_precise_roots(i1 true)\n"]
+        Just FrameTable  -> [UnsafeRaw "call void @cheap_set_frame_roots(i1 true)\n"]
+        Nothing          -> []
+    ++ [ UnsafeRaw $ "call void @cheap_set_types(ptr @cheap_types, i64 " <> show types <> ")\n" | types > 0 ]
+firstMainContent False _ _ = []
 
 -- | The last content of the main function
 lastMainContent :: Bool -> [LLVMIr]
@@ -410,6 +427,7 @@ emitApp rt e1 e2 = do
 
     emit $ Comment $ show (type2LlvmType rt)
     emit $ SetVariable vs call
+    rootValue (type2LlvmType rt) (VIdent vs (type2LlvmType rt))
 
   where
 
@@ -486,6 +504,7 @@ exprToValue et@(e, t) = case e of
         Just (Function t_return [_], _) -> do
             vc <- getNewVar
             emit $ SetVariable vc (Call FastCC t_return Global name [(Ptr, VNull)])
+            rootValue t_return (VIdent vc t_return)
             pure $ VIdent vc t_return
 
         Just _ -> error "Bad"
@@ -496,6 +515,7 @@ exprToValue et@(e, t) = case e of
                 | numArgsCI == 0 -> do
                     vc <- getNewVar
                     emit $ SetVariable vc call
+                    rootValue (type2LlvmType t) (VIdent vc (type2LlvmType t))
                     pure $ VIdent vc (type2LlvmType t)
                 | otherwise -> pure $ VFunction name Global (type2LlvmType t)
                   where
@@ -537,6 +557,142 @@ exprToValue et@(e, t) = case e of
         pure $ VIdent (Ident $ show v) (getType et)
 
 
+{- | The garbage collector strategy of the functions. With precise roots
+  only the values in the root slots keep objects alive, which the GC
+  finds on LLVM's shadow stack or in the frame table of our "gc"
+  strategy.
+-}
+gcStrategy :: CompilerState (Maybe String)
+gcStrategy = gets $ \s -> case s.preciseRoots of
+    Just ShadowStack -> Just "shadow-stack"
+    Just FrameTable  -> Just "gc"
+    Nothing          -> Nothing
+
+{- | Roots a value that was returned from a call. The heap pointers of
+  a data value are spilled into root slots, which keep the objects alive
+  until the function returns. Values that are loaded from the fields of
+  a rooted value, or passed on as arguments, are reachable from a root
+  of this frame or the caller's and need no slots of their own.
+  Only named variables are used, since exprToValue relies on the count
+  of the numbered ones.
+-}
+rootValue :: LLVMType -> LLVMValue -> CompilerState ()
+rootValue t v@(VIdent (Ident x) _) = do
+    precise <- gets $ isJust . preciseRoots
+    offsets <- pointerOffsets t
+    size <- gets $ fromMaybe 0 . Map.lookup t . customTypes
+    let layout = Array ((size + 7) `div` 8) Ptr
+        spill  = Ident $ "root." <> x
+    when (precise && notNull offsets) $ do
+        emit $ SetVariable spill (Alloca layout)
+        emit $ Store t v Ptr spill
+        forM_ offsets $ \k -> do
+            let addr = Ident $ "root." <> x <> "." <> show k
+                word = Ident $ "root." <> x <> "." <> show k <> ".ptr"
+            emit . SetVariable addr
+                 $ GetElementPtrInbounds layout Ptr (VIdent spill Ptr)
+                   I64 (VInteger 0) I64 (VInteger $ k `div` 8)
+            emit $ SetVariable word (Load Ptr Ptr addr)
+            rootPointer (VIdent word Ptr)
+rootValue _ _ = pure ()
+
+-- | Stores a heap pointer in a root slot of the current function.
+rootPointer :: LLVMValue -> CompilerState ()
+rootPointer v@(VIdent (Ident x) _) = do
+    precise <- gets $ isJust . preciseRoots
+    when precise $ do
+        let slot = Ident $ "gcroot." <> x
+        modify $ \s -> s { gcRoots = snoc slot s.gcRoots }
+        emit $ Store Ptr v Ptr slot
+rootPointer _ = pure ()
+
+{- | Declares the root slots of the current function in its entry block,
+  which starts at the given instruction, as llvm.gcroot requires.
+-}
+declareRoots :: Int -> CompilerState ()
+declareRoots entry = do
+    slots <- gets gcRoots
+    let declare slot@(Ident x) =
+            [ SetVariable slot (Alloca Ptr)
+            , UnsafeRaw $ "call void @llvm.gcroot(ptr %" <> x <> ", ptr null)\n"
+            ]
+    unless (null slots) . modify $ \s ->
+        let (before, after) = splitAt entry s.instructions
+        in  s { instructions = before ++ concatMap declare slots ++ after }
+    modify $ \s -> s { gcRoots = mempty }
+
+{- | The byte offsets of the words of a data value that hold a heap
+  pointer in some constructor. A word that holds an integer in the
+  constructor of the value is not an object, and the GC skips it.
+-}
+pointerOffsets :: LLVMType -> CompilerState [Integer]
+pointerOffsets t = do
+    cTypes <- gets customTypes
+    cons <- gets $ Map.elems . constructors
+    pure $ if Map.member t cTypes
+        then nub $ concat [ constructorOffsets cTypes ci | ci <- cons, type2LlvmType ci.returnTypeCI == t ]
+        else []
+
+{- | The byte offsets of the heap pointers in a value of a constructor.
+  The constructors are laid out as { i8, fields.. } with the natural
+  alignment of the fields, where the fields of a data type are pointers.
+-}
+constructorOffsets :: Map.Map LLVMType Integer -> ConstructorInfo -> [Integer]
+constructorOffsets cTypes ci = go 1 (map (type2LlvmType . snd) ci.argumentsCI)
+  where
+    go _ [] = []
+    go off (f : fs)
+        | Map.member f cTypes = aligned 8 : go (aligned 8 + 8) fs
+        | otherwise           = go (aligned (align f) + align f) fs
+      where
+        aligned a = (off + a - 1) `div` a * a
+    align = \case
+        I1  -> 1
+        I8  -> 1
+        I16 -> 2
+        I32 -> 4
+        _   -> 8
+
+{- | The index of the layout of a data type that the GC was given with
+  cheap_set_types, or 0 for an object that the GC scans as a whole. The
+  GC only keeps the layouts of objects of at most 64 words.
+-}
+typeIndex :: LLVMType -> CompilerState Integer
+typeIndex t = gets $ \s -> case (Map.lookupIndex t s.customTypes, Map.lookup t s.customTypes) of
+    (Just i, Just size) | size <= 64 * 8 -> fromIntegral i + 1
+    _                                    -> 0
+
+{- | The layouts of the data types for the GC, one descriptor per type
+  with the number of constructors and a bitmap of the pointer words of
+  each constructor, in the order of typeIndex. The GC reads the index
+  of the constructor from the first byte of an object, and only scans
+  the words in its bitmap.
+-}
+typeLayouts :: CodeGenerator -> [LLVMIr]
+typeLayouts s
+    | Map.null s.customTypes = []
+    | otherwise = map layout types ++ [UnsafeRaw table]
+  where
+    types = Map.keys s.customTypes
+    layout t =
+        let cons    = Map.fromList [ (ci.numCI, ci) | ci <- Map.elems s.constructors
+                                                  , type2LlvmType ci.returnTypeCI == t ]
+            bitmap  = maybe 0 (foldl' setBit (0 :: Integer) . map fromIntegral . filter (< 64)
+                                . map (`div` 8) . constructorOffsets s.customTypes)
+            -- Word 63 is the sign bit of the i64
+            signed w = if w >= 2 ^ (63 :: Int) then w - 2 ^ (64 :: Int) else w
+            n       = maybe 0 fst (Map.lookupMax cons) + 1
+            words'  = [ signed $ bitmap (Map.lookup i cons) | i <- [0 .. n - 1] ]
+        in  UnsafeRaw $ concat
+                [ layoutName t, " = private constant { i64, [", show n, " x i64] } { i64 ", show n
+                , ", [", show n, " x i64] [", intercalate ", " (map (("i64 " <>) . show) words'), "] }\n"
+                ]
+    layoutName t = "@layout." <> drop 1 (toIr t)
+    table = concat
+        [ "@cheap_types = private constant [", show (length types), " x ptr] ["
+        , intercalate ", " (map (("ptr " <>) . layoutName) types), "]\n"
+        ]
+
 mkClosureName :: Ident -> Ident
 mkClosureName (Ident s) = Ident $ "Closure_" ++ s
 
@@ -121,7 +121,8 @@ type Args = [(LLVMType, LLVMValue)]
 -- | A datatype which represents different instructions in LLVM
 data LLVMIr
     = Type Ident [LLVMType]
-    | Define CallingConvention LLVMType Ident Params
+    | Define CallingConvention LLVMType Ident Params (Maybe String)
+    -- ^ The last field is the garbage collector strategy of the function
     | DefineEnd
     | Declare LLVMType Ident Params
     | SetVariable Ident LLVMIr
@@ -146,7 +147,7 @@ data LLVMIr
     | Ret LLVMType LLVMValue
     | Comment String
     | Malloc Integer
-    | GcMalloc Integer
+    | GcMalloc Integer Integer
     | UnsafeRaw String -- This should generally be avoided, and proper
     -- instructions should be used in its place
     deriving (Show, Eq, Ord)
@@ -211,11 +212,11 @@ llvmIrToString = go 0
                     , intercalate ", " (map toIr types)
                     , " }\n"
                     ]
-            (Define c t (Ident i) params) ->
+            (Define c t (Ident i) params strategy) ->
                 concat
                     [ "define ", toIr c, " ", toIr t, " @", i
                     , "(", intercalate ", " (map (\(Ident y, x) -> unwords [toIr x, "%" <> y]) params)
-                    , ") {\n"
+                    , ")", maybe "" gcAttributes strategy, " {\n"
                     ]
             DefineEnd -> "}\n"
             (Declare _t (Ident _i) _params) -> undefined
@@ -255,9 +256,9 @@ llvmIrToString = go 0
             (Malloc t) ->
                 concat
                     [ "call ptr @malloc(i64 ", show t, ")\n"]
-            (GcMalloc t) ->
+            (GcMalloc t idx) ->
                 concat
-                    [ "call ptr @cheap_alloc(i64 ", show t, ")\n"]
+                    [ "call ptr @cheap_alloc_inline(i64 ", show t, ", i64 ", show idx, ")\n"]
             (Store t1 val t2 (Ident id2)) ->
                 concat
                     [ "store ", toIr t1, " ", toIr val
@@ -295,5 +296,11 @@ llvmIrToString = go 0
             (Variable (Ident id)) -> "%" <> id
 {- FOURMOLU_ENABLE -}
 
+-- | The attributes of a function with a garbage collector strategy.
+--   The frame table of the "gc" strategy is walked by frame pointers.
+gcAttributes :: String -> String
+gcAttributes "gc" = " \"frame-pointer\"=\"all\" gc \"gc\""
+gcAttributes s    = " gc " <> show s
+
 lblPfx :: String
 lblPfx = "lbl_"
@@ -7,8 +7,8 @@ import           System.Process.Extra (readCreateProcess, shell)
 optimize :: String -> IO String
 optimize = readCreateProcess (shell "opt --O3 --tailcallopt -S")
 
-compileClang :: String -> Bool -> String -> IO String
-compileClang name False =
+compileClang :: String -> Bool -> Bool -> String -> IO String
+compileClang name False _ =
     readCreateProcess . shell $
         unwords
             [ "clang++" -- , "-Lsrc/GC/lib/", "-l:libgcoll.a"
@@ -19,26 +19,28 @@ compileClang name False =
             , "output/" <> name
             , "-"
             ]
-compileClang name True =
+-- The GC runtime is built once by `make runtime`, see src/GC/Makefile
+-- The frame table is printed by the "gc" strategy of the plugin, see
+-- src/Accurate_GC/Makefile
+compileClang name True frameTable =
     readCreateProcess . shell $
-        unwords
-            [ "clang++" -- , "-Lsrc/GC/lib/", "-l:libgcoll.a"
+        unwords $
+            [ "clang++"
             , "-fno-rtti"
-            , "src/GC/lib/cheap.cpp"
-            , "src/GC/lib/event.cpp"
-            , "src/GC/lib/heap.cpp"
-            , "src/GC/lib/profiler.cpp"
-            -- , "-Wall -Wextra -g -std=gnu++20 -stdlib=libstdc++"
-            , "-w -g -std=gnu++20 -stdlib=libstdc++"
+            , "-stdlib=libstdc++"
             , "-O3"
             --, "-tailcallopt"
-            , "-Isrc/GC/include"
             , "-x"
-            , "ir" -- , "-Lsrc/GC/lib -l:gcoll.a"
+            , "ir"
+            , "-"
+            , "-x"
+            , "none"
+            , "src/GC/lib/libgcoll.a"
+            , "-pthread"
             , "-o"
             , "output/" <> name
-            , "-"
             ]
+            ++ [ "-fplugin=src/Accurate_GC/gc.so" | frameTable ]
 
-compile :: String -> String -> Bool -> IO String
-compile name s addGc = optimize s >>= compileClang name addGc
+compile :: String -> String -> Bool -> Bool -> IO String
+compile name s addGc frameTable = optimize s >>= compileClang name addGc frameTable
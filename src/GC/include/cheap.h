@@ -20,15 +20,99 @@ struct cheap;
 typedef struct cheap cheap_t;
 #endif
 
+/*
+ * The layout of the objects of a type, see GC::TypeDescriptor.
+ * Bit k of pointers[v] is set if word k of an object of variant v
+ * holds a pointer, and the variant is the byte at the start of the
+ * object if there are several.
+ */
+typedef struct cheap_type
+{
+    unsigned long variants;
+    unsigned long pointers[];
+} cheap_type_t;
+
 #define FuncCallsOnly   0x1E
 #define ChunkOpsOnly    0x3E0
 
 cheap_t *cheap_the();
 void cheap_init();
 void cheap_dispose();
+void cheap_thread_attach();
+void cheap_thread_detach();
 void *cheap_alloc(unsigned long size);
+void *cheap_alloc_atomic(unsigned long size);
+void *cheap_alloc_typed(unsigned long size, unsigned long type);
+void cheap_set_types(const cheap_type_t *const *types, unsigned long count);
+void cheap_set_gc_percent(unsigned long percent);
+void cheap_set_mark_budget(unsigned long us);
+bool cheap_set_concurrent(bool mode);
+void cheap_set_lazy_sweep(bool mode);
+void cheap_set_generational(bool mode);
+void cheap_set_compact(bool mode);
+void cheap_set_immix(bool mode);
+void cheap_set_precise_roots(bool mode);
+void cheap_set_frame_roots(bool mode);
 void cheap_set_profiler(cheap_t *cheap, bool mode);
 void cheap_profiler_log_options(cheap_t *cheap, unsigned long flag);
+void cheap_profiler_trace(cheap_t *cheap, const char *path, bool mapped);
+
+#define CHEAP_HEADER_SIZE   8
+#define CHEAP_INLINE_MAX    64  // the largest chunk, with its header, of the fast path
+#define CHEAP_TYPE_SHIFT    50  // the position of the type in a header
+
+extern __thread char *cheap_alloc_cursor;
+extern __thread char *cheap_alloc_limit;
+
+/*
+ * Allocation fast path, which bumps the allocation buffer of
+ * the thread and only calls cheap_alloc() when the buffer is
+ * full. A small chunk is its size with the header, rounded
+ * up to 8 bytes, and its header is that size. For a constant
+ * size the compiler folds all of this into a few instructions.
+ * The header is written before the cursor moves past it, so a
+ * collection that stops the thread in between never finds a
+ * chunk without its header.
+ */
+static inline void *cheap_alloc_inline(unsigned long size)
+{
+    if (size > 0 && size + CHEAP_HEADER_SIZE <= CHEAP_INLINE_MAX)
+    {
+        unsigned long chunk_size = (size + CHEAP_HEADER_SIZE + 7) & ~7UL;
+        char *chunk = cheap_alloc_cursor;
+        // Also false for the empty buffer, where both are null
+        if (chunk_size <= (unsigned long)(cheap_alloc_limit - chunk))
+        {
+            *(unsigned long *)chunk = chunk_size;
+            __atomic_signal_fence(__ATOMIC_RELEASE);
+            cheap_alloc_cursor = chunk + chunk_size;
+            return chunk + CHEAP_HEADER_SIZE;
+        }
+    }
+    return cheap_alloc(size);
+}
+
+/*
+ * The fast path of cheap_alloc_typed(), whose header also
+ * holds the type. The type is not checked against the types
+ * registered with cheap_set_types() on this path.
+ */
+static inline void *cheap_alloc_typed_inline(unsigned long size, unsigned long type)
+{
+    if (size > 0 && size + CHEAP_HEADER_SIZE <= CHEAP_INLINE_MAX)
+    {
+        unsigned long chunk_size = (size + CHEAP_HEADER_SIZE + 7) & ~7UL;
+        char *chunk = cheap_alloc_cursor;
+        if (chunk_size <= (unsigned long)(cheap_alloc_limit - chunk))
+        {
+            *(unsigned long *)chunk = chunk_size | type << CHEAP_TYPE_SHIFT;
+            __atomic_signal_fence(__ATOMIC_RELEASE);
+            cheap_alloc_cursor = chunk + chunk_size;
+            return chunk + CHEAP_HEADER_SIZE;
+        }
+    }
+    return cheap_alloc_typed(size, type);
+}
 
 #ifdef __cplusplus
 }
@@ -6,11 +6,86 @@
 namespace GC
 {
     /**
-     * The basic element of what can be stored on
-     * the heap. A chunk contains a start address
-     * on the actual heap, the size of memory that
-     * is allocated at that address and if the
-     * chunk is reachable (marked).
+     * The header stored on the heap in front of every
+     * chunk. It contains the size of the chunk, which
+     * includes the header itself, a tag bit for free
+     * memory, a bit for objects without pointers,
+     * which are not scanned, and the index of the
+     * TypeDescriptor of a typed object, of which only the
+     * pointer words are scanned. The mark bits are kept in a bitmap on the
+     * side, see Heap. Since the chunks are laid out back
+     * to back, the size of a chunk is also the offset to
+     * the header of the next one.
+    */
+    struct Header
+    {
+        uint64_t m_size   : 48;
+        uint64_t m_free   : 1;    // the chunk is free memory, not an object
+        uint64_t m_atomic : 1;    // the object contains no pointers
+        uint64_t m_type   : 14;   // the type of the object, 0 if every word is scanned
+
+        /**
+         * @returns The address of the object stored
+         *          after the header.
+        */
+        uintptr_t *payload()
+        {
+            return reinterpret_cast<uintptr_t *>(this + 1);
+        }
+
+        /**
+         * @returns The header of the chunk following
+         *          this one on the heap.
+        */
+        Header *next()
+        {
+            return reinterpret_cast<Header *>(reinterpret_cast<char *>(this) + m_size);
+        }
+
+        /**
+         * @returns The header of the object at addr.
+        */
+        static Header *of(uintptr_t addr)
+        {
+            return reinterpret_cast<Header *>(addr) - 1;
+        }
+    };
+
+    static_assert(sizeof(Header) == 8);
+
+    /**
+     * The layout of the objects of a type, which tells
+     * the words of an object that hold pointers from
+     * those that hold numbers. A type with several
+     * variants, like the constructors of a churf data
+     * type, has a map for each, and its objects start
+     * with a tag byte that is the index of their variant.
+     * A map covers the first 64 words of an object.
+    */
+    struct TypeDescriptor
+    {
+        uint64_t m_variants;        // the number of maps
+        uint64_t m_pointers[0];     // a bit per word that holds a pointer, for every variant
+    };
+
+    /**
+     * A chunk in the large object space, which is a
+     * mapping of its own with the header at its start.
+     * The mark bit is kept here, since a large chunk
+     * has no bits in the bitmaps of the heap.
+    */
+    struct LargeChunk
+    {
+        Header *m_header;
+        bool m_marked {false};
+    };
+
+    /**
+     * A copy of the information about a chunk on the
+     * heap, as it is recorded by the profiler. It
+     * contains the start address of the object, the
+     * size of memory that is allocated at that address
+     * and if the chunk is reachable (marked).
     */
     struct Chunk
     {
@@ -19,7 +94,8 @@ namespace GC
         const size_t m_size {0};
 
         Chunk(size_t size, uintptr_t *start) : m_start(start), m_size(size) {}
+        Chunk(Header *h) : m_start(h->payload()), m_size(h->m_size - sizeof(Header)) {}
         Chunk(const Chunk *const c) : m_marked(c->m_marked), m_start(c->m_start), m_size(c->m_size) {}
         Chunk(const Chunk &c) : m_marked(c.m_marked), m_start(c.m_start), m_size(c.m_size) {}
     };
-}
\ No newline at end of file
+}
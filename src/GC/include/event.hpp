@@ -1,8 +1,10 @@
 #pragma once
 
-#include <ctime>
+#include <atomic>
+#include <stdint.h>
+#include <type_traits>
 
-#include "chunk.hpp"
+#define EVENT_RING_SIZE (1 << 16)   // events the profiler keeps, a power of two
 
 namespace GC
 {
@@ -22,34 +24,98 @@ namespace GC
         NewChunk        = 1 << 8,
         ReusedChunk     = 1 << 9,
         ProfilerDispose = 1 << 10,
-        FreeStart       = 1 << 11
+        FreeStart       = 1 << 11,
+        RootScan        = 1 << 12
     };
 
     /**
-     * Stores metadeta about an event on the heap.
+     * Stores metadeta about an event on the heap: the
+     * nanoseconds of the steady clock at which it
+     * happened, the address and size of the chunk it is
+     * about, or the size requested from alloc() for an
+     * AllocStart event, and its type. It is plain old
+     * data, so that recording an event is a copy of three
+     * words into the ring buffer of the profiler.
     */
-    class GCEvent
+    struct GCEvent
+    {
+        uint64_t m_time;
+        uintptr_t m_address;
+        uint64_t m_size : 48;
+        uint64_t m_type : 16;
+
+        GCEventType get_type() const { return GCEventType(m_type); }
+        const char *type_to_string() const;
+    };
+
+    static_assert(sizeof(GCEvent) == 24);
+    static_assert(std::is_trivial_v<GCEvent>);
+
+    /**
+     * A ring buffer of the last EVENT_RING_SIZE events,
+     * which is mapped once and never grows. It is only
+     * written by the thread that holds the heap lock, so
+     * pushing an event is a store of the record and of the
+     * count, without a lock or a read-modify-write. Once
+     * it is full the oldest events are overwritten, and
+     * counted as lost.
+    */
+    class EventRing
     {
     private:
-        const GCEventType m_type;
-        const std::time_t m_timestamp {std::time(NULL)};
-        const Chunk *m_chunk {nullptr};
-        const size_t m_size {0};
+        GCEvent *m_events;
+        std::atomic<uint64_t> m_written {0};    // events pushed since the start
 
     public:
-        GCEvent(GCEventType type) : m_type(type) {}
-        GCEvent(GCEventType type, Chunk *chunk) : m_type(type), m_chunk(chunk) {}
-        GCEvent(GCEventType type, size_t size) : m_type(type), m_size(size) {}
+        EventRing();
+        ~EventRing();
+
+        EventRing(EventRing const&) = delete;
+        EventRing& operator=(EventRing const&) = delete;
 
-        ~GCEvent() {
-            if (m_chunk != nullptr)
-                delete m_chunk;
+        void push(const GCEvent &event)
+        {
+            uint64_t written = m_written.load(std::memory_order_relaxed);
+            m_events[written & (EVENT_RING_SIZE - 1)] = event;
+            m_written.store(written + 1, std::memory_order_release);
         }
 
-        GCEventType get_type();
-        std::time_t get_time_stamp();
-        const Chunk *get_chunk();
-        size_t get_size();
-        const char *type_to_string();
+        /**
+         * @returns The number of events pushed since
+         *          the start, including the lost ones.
+        */
+        uint64_t written() const
+        {
+            return m_written.load(std::memory_order_acquire);
+        }
+
+        /**
+         * @returns The number of events that have been
+         *          overwritten by newer ones.
+        */
+        uint64_t lost() const
+        {
+            uint64_t written = this->written();
+            return written > EVENT_RING_SIZE ? written - EVENT_RING_SIZE : 0;
+        }
+
+        /**
+         * @returns The number of events kept.
+        */
+        uint64_t size() const
+        {
+            return written() - lost();
+        }
+
+        /**
+         * @param i The index of an event among the ones
+         *          kept, 0 being the oldest.
+         *
+         * @returns The event.
+        */
+        const GCEvent &operator[](uint64_t i) const
+        {
+            return m_events[(lost() + i) & (EVENT_RING_SIZE - 1)];
+        }
     };
-}
\ No newline at end of file
+}
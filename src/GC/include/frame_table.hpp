@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * The frame table that the "gc" strategy in src/Accurate_GC prints
+ * into the section churf_frametable of every object it compiles.
+ * The linker concatenates the sections and defines their bounds.
+ */
+extern "C"
+{
+    /**
+     * The roots of a frame at one safe point, which is
+     * the address that a call of the function returns
+     * to. The roots are the gcroot slots of the frame,
+     * at offsets from its frame pointer. Descriptors
+     * are padded to 8 bytes.
+    */
+    struct FrameDescriptor
+    {
+        uintptr_t ReturnAddress;    // the address after the call
+        uint32_t NumRoots;          // number of roots in the frame
+        int32_t Offsets[0];         // the offsets of the roots
+    };
+
+    // The bounds of the table. They are null in a program where
+    // nothing was compiled with gc "gc".
+    extern const char __start_churf_frametable[] __attribute__((weak));
+    extern const char __stop_churf_frametable[] __attribute__((weak));
+}
@@ -1,18 +1,55 @@
 #pragma once
 
-#include <list>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
 #include <stdlib.h>
+#include <thread>
 #include <vector>
-#include <unordered_map>
 #include <queue>
+#include <semaphore.h>
 
 #include "chunk.hpp"
+#include "frame_table.hpp"
 #include "profiler.hpp"
+#include "shadow_stack.hpp"
+#include "size_class.hpp"
+#include "work_deque.hpp"
 
-#define HEAP_SIZE 160000//65536
-#define FREE_THRESH (uint) 5
+#define HEAP_RESERVE	((size_t)1 << 36)	// 64 GB of address space
+#define HEAP_RESERVE_MIN	((size_t)1 << 26)	// 64 MB, lower bound when shrinking the reservation
+#define SEGMENT_SIZE	((size_t)1 << 20)	// 1 MB, commit granularity
+#define MIN_FREE_CHUNK	(2 * sizeof(Header))	// a header and the free list link
+#define GRANULE_SIZE	sizeof(Header)	// heap bytes per bit in the bitmaps
+#define MEDIUM_CHUNK_MIN	((size_t)1 << 10)	// 1 KB, larger chunks are fitted from m_free_tree
+#define LARGE_CHUNK_MIN	((size_t)1 << 13)	// 8 KB, larger requests get a mapping of their own
+#define RELEASE_MIN		((size_t)1 << 16)	// 64 KB, free runs with this many bytes of whole pages release them
+#define BUFFER_MAX		((size_t)1 << 16)	// 64 KB, the largest allocation buffer of a thread
+#define GC_PERCENT		100					// default growth of the heap over the live data before a collection
+#define GC_TRIGGER_MIN	((size_t)1 << 22)	// 4 MB, the heap size below which no collection is triggered
+#define NURSERY_SIZE	((size_t)1 << 23)	// 8 MB, the bytes allocated between two minor collections
+#define MARK_STEP		512					// words of an object scanned before the rest is queued again
+#define MARK_CLOCK_WORDS	4096			// words scanned between looks at the clock of a mark slice
+#define MARK_THREADS_MAX	((size_t)64)	// the most threads of a parallel mark
+#define SWEEP_STEP		((size_t)1 << 18)	// 256 KB, the heap swept by a lazy sweep step
+#define TYPES_MAX		((size_t)1 << 14)	// type indices that fit in a header, 0 means untyped
+#define TYPE_WORDS_MAX	64					// words of an object that a TypeDescriptor covers
+#define TYPED_RANGE		((uintptr_t)1)		// tags a gray range that ends with a pointer map
+#define LINE_SIZE		((size_t)1 << 7)	// 128 B, the unit that an Immix heap reclaims
+#define BLOCK_SIZE		((size_t)1 << 15)	// 32 KB, the unit that an Immix heap evacuates
+#define LINES_PER_BLOCK	(BLOCK_SIZE / LINE_SIZE)
 // #define HEAP_DEBUG
 
+extern "C"
+{
+	// The allocation buffer of the thread that the inline fast
+	// path in cheap.h bumps, empty when both are nullptr
+	extern __thread char *cheap_alloc_cursor;
+	extern __thread char *cheap_alloc_limit;
+}
+
 namespace GC
 {
 	/**
@@ -27,79 +64,460 @@ namespace GC
 		COLLECT_ALL	= 0b1111 // all flags above
 	};
 
-	struct AddrRange
+	/**
+	 * A thread that is attached to the heap, with the
+	 * bounds of its stack, its shadow stack and its
+	 * allocation buffer. The
+	 * chunks that the thread allocates in the buffer are
+	 * registered from m_buffer on, by the thread itself
+	 * when the buffer is full or by the collector while
+	 * the thread is stopped. Until then the rest of the
+	 * buffer up to m_buffer_end belongs to the thread.
+	*/
+	struct Mutator
 	{
-		const uintptr_t *start, *end;
-
-		AddrRange(uintptr_t *_start, uintptr_t *_end) : start(_start), end(_end) {}
+		pthread_t m_thread;
+		uintptr_t *m_stack_top;
+		uintptr_t *m_stack_bottom {nullptr};	// where the stack ended when the thread was stopped
+		char **m_cursor;	// the cheap_alloc_cursor of the thread
+		char **m_limit;		// the cheap_alloc_limit of the thread
+		StackEntry **m_root_chain;	// the llvm_gc_root_chain of the thread
+		char *m_buffer {nullptr};
+		char *m_buffer_end {nullptr};
+		uintptr_t *m_frame {nullptr};	// the frame of cheap_alloc while compiled code allocates
 	};
 
 	/**
 	 * The heap class to represent the heap for the
 	 * garbage collection. The heap is a singleton
 	 * instance and can be retrieved by Heap::the()
-	 * inside the heap class. The heap is represented
-	 * by a char array of size 65536 and can enable
-	 * a profiler to track the actions on the heap.
+	 * inside the heap class. It is a large reserved
+	 * range of virtual memory, committed in segments as
+	 * live data grows, with bitmaps of the chunk starts
+	 * and marks next to it. The collection modes are
+	 * described at their members and in docs/lib/cheap.md.
 	*/
 	class Heap
 	{
 	private:
-		Heap() : m_heap(static_cast<char *>(malloc(HEAP_SIZE))) {}
+		Heap();
+		~Heap();
 
-		~Heap()
-		{
-			std::free((char *)m_heap);
-		}
-
-		char *const m_heap;
-		size_t m_size {0};
+		char *m_heap {nullptr};
+		size_t m_reserved {0};	// bytes of address space reserved at m_heap
+		size_t m_committed {0};	// bytes at m_heap backed by memory
+		size_t m_top {0};		// bump offset, everything below has been handed out
+		size_t m_size {0};		// bytes currently allocated to chunks
 		// static Heap *m_instance {nullptr};
-		uintptr_t *m_stack_top {nullptr};
 		bool m_profiler_enable {false};
 
-		std::vector<Chunk *> m_allocated_chunks;
-		std::vector<Chunk *> m_freed_chunks;
-		std::list<Chunk *> m_free_list;
-		std::unordered_map<uintptr_t, Chunk*> m_chunk_table;
+		// The attached threads, and the stop of the other
+		// threads by a collection, which each of them
+		// acknowledges on m_ack when it stops and resumes.
+		// Each thread bumps small objects from a buffer of its
+		// own, which is cut from the free memory under m_lock.
+		std::mutex m_lock;	// guards the heap in the slow paths
+		std::vector<Mutator *> m_mutators;
+		std::atomic<bool> m_world_stopped {false};
+		sem_t m_ack;
+		// With precise roots the stacks are not scanned. The roots
+		// are the slots of the shadow stacks that code compiled
+		// with gc "shadow-stack" keeps, or with frame table roots
+		// the slots that the table of code compiled with gc "gc"
+		// gives for the frames of a thread in cheap_alloc, found
+		// by their return addresses
+		bool m_precise_roots {false};	// the roots are on the shadow stacks
+		bool m_frame_roots {false};		// the roots are found in the frame table
+		std::vector<const TypeDescriptor *> m_types {nullptr};	// by the type index in a header
+		std::vector<const FrameDescriptor *> m_frame_table;	// sorted by return address
+
+		// The bitmaps have a bit per granule of the heap. Which
+		// value of a mark bit means marked alternates between
+		// collections, so the survivors of one read as unmarked
+		// in the next without being cleared
+		uint64_t *m_start_bits {nullptr};	// a bit per granule where a chunk starts
+		uint64_t *m_mark_bits {nullptr};	// the mark bits of the chunks
+		uint64_t *m_pin_bits {nullptr};		// a bit per chunk that must not move
+		uint8_t *m_line_marks {nullptr};	// a byte per line that a marked chunk covers
+		bool m_mark_epoch {true};			// the value of a mark bit that means marked
+
+		// Large chunks by the address of their object, the bounds
+		// of all large objects and the bytes mapped for them.
+		// Requests of LARGE_CHUNK_MIN bytes or more are mapped
+		// one by one instead of placed on the heap.
+		std::map<uintptr_t, LargeChunk> m_large_chunks;
+		uintptr_t m_large_min {UINTPTR_MAX};
+		uintptr_t m_large_max {0};
+		size_t m_large_size {0};
+
+		// Pacing, the bytes that survived the last collection
+		// and the allocated bytes that trigger the next one,
+		// m_gc_percent percent past the survivors but not below
+		// GC_TRIGGER_MIN
+		size_t m_gc_percent {GC_PERCENT};
+		size_t m_live {0};
+		size_t m_next_gc {GC_TRIGGER_MIN};
+
+		// Generational collection, whether the marks of the last
+		// collection were kept, whether the current one is minor,
+		// the heap bytes that survived the last one and the live
+		// bytes at which the next collection is major. The marks
+		// of the survivors are sticky, so a minor collection every
+		// NURSERY_SIZE bytes stops at them and only traces and
+		// sweeps the young chunks. Objects are not changed after
+		// they are initialised, so no old one points to a young
+		// one and no write barrier is needed.
+		bool m_generational {false};
+		bool m_sticky {false};
+		bool m_minor {false};
+		size_t m_old_size {0};
+		size_t m_major_target {GC_TRIGGER_MIN};
+
+		// Compaction, and whether the current mark pins the chunks
+		// that ambiguous words point to: roots and the words of
+		// untyped and large objects. The other marked chunks are
+		// slid down past the pinned ones and their typed pointers
+		// updated, which leaves the free memory at the top.
+		bool m_compact {false};
+		bool m_pinning {false};
+
+		// Immix mode, whether the current cycle marks lines, the
+		// free line runs in address order with the next one to
+		// allocate from and the next one for chunks larger than
+		// a line, and the blocks to evacuate. A run used up by
+		// such a chunk is left as a nullptr. The sweep frees the
+		// runs of unmarked lines from the line table alone, and
+		// with compaction the blocks with the most holes are
+		// evacuated into the free lines of the others.
+		bool m_immix {false};
+		bool m_marking_lines {false};
+		std::vector<Header *> m_line_holes;
+		size_t m_next_hole {0};
+		size_t m_overflow_hole {0};
+		std::vector<bool> m_evacuate;
+
+		// Incremental marking, the gray ranges of objects still to
+		// be scanned and the time a mark slice may take, where zero
+		// means that the whole mark is done at once. A slice runs
+		// on every slow path allocation, and chunks allocated
+		// meanwhile are marked, which keeps the snapshot at the
+		// start without a write barrier.
+		// A gray range of a typed object is its tagged payload
+		// and the map of its pointer words instead of its end
+		std::queue<std::pair<uintptr_t, uintptr_t>> m_worklist;
+		bool m_marking {false};
+		std::chrono::microseconds m_mark_budget {0};
+		size_t m_cycle_allocated {0};
+
+		// Concurrent marking, if soft-dirty bits are supported,
+		// and the marker thread of the current collection. The
+		// marked objects on the pages that the program wrote
+		// meanwhile are scanned again when it next stops.
+		bool m_concurrent {false};
+		bool m_marker_running {false};
+		bool m_atomic_bits {false};	// more than one thread changes the bitmaps
+		std::atomic<bool> m_marker_done {false};
+		std::thread m_marker;
+		std::mutex m_large_lock;	// guards m_large_chunks while the marker runs
+
+		// The threads that drain the worklist of a mark at once,
+		// which steal ranges from each other
+		size_t m_mark_threads {1};
+
+		// The bytes of the heap chunks marked by the current
+		// mark, and the bytes on the heap when it started
+		size_t m_marked_bytes {0};
+		size_t m_cycle_size {0};
+
+		// Lazy sweeping, the granule up to which the heap has
+		// been swept and the end of the part to sweep. The heap
+		// is swept SWEEP_STEP bytes at a time when an allocation
+		// finds no free chunk, and the mark bits flip at the end.
+		bool m_lazy_sweep {false};
+		bool m_sweeping {false};
+		size_t m_sweep_cursor {0};
+		size_t m_sweep_top {0};
+
+		// Free runs found by the sweep phase, to be freed
+		std::vector<Header *> m_freed_chunks;
+		// The medium free chunks by size and then by address, for
+		// address-ordered best fit
+		std::set<std::pair<size_t, Header *>> m_free_tree;
+		// One free list per size class, threaded through the
+		// free chunks, and a bit per class that is set if its
+		// list is not empty
+		Header *m_free_lists[NUM_SIZE_CLASSES] {};
+		uint64_t m_free_mask[NUM_SIZE_CLASSES / 64] {};
 
 		static bool profiler_enabled();
-		// static Chunk *get_at(std::vector<Chunk *> &list, size_t n);
+		static void *allocate(size_t size, bool atomic, uint16_t type);
+		void *alloc_large(size_t size, bool atomic);
+		void set_buffer(char *start, char *end);
+		bool take_buffer(size_t size);
+		void *bump_buffer(size_t size, bool atomic, uint16_t type);
+		void flush_buffer(Mutator &mutator);
+		void retire_buffer();
+		void stop_world();
+		void start_world();
+		static void suspend_handler(int signal);
+		static void resume_handler(int signal);
+		void grow(size_t size);
+		void pace(size_t allocated);
+		void clear_marks();
+		std::vector<std::pair<size_t, size_t>> buffer_holes() const;
+		void compact();
+		void evacuate();
+		void move_chunks(const std::vector<std::pair<Header *, Header *>> &moves);
+		void mark_buffer_lines();
+		void sweep_lines();
+		void select_evacuation(const std::vector<std::pair<size_t, size_t>> &blocks, size_t free_lines);
+		Header *take_line_hole(size_t size);
+		Header *take_overflow_hole(size_t size);
+		Header *cut_line_hole(size_t index, size_t size);
+
+		/**
+		 * @returns The bytes allocated on the heap and in
+		 *          large objects, not counting the chunks in
+		 *          the allocation buffer.
+		 */
+		inline size_t allocated() const
+		{
+			return m_size + m_large_size;
+		}
+
+		/**
+		 * Checks if an address points into the part of the
+		 * heap that has been handed out. The segments are
+		 * committed contiguously from m_heap, so this is a
+		 * single compare no matter how many segments the
+		 * heap has grown to.
+		 */
+		inline bool contains(uintptr_t addr) const
+		{
+			return addr - reinterpret_cast<uintptr_t>(m_heap) < m_top;
+		}
+
+		/**
+		 * @returns The amount of bytes of a bitmap
+		 *          for size bytes of the heap.
+		 */
+		static constexpr size_t bitmap_size(size_t size)
+		{
+			return size / GRANULE_SIZE / 8;
+		}
+
+		/**
+		 * @returns The amount of bytes of the line table
+		 *          for size bytes of the heap.
+		 */
+		static constexpr size_t line_table_size(size_t size)
+		{
+			return size / LINE_SIZE;
+		}
+
+		/**
+		 * Marks the lines that a chunk covers. Threads that
+		 * mark at the same time only ever set line bytes,
+		 * so a line is stored once it is found unmarked.
+		 */
+		inline void mark_lines(const Header *chunk)
+		{
+			auto start = reinterpret_cast<const char *>(chunk) - m_heap;
+			for (size_t l = start / LINE_SIZE; l <= (start + chunk->m_size - 1) / LINE_SIZE; l++)
+				if (!__atomic_load_n(m_line_marks + l, __ATOMIC_RELAXED))
+					__atomic_store_n(m_line_marks + l, 1, __ATOMIC_RELAXED);
+		}
+
+		inline size_t granule(const Header *chunk) const
+		{
+			return (reinterpret_cast<const char *>(chunk) - m_heap) / GRANULE_SIZE;
+		}
+
+		inline bool is_pinned(size_t g) const
+		{
+			return (m_pin_bits[g / 64] >> (g % 64)) & 1;
+		}
+
+		/**
+		 * Pins a chunk, atomically if several threads mark.
+		 */
+		inline void pin(size_t g)
+		{
+			if (is_pinned(g))
+				return;
+			uint64_t bit = (uint64_t)1 << (g % 64);
+			if (m_atomic_bits)
+				__atomic_fetch_or(m_pin_bits + g / 64, bit, __ATOMIC_RELAXED);
+			else
+				m_pin_bits[g / 64] |= bit;
+		}
+
+		inline bool is_marked(const Header *chunk) const
+		{
+			size_t g = granule(chunk);
+			return ((m_mark_bits[g / 64] >> (g % 64)) & 1) == m_mark_epoch;
+		}
+
+		/**
+		 * Sets or clears a mark bit. While the marker thread
+		 * or a parallel mark runs, several threads change
+		 * bits in the same words, so the bits are changed
+		 * atomically.
+		 */
+		inline void set_mark(size_t g, bool value)
+		{
+			uint64_t bit = (uint64_t)1 << (g % 64);
+			uint64_t *word = m_mark_bits + g / 64;
+			if (m_atomic_bits)
+				value ? __atomic_fetch_or(word, bit, __ATOMIC_RELAXED) : __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+			else
+				*word = value ? *word | bit : *word & ~bit;
+		}
+
+		/**
+		 * Registers a new chunk in the bitmaps, with its
+		 * mark bit unmarked and its start bit set. The start
+		 * bit is set last, so that the marker thread never
+		 * finds a chunk before its header is written. While
+		 * the heap is swept lazily the flip of the mark bits
+		 * is still to come, so the bit is set to what reads
+		 * as unmarked after it, unless the marks are sticky.
+		 */
+		inline void set_start(Header *chunk)
+		{
+			size_t g = granule(chunk);
+			uint64_t bit = (uint64_t)1 << (g % 64);
+			set_mark(g, m_sweeping && !m_sticky ? m_mark_epoch : !m_mark_epoch);
+			if (m_atomic_bits)
+				__atomic_fetch_or(m_start_bits + g / 64, bit, __ATOMIC_RELEASE);
+			else
+				m_start_bits[g / 64] |= bit;
+		}
+
+		/**
+		 * Marks a chunk unless it is marked already, with
+		 * an atomic test-and-set if several threads mark.
+		 *
+		 * @returns True if this call marked the chunk.
+		 */
+		inline bool try_mark(size_t g)
+		{
+			// A relaxed load is a plain one, but tells the compiler
+			// that other threads may change the word
+			if (((__atomic_load_n(m_mark_bits + g / 64, __ATOMIC_RELAXED) >> (g % 64)) & 1) == m_mark_epoch)
+				return false;
+			if (!m_atomic_bits)
+			{
+				set_mark(g, m_mark_epoch);
+				return true;
+			}
+			uint64_t bit = (uint64_t)1 << (g % 64);
+			uint64_t *word = m_mark_bits + g / 64;
+			uint64_t old = m_mark_epoch ? __atomic_fetch_or(word, bit, __ATOMIC_RELAXED) : __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+			return ((old >> (g % 64)) & 1) != m_mark_epoch;
+		}
+
+		/**
+		 * Registers a newly allocated chunk in the bitmaps.
+		 * The chunk, and its lines in Immix mode, are marked
+		 * if a mark is in progress, so that it survives the
+		 * collection.
+		 */
+		inline void set_allocated(Header *chunk)
+		{
+			set_start(chunk);
+			if (!m_marking)
+				return;
+			set_mark(granule(chunk), m_mark_epoch);
+			if (m_marking_lines)
+				mark_lines(chunk);
+		}
+
+		/**
+		 * @returns The bits of the live chunks, the ones
+		 *          that start and are marked, in a word
+		 *          of the bitmaps.
+		 */
+		inline uint64_t live_bits(size_t w) const
+		{
+			return m_start_bits[w] & (m_mark_epoch ? m_mark_bits[w] : ~m_mark_bits[w]);
+		}
+
+		Header *chunk_at(uintptr_t addr) const;
+		Header *find_enclosing(uintptr_t addr) const;
+		size_t next_live_word(size_t from, size_t to) const;
+		static void clear_bits(uint64_t *bits, size_t from, size_t to);
+		Header *sweep_run(size_t from, size_t to);
+		void sweep_large();
 		void collect(uintptr_t *stack_bottom);
 		void sweep(Heap &heap);
-		Chunk *try_recycle_chunks(size_t size);
+		bool sweep_chunks(size_t limit, size_t &live_size);
+		void sweep_step(size_t limit);
+		void finish_sweep();
+		void clear_free();
+		Header *try_recycle_chunks(size_t size);
+		size_t next_free_class(size_t cls);
+		void push_free(Header *chunk);
+		Header *pop_free(size_t cls);
 		void free(Heap &heap);
-		void free_overlap(Heap &heap);
-		void mark_hash(uintptr_t *start, const uintptr_t *end);
-		Chunk* find_pointer_hash(uintptr_t *start, const uintptr_t *end);
-		void create_table();
-		void print_line(Chunk *chunk);
-		void print_worklist(std::vector<Chunk *> &list);
-		void mark_step(uintptr_t start, uintptr_t end, std::vector<Chunk *> &worklist);
-		void mark_range(std::vector<AddrRange *> &ranges, std::vector<Chunk *> &worklist);
+		void release(char *from, char *to);
 
 		void find_roots(uintptr_t *stack_bottom, std::vector<uintptr_t *> &roots);
+		void scan_stack(uintptr_t *bottom, uintptr_t *top, std::vector<uintptr_t *> &roots);
+		void visit_gc_roots(StackEntry *chain, std::vector<uintptr_t *> &roots);
+		void walk_frames(uintptr_t *frame, uintptr_t *top, std::vector<uintptr_t *> &roots);
+		const FrameDescriptor *find_frame(uintptr_t return_address);
 		void mark(std::vector<uintptr_t *> &roots);
-		void find_chunks(uintptr_t *stack_addr, std::queue<std::pair<uintptr_t, uintptr_t>> &chunk_spaces);
-
-		// Temporary
-		Chunk *try_recycle_chunks_new(size_t size);
-		void free_overlap_new(Heap &heap);
+		bool mark_slice(std::chrono::microseconds budget);
+		void finish_collect();
+		void parallel_mark();
+		void mark_worker(size_t id, std::vector<std::unique_ptr<WorkDeque>> &deques, std::atomic<size_t> &idle, std::atomic<size_t> &marked);
+		void start_marker();
+		void remark(uintptr_t *stack_bottom);
+		void rescan_dirty(int pagemap, char *from, char *to);
+		void rescan(char *from, char *to);
+		static bool clear_soft_dirty();
+		static bool soft_dirty_supported();
+		void find_chunks(uintptr_t *stack_addr, std::queue<std::pair<uintptr_t, uintptr_t>> &chunk_spaces, bool ambiguous);
+		bool grey(uintptr_t addr, WorkDeque::Range &range, size_t &marked, bool ambiguous);
+		bool pointer_map(const Header *chunk, uint64_t &pointers) const;
+		bool find_large_chunk(uintptr_t addr, WorkDeque::Range &range);
 	public:
 		/**
-		 * These are the only five functions which are exposed
+		 * These are the only functions which are exposed
 		 * as the API for LLVM. At the absolute start of the
 		 * program the developer has to call init() to ensure
 		 * that the address of the topmost stack frame is
 		 * saved as the limit for scanning the stack in collect.
+		 * Every other thread that allocates or holds objects
+		 * has to call attach_thread() first, and
+		 * detach_thread() before it exits.
 		 */
 
 		static Heap &the();
 		static void init();
 		static void dispose();
+		static void attach_thread();
+		static void detach_thread();
 		static void *alloc(size_t size);
+		static void *alloc_atomic(size_t size);
+		static void *alloc_from_frame(size_t size, uint16_t type, void *frame);
+		static void *alloc_typed(size_t size, uint16_t type);
+		static void set_types(const TypeDescriptor *const *types, size_t count);
+		static void set_gc_percent(size_t percent);
+		static void set_mark_budget(size_t us);
+		static bool set_concurrent(bool mode);
+		static void set_mark_threads(size_t threads);
+		static void set_lazy_sweep(bool mode);
+		static void set_generational(bool mode);
+		static void set_compact(bool mode);
+		static void set_immix(bool mode);
+		static void set_precise_roots(bool mode);
+		static void set_frame_roots(bool mode);
+		static size_t footprint();
 		void set_profiler(bool mode);
 		void set_profiler_log_options(RecordOption flags);
+		void set_profiler_trace(const char *path, bool mapped);
 
 		// Stop the compiler from generating copy-methods
 		Heap(Heap const&) = delete;
@@ -109,7 +527,8 @@ namespace GC
 		void collect(CollectOption flags); // conditional collection
 		void check_init();		  // print dummy things
 		void print_contents();	  // print dummy things
-		void print_allocated_chunks(Heap *heap); // print the contents in m_allocated_chunks
+		void print_line(Header *chunk);
+		void print_allocated_chunks(Heap *heap); // print the allocated chunks in address order
 		void print_summary();
 #endif
 	};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS  5   // the buckets of a power of two are 2^HISTOGRAM_SUB_BITS
+#define HISTOGRAM_BUCKETS   ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+namespace GC
+{
+    /**
+     * A log-linear histogram in the style of HdrHistogram,
+     * which counts values of any size in fixed memory with
+     * a bounded relative error. Every power of two is split
+     * into 2^HISTOGRAM_SUB_BITS buckets of equal width, so a
+     * value is known to within 1/32 of itself, and the
+     * values below 32 are counted exactly. Recording a value
+     * is a count leading zeros, a shift and an increment.
+    */
+    class Histogram
+    {
+    private:
+        uint64_t m_counts[HISTOGRAM_BUCKETS] {};
+        uint64_t m_count {0};
+        uint64_t m_total {0};
+        uint64_t m_min {UINT64_MAX};
+        uint64_t m_max {0};
+
+    public:
+        /**
+         * @returns The bucket that counts a value.
+        */
+        static size_t bucket(uint64_t value)
+        {
+            if (value < (1 << HISTOGRAM_SUB_BITS))
+                return value;
+            int exponent = 63 - __builtin_clzll(value);
+            int shift = exponent - HISTOGRAM_SUB_BITS;
+            size_t sub = (value >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+            return ((shift + 1) << HISTOGRAM_SUB_BITS) + sub;
+        }
+
+        /**
+         * @returns The smallest value counted by a bucket.
+        */
+        static uint64_t lowest(size_t bucket)
+        {
+            if (bucket < (1 << HISTOGRAM_SUB_BITS))
+                return bucket;
+            int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+            uint64_t sub = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+            return ((1ULL << HISTOGRAM_SUB_BITS) + sub) << shift;
+        }
+
+        /**
+         * @returns The largest value counted by a bucket.
+        */
+        static uint64_t highest(size_t bucket)
+        {
+            if (bucket < (1 << HISTOGRAM_SUB_BITS))
+                return bucket;
+            int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+            return lowest(bucket) + (1ULL << shift) - 1;
+        }
+
+        void record(uint64_t value)
+        {
+            record(value, 1);
+        }
+
+        /**
+         * Records the same value a number of times at the
+         * cost of recording it once.
+        */
+        void record(uint64_t value, uint64_t times)
+        {
+            m_counts[bucket(value)] += times;
+            m_count += times;
+            m_total += value * times;
+            m_min = std::min(m_min, value);
+            m_max = std::max(m_max, value);
+        }
+
+        /**
+         * @param percent   The percentile, from 0 to 100.
+         *
+         * @returns The largest value of the bucket that
+         *          the percentile falls in, but at most
+         *          the largest value recorded, or 0 if
+         *          nothing is recorded.
+        */
+        uint64_t percentile(double percent) const
+        {
+            // The rank of the value, from 1
+            uint64_t rank = std::max<uint64_t>(1, uint64_t(percent / 100 * m_count + 0.5));
+            uint64_t seen = 0;
+            for (size_t b = 0; b < HISTOGRAM_BUCKETS && m_count > 0; b++)
+            {
+                seen += m_counts[b];
+                if (seen >= rank)
+                    return std::min(highest(b), m_max);
+            }
+            return m_max;
+        }
+
+        uint64_t count() const { return m_count; }
+        uint64_t total() const { return m_total; }
+        uint64_t min() const { return m_count ? m_min : 0; }
+        uint64_t max() const { return m_max; }
+        uint64_t count(size_t bucket) const { return m_counts[bucket]; }
+
+        double mean() const
+        {
+            return m_count ? double(m_total) / m_count : 0.0;
+        }
+    };
+}
@@ -6,6 +6,10 @@
 
 #include "chunk.hpp"
 #include "event.hpp"
+#include "histogram.hpp"
+#include "trace.hpp"
+
+#define PROFILER_HISTORY    64  // collections whose pacing and phase times are dumped one by one
 
 // #define FunctionCallTypes   
 // #define ChunkOpsTypes        
@@ -20,12 +24,50 @@ namespace GC {
         AllOps          = 0xFFFFFF
     };
 
-    struct ProfilerEvent
+    /**
+     * The pacing chosen by a collection: the bytes that
+     * survived it, the bytes allocated since the one before
+     * and the allocated bytes at which the next one starts.
+     * A minor collection of a generational heap also has
+     * the bytes of the young chunks that it promoted.
+    */
+    struct PacingTarget
+    {
+        size_t m_live;
+        size_t m_allocated;
+        size_t m_target;
+        bool m_minor {false};
+        size_t m_promoted {0};
+    };
+
+    /**
+     * The pacing of all collections so far: how many there
+     * were, how many of them were minor ones, the bytes
+     * that those promoted and the bytes allocated before
+     * them, and the pacing chosen by the last collection.
+    */
+    struct PacingTotals
     {
-        uint m_n {1};
-        const GCEventType m_type;
+        uint64_t m_collections {0};
+        uint64_t m_minors {0};
+        size_t m_promoted {0};
+        size_t m_nursery {0};
+        PacingTarget m_last {};
+    };
 
-        ProfilerEvent(GCEventType type) : m_type(type) {}
+    /**
+     * The nanoseconds that a collection spent in each of
+     * its phases: finding the roots, marking, including
+     * every slice of an incremental mark and a compaction,
+     * sweeping, including every step of a lazy sweep, and
+     * adding the free runs to the free lists.
+    */
+    struct PhaseTimes
+    {
+        uint64_t m_roots {0};
+        uint64_t m_mark {0};
+        uint64_t m_sweep {0};
+        uint64_t m_free {0};
     };
 
     class Profiler {
@@ -33,40 +75,81 @@ namespace GC {
         Profiler() {}
         ~Profiler()
         {
-            for (GCEvent *c : m_events)
-                delete c;
+            delete m_trace;
         }
 
         static Profiler &the();
         inline static Profiler *m_instance {nullptr};
-        std::vector<GCEvent *> m_events;
-        ProfilerEvent *m_last_prof_event {new ProfilerEvent(HeapInit)};
-        std::vector<ProfilerEvent *> m_prof_events;
+        EventRing m_events;
+        uint64_t m_counts[16] {};   // events recorded of each type, lost or not
+        const uint64_t m_start {now()};
+        TraceWriter *m_trace {nullptr};
+        PacingTotals m_pacing;
+        PacingTarget m_targets[PROFILER_HISTORY] {};    // the last collections, by their number
+        PhaseTimes m_phases[PROFILER_HISTORY] {};       // the last collections, by their number
+        uint64_t m_cycles {0};          // collections whose phases were recorded
+        bool m_cycle_open {false};      // if the last one may still add to its phases
+        Histogram m_phase_times[4];     // nanoseconds of each phase of the closed collections
+        bool m_enabled {false};         // the histograms and phases are only filled while enabled
+        Histogram m_pauses;             // nanoseconds of every collection pause
+        Histogram m_alloc_latencies;    // nanoseconds of every slow path allocation
+        Histogram m_alloc_sizes;        // payload bytes of every allocation
         RecordOption flags {AllOps};
 
-        std::chrono::microseconds alloc_time {0};
+        std::chrono::nanoseconds alloc_time {0};
         // size_t alloc_counts {0};
-        std::chrono::microseconds collect_time {0};
+        std::chrono::nanoseconds collect_time {0};
+        std::chrono::nanoseconds max_collect_time {0};
+        std::chrono::nanoseconds mark_time {0};
+        std::chrono::nanoseconds sweep_time {0};
+        std::chrono::nanoseconds max_sweep_time {0};
+        std::chrono::nanoseconds root_time {0};
+        std::chrono::nanoseconds free_time {0};
         // size_t collect_counts {0};
 
-        static void record_data(GCEvent *type);
-        std::ofstream create_file_stream();
+        static void record_data(GCEvent event);
+        void close_cycle();
+        std::ofstream create_file_stream(const char *extension = ".txt");
         std::string get_log_folder();
         static void dump_trace();
         static void dump_prof_trace(bool timing_only);
         static void dump_chunk_trace();
+        static void dump_targets(std::ofstream &fstr);
+        static void dump_phases(std::ofstream &fstr);
+        static void dump_histograms(std::ofstream &fstr);
         // static void dump_trace_short();
         // static void dump_trace_full();
-        static void print_chunk_event(GCEvent *event, char buffer[22]);
+        static void print_chunk_event(std::ofstream &fstr, const GCEvent &event, char buffer[22]);
         static const char *type_to_string(GCEventType type);
 
     public:
+        static uint64_t now();
         static RecordOption log_options();
         static void set_log_options(RecordOption flags);
+        static void set_enabled(bool mode);
         static void record(GCEventType type);
         static void record(GCEventType type, size_t size);
+        static void record(GCEventType type, size_t size, uint64_t time);
+        static void record_buffer(Header *from, Header *to);
         static void record(GCEventType type, Chunk *chunk);
-        static void record(GCEventType type, std::chrono::microseconds time);
+        static void record(GCEventType type, Chunk *chunk, uint64_t time);
+        static void record(GCEventType type, std::chrono::nanoseconds time);
+        static void record(PacingTarget target);
+        static void open_trace(const std::string &path, bool mapped);
+        static void close_trace();
+        static const PacingTotals &pacing();
+        static const Histogram &phase_times(GCEventType phase);
+        static uint64_t recorded(GCEventType type);
+        static uint64_t lost();
+        static std::chrono::microseconds marking_time();
+        static std::chrono::microseconds sweeping_time();
+        static std::chrono::microseconds max_sweeping_time();
+        static std::chrono::microseconds root_scanning_time();
+        static std::chrono::microseconds freeing_time();
+        static const Histogram &pauses();
+        static const Histogram &alloc_latencies();
+        static const Histogram &alloc_sizes();
+        static void export_histograms(std::ostream &out);
         static void dispose();
     };
 }
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * The shadow stack that LLVM maintains for functions compiled with
+ * gc "shadow-stack". The layout is fixed by LLVM, see
+ * https://llvm.org/docs/GarbageCollection.html#the-shadow-stack-gc
+ */
+extern "C"
+{
+    /**
+     * The map for a single function's stack frame. One
+     * of these is compiled as constant data into the
+     * executable for each function with roots.
+     *
+     * Storage of metadata values is elided if the
+     * metadata parameter to llvm.gcroot is null.
+    */
+    struct FrameMap
+    {
+        int32_t NumRoots;       // number of roots in the stack frame
+        int32_t NumMeta;        // number of metadata entries, may be < NumRoots
+        const void *Meta[0];    // metadata for each root
+    };
+
+    /**
+     * A link in the dynamic shadow stack. One of these
+     * is embedded in the stack frame of each function
+     * with roots on the call stack.
+    */
+    struct StackEntry
+    {
+        StackEntry *Next;       // link to the entry of the caller
+        const FrameMap *Map;    // pointer to the constant FrameMap
+        void *Roots[0];         // the stack roots, in place
+    };
+
+    // The head of the shadow stack of the thread. Functions push
+    // and pop onto it in their prologue and epilogue. LLVM defines
+    // it as a global, which churf declares thread-local instead.
+    extern __thread StackEntry *llvm_gc_root_chain;
+}
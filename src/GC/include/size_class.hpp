@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIZE_CLASS_LINEAR_MAX	64	// classes up to this size are 8 bytes apart
+#define SIZE_CLASS_MAX_LOG		36	// the largest class is 2^SIZE_CLASS_MAX_LOG bytes
+#define NUM_SIZE_CLASSES		(SIZE_CLASS_LINEAR_MAX / 8 + 4 * (SIZE_CLASS_MAX_LOG - 6))
+
+namespace GC
+{
+	/**
+	 * Size classes for the free lists of the heap.
+	 *
+	 * Up to SIZE_CLASS_LINEAR_MAX bytes there is one class
+	 * every 8 bytes (8, 16, 24, ..., 64), which covers the
+	 * constructor cells emitted by churf. Above that, every
+	 * power of two is split into four quarter steps that are
+	 * all multiples of 16 bytes (80, 96, 112, 128, 160, ...),
+	 * so rounding a request up wastes at most 25%.
+	 */
+
+	/**
+	 * @returns The index of the smallest class that
+	 *          can hold size bytes.
+	 */
+	constexpr size_t size_class(size_t size)
+	{
+		if (size <= SIZE_CLASS_LINEAR_MAX)
+			return size == 0 ? 0 : (size - 1) / 8;
+		// size lies in (2^k, 2^(k+1)] where k >= 6
+		size_t k = 63 - __builtin_clzl(size - 1);
+		size_t quarter = (size - 1 - ((size_t)1 << k)) >> (k - 2);
+		return SIZE_CLASS_LINEAR_MAX / 8 + 4 * (k - 6) + quarter;
+	}
+
+	/**
+	 * @returns The amount of bytes in a class.
+	 */
+	constexpr size_t class_size(size_t cls)
+	{
+		if (cls < SIZE_CLASS_LINEAR_MAX / 8)
+			return (cls + 1) * 8;
+		size_t j = cls - SIZE_CLASS_LINEAR_MAX / 8;
+		size_t k = 6 + j / 4;
+		return ((size_t)1 << k) + (j % 4 + 1) * ((size_t)1 << (k - 2));
+	}
+
+	/**
+	 * Rounds a request up to the size of its class.
+	 */
+	constexpr size_t class_round(size_t size)
+	{
+		return class_size(size_class(size));
+	}
+
+	/**
+	 * @returns The index of the largest class that
+	 *          fits inside a block of size bytes, which
+	 *          must be a multiple of 8 and at least 8.
+	 */
+	constexpr size_t floor_class(size_t size)
+	{
+		size_t cls = size_class(size);
+		return class_size(cls) > size ? cls - 1 : cls;
+	}
+
+	static_assert(class_size(size_class(80)) == 80);
+	static_assert(class_size(size_class(81)) == 96);
+	static_assert(class_size(size_class(129)) == 160);
+	static_assert(floor_class(150) == size_class(128));
+	static_assert(NUM_SIZE_CLASSES % 64 == 0);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+
+#define TRACE_MAGIC     0x4352545041454843ULL   // "CHEAPTRC", the first word of a trace file
+#define TRACE_BUFFER    (1 << 16)   // bytes written to the file at a time
+#define TRACE_WINDOW    (1 << 22)   // bytes of the file mapped at a time
+#define TRACE_FLUSH_MS  100         // the longest a record waits in the buffer
+
+namespace GC
+{
+    /**
+     * The kinds of records in a trace file, of a GCEvent
+     * and of a TraceSpan.
+    */
+    enum TraceKind : uint32_t
+    {
+        EventRecord = 1,
+        SpanRecord  = 2
+    };
+
+    /**
+     * The start of a trace file: TRACE_MAGIC and the
+     * nanoseconds of the steady clock at which the
+     * profiler started, which the times of the records
+     * are relative to.
+    */
+    struct TraceHeader
+    {
+        uint64_t m_magic;
+        uint64_t m_start;
+    };
+
+    /**
+     * The framing of every record after the header: the
+     * bytes that follow the length, and the kind. A
+     * reader skips the records of kinds it does not know.
+    */
+    struct TraceRecord
+    {
+        uint32_t m_length;
+        uint32_t m_kind;
+    };
+
+    /**
+     * A phase of the heap with a duration, like a
+     * collection or a sweep, of a GCEventType.
+    */
+    struct TraceSpan
+    {
+        uint64_t m_type;
+        uint64_t m_start;
+        uint64_t m_duration;
+    };
+
+    /**
+     * Writes the records of the profiler to a trace file
+     * as they happen. The file is opened once, and the
+     * records are collected in a buffer that is written
+     * when it is full or when flush_if_due() finds it
+     * older than TRACE_FLUSH_MS. A mapped writer instead
+     * maps a window of the file and writes the records
+     * straight into it, which saves the copy and the
+     * system call of every buffer.
+    */
+    class TraceWriter
+    {
+    private:
+        int m_fd;
+        const bool m_mapped;
+        char *m_buffer;
+        size_t m_used {0};          // bytes of the buffer or window written
+        off_t m_offset {0};         // the offset in the file of the buffer or window
+        uint64_t m_flushed;         // when the buffer was last flushed
+
+        void map_window(off_t position);
+        void advance();
+        bool write_out();
+
+    public:
+        TraceWriter(const std::string &path, bool mapped, uint64_t start);
+        ~TraceWriter();
+
+        TraceWriter(TraceWriter const&) = delete;
+        TraceWriter& operator=(TraceWriter const&) = delete;
+
+        void write(TraceKind kind, const void *payload, uint32_t size);
+        void flush(uint64_t now);
+        void flush_if_due(uint64_t now);
+    };
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#define WORK_DEQUE_MIN	256	// ranges a deque holds before it grows
+
+namespace GC
+{
+	/**
+	 * A work-stealing deque of gray ranges for the
+	 * parallel mark, as described by Chase and Lev, with
+	 * the memory orders of Lê et al. for weak memory
+	 * models. The owning worker pushes and pops ranges at
+	 * the bottom, other workers steal them from the top.
+	 * The ring buffer grows when it is full, and the old
+	 * buffers are kept until the deque is destroyed,
+	 * since a thief may still read from them.
+	 */
+	class WorkDeque
+	{
+	public:
+		using Range = std::pair<uintptr_t, uintptr_t>;
+
+		WorkDeque()
+		{
+			m_buffers.emplace_back(new Buffer(WORK_DEQUE_MIN));
+			m_buffer.store(m_buffers.back().get(), std::memory_order_relaxed);
+		}
+
+		WorkDeque(WorkDeque const&) = delete;
+		WorkDeque& operator=(WorkDeque const&) = delete;
+
+		/**
+		 * Adds a range at the bottom, only called
+		 * by the owner.
+		 */
+		void push(Range range)
+		{
+			int64_t b = m_bottom.load(std::memory_order_relaxed);
+			int64_t t = m_top.load(std::memory_order_acquire);
+			Buffer *buffer = m_buffer.load(std::memory_order_relaxed);
+			if (b - t > int64_t(buffer->m_capacity) - 1)
+				buffer = grow(buffer, t, b);
+			buffer->put(b, range);
+			std::atomic_thread_fence(std::memory_order_release);
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+		}
+
+		/**
+		 * Removes the range at the bottom, only called
+		 * by the owner.
+		 *
+		 * @returns False if the deque is empty.
+		 */
+		bool pop(Range &range)
+		{
+			int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+			Buffer *buffer = m_buffer.load(std::memory_order_relaxed);
+			m_bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t t = m_top.load(std::memory_order_relaxed);
+			if (t > b)
+			{
+				m_bottom.store(b + 1, std::memory_order_relaxed);
+				return false;
+			}
+
+			range = buffer->get(b);
+			if (t < b)
+				return true;
+			// The last range, which a thief may take as well
+			bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+			return won;
+		}
+
+		/**
+		 * Removes the range at the top, called by any
+		 * worker but the owner.
+		 *
+		 * @returns False if the deque is empty or if
+		 *          another worker took the range first.
+		 */
+		bool steal(Range &range)
+		{
+			int64_t t = m_top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t b = m_bottom.load(std::memory_order_acquire);
+			if (t >= b)
+				return false;
+
+			Buffer *buffer = m_buffer.load(std::memory_order_acquire);
+			range = buffer->get(t);
+			return m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+		}
+
+		/**
+		 * @returns True if the deque looks empty, which
+		 *          may be out of date by the time the
+		 *          caller looks at it.
+		 */
+		bool empty() const
+		{
+			return m_top.load(std::memory_order_relaxed) >= m_bottom.load(std::memory_order_relaxed);
+		}
+
+	private:
+		/**
+		 * A ring buffer of ranges, whose capacity is a
+		 * power of two. The two words of a range are
+		 * atomic, since a thief may read a slot that the
+		 * owner writes, although it then loses the race
+		 * for the range.
+		 */
+		struct Buffer
+		{
+			const size_t m_capacity;
+			std::unique_ptr<std::atomic<uintptr_t>[]> m_slots;
+
+			explicit Buffer(size_t capacity) : m_capacity(capacity), m_slots(new std::atomic<uintptr_t>[2 * capacity]) {}
+
+			void put(int64_t i, Range range)
+			{
+				size_t slot = 2 * (i & (m_capacity - 1));
+				m_slots[slot].store(range.first, std::memory_order_relaxed);
+				m_slots[slot + 1].store(range.second, std::memory_order_relaxed);
+			}
+
+			Range get(int64_t i) const
+			{
+				size_t slot = 2 * (i & (m_capacity - 1));
+				return Range(m_slots[slot].load(std::memory_order_relaxed), m_slots[slot + 1].load(std::memory_order_relaxed));
+			}
+		};
+
+		Buffer *grow(Buffer *buffer, int64_t t, int64_t b)
+		{
+			auto bigger = new Buffer(2 * buffer->m_capacity);
+			for (int64_t i = t; i < b; i++)
+				bigger->put(i, buffer->get(i));
+			m_buffers.emplace_back(bigger);
+			m_buffer.store(bigger, std::memory_order_release);
+			return bigger;
+		}
+
+		alignas(64) std::atomic<int64_t> m_top {0};
+		alignas(64) std::atomic<int64_t> m_bottom {0};
+		std::atomic<Buffer *> m_buffer;
+		std::vector<std::unique_ptr<Buffer>> m_buffers;
+	};
+}
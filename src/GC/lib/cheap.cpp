@@ -4,6 +4,11 @@
 #include "heap.hpp"
 #include "cheap.h"
 
+// The fast path in cheap.h rounds like the small size classes
+static_assert(CHEAP_HEADER_SIZE == sizeof(GC::Header));
+static_assert(CHEAP_INLINE_MAX <= SIZE_CLASS_LINEAR_MAX);
+static_assert(sizeof(cheap_type_t) == sizeof(GC::TypeDescriptor));
+
 #ifndef WRAPPER_DEBUG
 struct cheap
 {
@@ -33,9 +38,83 @@ void cheap_dispose()
     GC::Heap::dispose();
 }
 
+void cheap_thread_attach()
+{
+    GC::Heap::attach_thread();
+}
+
+void cheap_thread_detach()
+{
+    GC::Heap::detach_thread();
+}
+
 void *cheap_alloc(unsigned long size)
 {
-    return GC::Heap::alloc(size);
+    // The frame pointer of this frame links to the frame of the
+    // caller, where a walk of the frame table starts
+    return GC::Heap::alloc_from_frame(size, 0, __builtin_frame_address(0));
+}
+
+void *cheap_alloc_atomic(unsigned long size)
+{
+    return GC::Heap::alloc_atomic(size);
+}
+
+void *cheap_alloc_typed(unsigned long size, unsigned long type)
+{
+    if (type >= TYPES_MAX)
+        throw std::runtime_error(std::string("Error: Unknown type ") + std::to_string(type));
+    return GC::Heap::alloc_from_frame(size, type, __builtin_frame_address(0));
+}
+
+void cheap_set_types(const cheap_type_t *const *types, unsigned long count)
+{
+    GC::Heap::set_types(reinterpret_cast<const GC::TypeDescriptor *const *>(types), count);
+}
+
+void cheap_set_gc_percent(unsigned long percent)
+{
+    GC::Heap::set_gc_percent(percent);
+}
+
+void cheap_set_mark_budget(unsigned long us)
+{
+    GC::Heap::set_mark_budget(us);
+}
+
+bool cheap_set_concurrent(bool mode)
+{
+    return GC::Heap::set_concurrent(mode);
+}
+
+void cheap_set_lazy_sweep(bool mode)
+{
+    GC::Heap::set_lazy_sweep(mode);
+}
+
+void cheap_set_generational(bool mode)
+{
+    GC::Heap::set_generational(mode);
+}
+
+void cheap_set_compact(bool mode)
+{
+    GC::Heap::set_compact(mode);
+}
+
+void cheap_set_immix(bool mode)
+{
+    GC::Heap::set_immix(mode);
+}
+
+void cheap_set_precise_roots(bool mode)
+{
+    GC::Heap::set_precise_roots(mode);
+}
+
+void cheap_set_frame_roots(bool mode)
+{
+    GC::Heap::set_frame_roots(mode);
 }
 
 void cheap_set_profiler(cheap_t *cheap, bool mode)
@@ -58,4 +137,11 @@ void cheap_profiler_log_options(cheap_t *cheap, unsigned long flags)
         cast_flag = GC::AllOps;
 
     heap->set_profiler_log_options(cast_flag);
+}
+
+void cheap_profiler_trace(cheap_t *cheap, const char *path, bool mapped)
+{
+    GC::Heap *heap = static_cast<GC::Heap *>(cheap->obj);
+
+    heap->set_profiler_trace(path, mapped);
 }
\ No newline at end of file
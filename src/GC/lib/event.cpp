@@ -1,57 +1,38 @@
-#include "chunk.hpp"
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+
 #include "event.hpp"
 
 namespace GC
 {
     /**
-     * @returns The type of the event
-    */
-    GCEventType GCEvent::get_type()
-    {
-        return m_type;
-    }
-
-    /**
-     * @returns The time the event happened in
-     *          the form of time_t.
+     * Maps the memory of the ring buffer. The pages are
+     * only committed once events are written to them, so
+     * a program that never records an event does not pay
+     * for the buffer.
+     *
+     * @throws  A runtime error if the memory cannot be
+     *          mapped.
     */
-    std::time_t GCEvent::get_time_stamp()
+    EventRing::EventRing()
     {
-        return m_timestamp;
+        void *addr = mmap(nullptr, EVENT_RING_SIZE * sizeof(GCEvent), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error(std::string("Error: Failed to map the profiler events"));
+        m_events = static_cast<GCEvent *>(addr);
     }
 
-    /**
-     * If the event is related to a chunk, this
-     * function returns the chunk that it is
-     * related to. If the event is independent
-     * of a chunk, it returns the nullptr.
-     * 
-     * @returns A chunk pointer or the nullptr.
-    */
-    const Chunk *GCEvent::get_chunk()
-    {
-        return m_chunk;
-    }
-    
-    /**
-     * If the event is an AllocStart event, this
-     * returns the size of the alloc() request.
-     * otherwise this returns 0.
-     * 
-     * @returns A number representing the number
-     *          of bytes requested to alloc()
-     *          or 0 if the event is not an
-     *          AllocStart event.
-    */
-    size_t GCEvent::get_size()
+    EventRing::~EventRing()
     {
-        return m_size;
+        munmap(m_events, EVENT_RING_SIZE * sizeof(GCEvent));
     }
 
     /**
      * @returns The string conversion of the event type.
     */
-    const char *GCEvent::type_to_string()
+    const char *GCEvent::type_to_string() const
     {
         switch (m_type)
         {
@@ -67,7 +48,8 @@ namespace GC
             case ReusedChunk:       return "ReusedChunk";
             case ProfilerDispose:   return "ProfilerDispose";
             case FreeStart:         return "FreeStart";
+            case RootScan:          return "RootScan";
             default:                return "[Unknown]";
         }
     }
-}
\ No newline at end of file
+}
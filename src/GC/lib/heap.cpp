@@ -1,21 +1,42 @@
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include <stdlib.h>
+#include <string.h>
 #include <vector>
-#include <unordered_map>
 #include <chrono>
 #include <queue>
 #include <set>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "heap.hpp"
 
-#define time_now	std::chrono::high_resolution_clock::now()
-#define to_us		std::chrono::duration_cast<std::chrono::microseconds>
+#define time_now	std::chrono::steady_clock::now()
+#define to_ns		std::chrono::duration_cast<std::chrono::nanoseconds>
+#define PAGEMAP_SOFT_DIRTY	((uint64_t)1 << 55)	// bit of a /proc/self/pagemap entry
+#define SIG_SUSPEND	SIGPWR	// stops an attached thread for a collection
+#define SIG_RESUME	SIGXCPU	// lets it run again
+
+using std::cout, std::endl, std::vector, std::hex, std::dec;
 
-using std::cout, std::endl, std::vector, std::hex, std::dec, std::unordered_map;
+__thread char *cheap_alloc_cursor = nullptr;
+__thread char *cheap_alloc_limit = nullptr;
+__thread StackEntry *llvm_gc_root_chain = nullptr;
 
 namespace GC
 {
+	// The record of the calling thread, or nullptr if it is
+	// not attached
+	static thread_local Mutator *this_mutator = nullptr;
+
 	/**
 	 * This implementation of the() guarantees laziness
 	 * on the instance and a correct destruction with
@@ -30,21 +51,375 @@ namespace GC
 	}
 
 	/**
-	 * Initialises the heap singleton and saves the address
-	 * of the calling function's stack frame as the stack_top.
-	 * Presumeably this address points to the stack frame of
-	 * the compiled LLVM executable after linking.
+	 * Reserves the address space for the heap without
+	 * backing it by memory. If the system refuses a
+	 * reservation of HEAP_RESERVE bytes, smaller ones
+	 * are tried down to HEAP_RESERVE_MIN bytes. The
+	 * address space for the bitmaps is reserved for the
+	 * whole heap as well.
+	 *
+	 * @throws  A runtime error if no reservation could
+	 *          be made.
+	 */
+	Heap::Heap()
+	{
+		for (size_t reserve = HEAP_RESERVE; reserve >= HEAP_RESERVE_MIN; reserve >>= 1)
+		{
+			void *addr = mmap(nullptr, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (addr != MAP_FAILED)
+			{
+				m_heap = static_cast<char *>(addr);
+				m_reserved = reserve;
+				addr = mmap(nullptr, 3 * bitmap_size(reserve) + line_table_size(reserve), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+				if (addr == MAP_FAILED)
+				{
+					munmap(m_heap, reserve);
+					continue;
+				}
+				m_start_bits = static_cast<uint64_t *>(addr);
+				m_mark_bits = m_start_bits + bitmap_size(reserve) / sizeof(uint64_t);
+				m_pin_bits = m_mark_bits + bitmap_size(reserve) / sizeof(uint64_t);
+				m_line_marks = reinterpret_cast<uint8_t *>(m_pin_bits + bitmap_size(reserve) / sizeof(uint64_t));
+				grow(0);
+				sem_init(&m_ack, 0, 0);
+				return;
+			}
+		}
+		throw std::runtime_error(std::string("Error: Could not reserve memory for the heap"));
+	}
+
+	Heap::~Heap()
+	{
+		if (m_marker.joinable())
+			m_marker.join();
+		munmap(m_heap, m_reserved);
+		munmap(m_start_bits, 3 * bitmap_size(m_reserved) + line_table_size(m_reserved));
+		for (auto &large : m_large_chunks)
+			munmap(large.second.m_header, large.second.m_header->m_size);
+		for (Mutator *mutator : m_mutators)
+			delete mutator;
+		sem_destroy(&m_ack);
+	}
+
+	/**
+	 * Initialises the heap singleton, installs the signal
+	 * handlers that stop the attached threads for a
+	 * collection and attaches the calling thread.
+	 * The growth percent of the pacing, the mark budget,
+	 * concurrent marking, the number of mark threads,
+	 * lazy sweeping, generational collection, compaction
+	 * and Immix mode are taken from the environment
+	 * variables CHEAP_GC_PERCENT, CHEAP_MARK_BUDGET,
+	 * CHEAP_CONCURRENT_MARK, CHEAP_MARK_THREADS,
+	 * CHEAP_LAZY_SWEEP, CHEAP_GENERATIONAL, CHEAP_COMPACT
+	 * and CHEAP_IMMIX if they are set. CHEAP_TRACE turns
+	 * the profiler on with a trace file at the path it is
+	 * set to, which is mapped if CHEAP_TRACE_MMAP is set.
+	 *
+	 * @throws  A runtime error if the signal handlers
+	 *          cannot be installed or if the stack of the
+	 *          thread cannot be found.
 	 */
 	void Heap::init()
 	{
 		Heap &heap = Heap::the();
 		if (heap.profiler_enabled())
 			Profiler::record(HeapInit);
-// clang complains because arg for __b_f_a is not 0 which is "unsafe"
-#pragma clang diagnostic ignored "-Wframe-address"
-		heap.m_stack_top = static_cast<uintptr_t *>(__builtin_frame_address(1));
-		// TODO: handle this below
-		//heap.m_heap_top = heap.m_heap;
+
+		// The resume signal is only taken while a thread waits
+		// in suspend_handler()
+		struct sigaction action {};
+		action.sa_flags = SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sigaddset(&action.sa_mask, SIG_RESUME);
+		action.sa_handler = suspend_handler;
+		bool installed = sigaction(SIG_SUSPEND, &action, nullptr) == 0;
+		sigemptyset(&action.sa_mask);
+		action.sa_handler = resume_handler;
+		installed = installed && sigaction(SIG_RESUME, &action, nullptr) == 0;
+		if (!installed)
+			throw std::runtime_error(std::string("Error: Could not install the signal handlers of the heap"));
+
+		attach_thread();
+
+		if (const char *percent = getenv("CHEAP_GC_PERCENT"))
+			set_gc_percent(strtoul(percent, nullptr, 10));
+		if (const char *budget = getenv("CHEAP_MARK_BUDGET"))
+			set_mark_budget(strtoul(budget, nullptr, 10));
+		if (const char *concurrent = getenv("CHEAP_CONCURRENT_MARK"))
+			set_concurrent(strtoul(concurrent, nullptr, 10) != 0);
+		if (const char *threads = getenv("CHEAP_MARK_THREADS"))
+			set_mark_threads(strtoul(threads, nullptr, 10));
+		if (const char *lazy = getenv("CHEAP_LAZY_SWEEP"))
+			set_lazy_sweep(strtoul(lazy, nullptr, 10) != 0);
+		if (const char *generational = getenv("CHEAP_GENERATIONAL"))
+			set_generational(strtoul(generational, nullptr, 10) != 0);
+		if (const char *compact = getenv("CHEAP_COMPACT"))
+			set_compact(strtoul(compact, nullptr, 10) != 0);
+		if (const char *immix = getenv("CHEAP_IMMIX"))
+			set_immix(strtoul(immix, nullptr, 10) != 0);
+		if (const char *precise = getenv("CHEAP_PRECISE_ROOTS"))
+			set_precise_roots(strtoul(precise, nullptr, 10) != 0);
+		if (const char *frame = getenv("CHEAP_FRAME_ROOTS"))
+			set_frame_roots(strtoul(frame, nullptr, 10) != 0);
+		if (const char *trace = getenv("CHEAP_TRACE"))
+		{
+			const char *mapped = getenv("CHEAP_TRACE_MMAP");
+			heap.set_profiler_trace(trace, mapped != nullptr && strtoul(mapped, nullptr, 10) != 0);
+			heap.set_profiler(true);
+		}
+	}
+
+	/**
+	 * Sets how many percent the allocated bytes may grow
+	 * past the live bytes of the last collection before
+	 * the next collection is triggered, GC_PERCENT by
+	 * default. A higher percent trades memory for fewer
+	 * collections. The trigger of the current cycle is
+	 * moved right away, or in generational mode the
+	 * trigger of the next major collection.
+	 *
+	 * @param percent   The growth in percent of the live
+	 *                  bytes.
+	 */
+	void Heap::set_gc_percent(size_t percent)
+	{
+		Heap &heap = Heap::the();
+		heap.m_gc_percent = percent;
+		size_t target = std::max(heap.m_live + heap.m_live / 100 * percent, GC_TRIGGER_MIN);
+		if (heap.m_generational)
+			heap.m_major_target = target;
+		else
+			heap.m_next_gc = target;
+	}
+
+	/**
+	 * Makes the mark phase incremental, so that no
+	 * allocation spends much more than the budget on
+	 * marking. A budget of zero, the default, marks the
+	 * whole heap at once.
+	 *
+	 * @param us    The time of a mark slice in
+	 *              microseconds.
+	 */
+	void Heap::set_mark_budget(size_t us)
+	{
+		Heap &heap = Heap::the();
+		heap.m_mark_budget = std::chrono::microseconds(us);
+	}
+
+	/**
+	 * Makes the mark phase concurrent, so that a marker
+	 * thread traces the heap while the program runs. This
+	 * needs the soft-dirty page tracking of Linux, without
+	 * it the mark stays incremental or stop-the-world.
+	 *
+	 * @param mode  True to mark concurrently.
+	 *
+	 * @returns True if the mark is concurrent from the
+	 *          next collection on.
+	 */
+	bool Heap::set_concurrent(bool mode)
+	{
+		Heap &heap = Heap::the();
+		heap.m_concurrent = mode && soft_dirty_supported();
+		return heap.m_concurrent;
+	}
+
+	/**
+	 * Sets the number of threads that drain the worklist
+	 * when the heap is marked at once, which includes the
+	 * thread that collects. One, the default, marks on
+	 * that thread alone.
+	 *
+	 * @param threads   The number of mark threads, at
+	 *                  most MARK_THREADS_MAX.
+	 */
+	void Heap::set_mark_threads(size_t threads)
+	{
+		Heap &heap = Heap::the();
+		heap.m_mark_threads = std::clamp(threads, (size_t)1, MARK_THREADS_MAX);
+	}
+
+	/**
+	 * Makes the sweep lazy, so that a collection ends
+	 * with the mark and the heap is swept a step at a
+	 * time by the allocations that need free chunks. Off
+	 * by default, which sweeps the whole heap at the end
+	 * of the collection.
+	 *
+	 * @param mode  True to sweep lazily from the next
+	 *              collection on.
+	 */
+	void Heap::set_lazy_sweep(bool mode)
+	{
+		Heap &heap = Heap::the();
+		heap.m_lazy_sweep = mode;
+	}
+
+	/**
+	 * Makes the collections generational, so that most
+	 * of them only trace and sweep the chunks allocated
+	 * since the last one. Only for programs that do not
+	 * change an object after it is initialised, like the
+	 * code emitted by churf, since a pointer from an old
+	 * object to a young one is not seen by a minor
+	 * collection. Off by default.
+	 *
+	 * @param mode  True to keep the marks of the
+	 *              survivors from the next collection on.
+	 */
+	void Heap::set_generational(bool mode)
+	{
+		Heap &heap = Heap::the();
+		heap.m_generational = mode;
+	}
+
+	/**
+	 * Makes the collections compacting, so that the
+	 * objects that are only pointed to by the pointer
+	 * words of typed objects are moved to the bottom of
+	 * the heap. Only for programs that keep every pointer
+	 * that is not on a stack in a typed object, like the
+	 * code emitted by churf, or in an object that is
+	 * scanned as a whole. Off by default.
+	 *
+	 * @param mode  True to compact from the next
+	 *              collection on.
+	 */
+	void Heap::set_compact(bool mode)
+	{
+		Heap &heap = Heap::the();
+		heap.m_compact = mode;
+	}
+
+	/**
+	 * Makes the heap an Immix heap, which reclaims free
+	 * lines instead of the memory between the chunks and
+	 * bumps the allocation buffers through them. It takes
+	 * effect with the next collection that is not minor,
+	 * since a minor one relies on the lines marked by the
+	 * last full one. The heap is then always swept at
+	 * once, since a line sweep only reads the line table.
+	 * Off by default.
+	 *
+	 * @param mode  True to reclaim the heap by lines.
+	 */
+	void Heap::set_immix(bool mode)
+	{
+		Heap &heap = Heap::the();
+		heap.m_immix = mode;
+	}
+
+	/**
+	 * Makes the roots precise, so that the collections
+	 * find them on the shadow stacks instead of scanning
+	 * the stacks. Only for programs whose every function
+	 * that holds objects is compiled with gc
+	 * "shadow-stack". Off by default.
+	 *
+	 * @param mode  True to find the roots on the shadow
+	 *              stacks.
+	 */
+	void Heap::set_precise_roots(bool mode)
+	{
+		Heap &heap = Heap::the();
+		heap.m_precise_roots = mode;
+	}
+
+	/**
+	 * Makes the roots precise by the frame table of the
+	 * program, which is read into m_frame_table the first
+	 * time. Only for programs whose every function that
+	 * holds objects is compiled with gc "gc" and frame
+	 * pointers, and which allocate with cheap_alloc. Off
+	 * by default.
+	 *
+	 * @param mode  True to find the roots of the threads
+	 *              in cheap_alloc in the frame table.
+	 */
+	void Heap::set_frame_roots(bool mode)
+	{
+		Heap &heap = Heap::the();
+		heap.m_frame_roots = mode;
+		if (!mode || !heap.m_frame_table.empty() || __start_churf_frametable == nullptr)
+			return;
+
+		auto entry = __start_churf_frametable;
+		while (entry < __stop_churf_frametable)
+		{
+			auto descriptor = reinterpret_cast<const FrameDescriptor *>(entry);
+			heap.m_frame_table.push_back(descriptor);
+			size_t size = offsetof(FrameDescriptor, Offsets) + descriptor->NumRoots * sizeof(int32_t);
+			entry += (size + 7) & ~size_t(7);
+		}
+		std::sort(heap.m_frame_table.begin(), heap.m_frame_table.end(),
+				  [](const FrameDescriptor *a, const FrameDescriptor *b) { return a->ReturnAddress < b->ReturnAddress; });
+	}
+
+	/**
+	 * @returns The bytes of the heap below the bump
+	 *          offset, free chunks included, which is
+	 *          the memory that the heap holds on to
+	 *          apart from the large chunks.
+	 */
+	size_t Heap::footprint()
+	{
+		Heap &heap = Heap::the();
+		std::lock_guard<std::mutex> lock(heap.m_lock);
+		return heap.m_top;
+	}
+
+	/**
+	 * Attaches the calling thread to the heap, so that it
+	 * can allocate and its stack is scanned for roots.
+	 * The top of the stack is saved as the limit of the
+	 * scan, so that every frame of the thread is below
+	 * it. The frame address of the caller cannot be used,
+	 * since optimised code does not keep frame pointers.
+	 * Attaching a thread twice has no effect.
+	 *
+	 * @throws  A runtime error if the stack of the thread
+	 *          cannot be found.
+	 */
+	void Heap::attach_thread()
+	{
+		Heap &heap = Heap::the();
+		if (this_mutator != nullptr)
+			return;
+
+		pthread_attr_t attr;
+		void *stack_addr;
+		size_t stack_size;
+		if (pthread_getattr_np(pthread_self(), &attr) != 0)
+			throw std::runtime_error(std::string("Error: Could not find the stack of the thread"));
+		pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+		pthread_attr_destroy(&attr);
+		auto stack_top = reinterpret_cast<uintptr_t *>(static_cast<char *>(stack_addr) + stack_size);
+
+		auto mutator = new Mutator {pthread_self(), stack_top, nullptr, &cheap_alloc_cursor, &cheap_alloc_limit, &llvm_gc_root_chain};
+		std::lock_guard<std::mutex> lock(heap.m_lock);
+		heap.m_mutators.push_back(mutator);
+		this_mutator = mutator;
+	}
+
+	/**
+	 * Detaches the calling thread from the heap, which
+	 * it must do before it exits. Its allocation buffer
+	 * is given back, and the objects only its stack
+	 * pointed to are collected.
+	 */
+	void Heap::detach_thread()
+	{
+		Heap &heap = Heap::the();
+		if (this_mutator == nullptr)
+			return;
+
+		std::lock_guard<std::mutex> lock(heap.m_lock);
+		heap.retire_buffer();
+		heap.m_mutators.erase(std::find(heap.m_mutators.begin(), heap.m_mutators.end(), this_mutator));
+		delete this_mutator;
+		this_mutator = nullptr;
 	}
 
 	void Heap::set_profiler_log_options(RecordOption flags)
@@ -52,6 +427,25 @@ namespace GC
 		Profiler::set_log_options(flags);
 	}
 
+	/**
+	 * Writes the events and the phases that the profiler
+	 * records from now on to a binary trace file as well,
+	 * see Profiler::open_trace(). Events are only recorded
+	 * while the profiler is enabled.
+	 *
+	 * @param path      The path of the trace file.
+	 *
+	 * @param mapped    If the file is written through a
+	 *                  mapping instead of a buffer.
+	 */
+	void Heap::set_profiler_trace(const char *path, bool mapped)
+	{
+		Heap &heap = Heap::the();
+		// The events are recorded under the lock
+		std::lock_guard<std::mutex> lock(heap.m_lock);
+		Profiler::open_trace(path, mapped);
+	}
+
 	/**
 	 * Disposes the heap and the profiler at program exit
 	 * which also triggers a heap log file dumped if the
@@ -74,14 +468,105 @@ namespace GC
 	 *          to be casted to and object pointer.
 	 */
 	void *Heap::alloc(size_t size)
+	{
+		return allocate(size, false, 0);
+	}
+
+	/**
+	 * Allocates a given amount of bytes on the heap for
+	 * an object that contains no pointers, such as an
+	 * array of numbers. The object is never scanned by
+	 * the mark phase.
+	 *
+	 * @param size The amount of bytes to be allocated.
+	 *
+	 * @return  A pointer to the address where the memory
+	 *          has been allocated.
+	 */
+	void *Heap::alloc_atomic(size_t size)
+	{
+		return allocate(size, true, 0);
+	}
+
+	/**
+	 * Allocates an object of a type that was registered
+	 * with set_types(), of which the mark only scans the
+	 * words that hold pointers. An object larger than
+	 * the map of its type is scanned as a whole.
+	 *
+	 * @param size  The amount of bytes to be allocated.
+	 * @param type  The index of the type, 0 for an object
+	 *              that is scanned as a whole.
+	 *
+	 * @return  A pointer to the allocated memory.
+	 *
+	 * @throws  A runtime error if the type is not
+	 *          registered.
+	 */
+	void *Heap::alloc_typed(size_t size, uint16_t type)
+	{
+		Heap &heap = Heap::the();
+		if (type >= heap.m_types.size())
+			throw std::runtime_error(std::string("Error: Unknown type ") + std::to_string(type));
+		return allocate(size, false, size <= TYPE_WORDS_MAX * sizeof(uintptr_t) ? type : 0);
+	}
+
+	/**
+	 * Registers the layouts of the typed objects, which
+	 * replace any registered before. The type of index i
+	 * is types[i - 1], index 0 is an object without a
+	 * type. It must be called before the first typed
+	 * allocation, and the descriptors must outlive the
+	 * heap.
+	 *
+	 * @param types The descriptors of the types.
+	 * @param count The number of types.
+	 *
+	 * @throws  A runtime error if there are more types
+	 *          than fit in a header.
+	 */
+	void Heap::set_types(const TypeDescriptor *const *types, size_t count)
+	{
+		Heap &heap = Heap::the();
+		if (count >= TYPES_MAX)
+			throw std::runtime_error(std::string("Error: Too many types for the header"));
+		std::lock_guard<std::mutex> lock(heap.m_lock);
+		heap.m_types.assign(1, nullptr);
+		heap.m_types.insert(heap.m_types.end(), types, types + count);
+	}
+
+	/**
+	 * Allocates like alloc_typed() for compiled code,
+	 * whose frames are found from the given frame if the
+	 * heap is collected meanwhile and the roots are found
+	 * in the frame table.
+	 *
+	 * @param size  The amount of bytes to be allocated.
+	 * @param type  The index of the type, 0 for an object
+	 *              that is scanned as a whole.
+	 * @param frame The frame of the function that the
+	 *              compiled code called, which has a
+	 *              frame pointer.
+	 *
+	 * @return  A pointer to the allocated memory.
+	 */
+	void *Heap::alloc_from_frame(size_t size, uint16_t type, void *frame)
+	{
+		if (this_mutator == nullptr)
+			return alloc_typed(size, type);
+
+		this_mutator->m_frame = static_cast<uintptr_t *>(frame);
+		void *object = alloc_typed(size, type);
+		this_mutator->m_frame = nullptr;
+		return object;
+	}
+
+	void *Heap::allocate(size_t size, bool atomic, uint16_t type)
 	{
 		auto a_start = time_now;
 		// Singleton
 		Heap &heap = Heap::the();
 		bool profiler_enabled = heap.profiler_enabled();
-		
-		if (profiler_enabled)
-			Profiler::record(AllocStart, size);
 
 		if (size == 0)
 		{
@@ -89,185 +574,1585 @@ namespace GC
 			return nullptr;
 		}
 
-		if (heap.m_size + size > HEAP_SIZE)
+		// The slow paths of all threads take turns, and a thread
+		// that collects stops the others
+		std::lock_guard<std::mutex> lock(heap.m_lock);
+
+		if (size >= LARGE_CHUNK_MIN)
+		{
+			void *large = heap.alloc_large(size, atomic);
+			if (profiler_enabled)
+				Profiler::record(AllocStart, size);
+			Profiler::record(AllocStart, to_ns(time_now - a_start));
+			return large;
+		}
+
+		// Every small chunk, including its header, is a whole
+		// size class, which lets the free lists hand out chunks
+		// without searching them. Medium chunks are fitted to
+		// the granule instead.
+		size += sizeof(Header);
+		if (size < MEDIUM_CHUNK_MIN)
+			size = class_round(size);
+		else
+			size = (size + GRANULE_SIZE - 1) & ~(GRANULE_SIZE - 1);
+
+		// Small objects are bumped from the allocation buffer of
+		// the thread, which the inline fast path in cheap.h does
+		// without calling the heap. In Immix mode atomic ones are
+		// too, so that they fill the free lines as well. The
+		// profiler records them when the buffer is flushed.
+		bool buffered = size < MEDIUM_CHUNK_MIN && (!atomic || heap.m_immix) && this_mutator != nullptr;
+		if (buffered && size <= size_t(cheap_alloc_limit - cheap_alloc_cursor))
+			return heap.bump_buffer(size, atomic, type);
+
+		// The allocations past this point are timed, the ones that
+		// end in a new allocation buffer too
+		auto timed = [&](void *object)
+		{
+			Profiler::record(AllocStart, to_ns(time_now - a_start));
+			return object;
+		};
+
+		// In Immix mode a chunk larger than a line that does not
+		// fit in the rest of the buffer overflows on its own, and
+		// the buffer is kept for the small chunks that fit the hole
+		if (buffered && heap.m_immix && size > LINE_SIZE && this_mutator->m_buffer != nullptr)
+			buffered = false;
+		else
+			heap.retire_buffer();
+
+		// Collect once the allocations since the last collection
+		// have used up the budget set by pace(), and continue an
+		// incremental mark on every slow path allocation
+		if (heap.m_marking || heap.allocated() + size > heap.m_next_gc)
 		{
-			// auto a_ms = to_us(c_start - a_start);
-			// Profiler::record(AllocStart, a_ms);
+			// Spill the callee-saved registers into this frame so
+			// that roots only held in registers are found by the
+			// stack scan in collect()
+			__builtin_unwind_init();
 			auto stack_bottom = reinterpret_cast<uintptr_t *>(__builtin_frame_address(0));
 			heap.collect(stack_bottom);
-			// If memory is not enough after collect, crash with OOM error
-			if (heap.m_size > HEAP_SIZE)
-			{
-				throw std::runtime_error(std::string("Error: Heap out of memory"));
-			}
-			//throw std::runtime_error(std::string("Error: Heap out of memory"));
 		}
-		if (heap.m_size + size > HEAP_SIZE)
+
+		// A new buffer is cut from a large free chunk if there is
+		// one, or else from the bump space
+		if (buffered && heap.take_buffer(size))
+			return timed(heap.bump_buffer(size, atomic, type));
+		// A lazy sweep step may find a buffer before the small
+		// free chunks are handed out one by one
+		if (buffered && heap.m_sweeping)
 		{
-			if (profiler_enabled)
-				Profiler::dispose();
-			throw std::runtime_error(std::string("Error: Heap out of memory"));
+			heap.sweep_step(heap.m_sweep_cursor + SWEEP_STEP / GRANULE_SIZE);
+			if (heap.take_buffer(size))
+				return timed(heap.bump_buffer(size, atomic, type));
+		}
+
+		// If a chunk was recycled, return the old chunk address,
+		// and otherwise bump it, growing the heap if the budget
+		// reaches past the committed memory. The part of the
+		// heap that is still to be swept lazily is swept first.
+		Header *reused_chunk = heap.try_recycle_chunks(size);
+		while (reused_chunk == nullptr && heap.m_sweeping)
+		{
+			heap.sweep_step(heap.m_sweep_cursor + SWEEP_STEP / GRANULE_SIZE);
+			reused_chunk = heap.try_recycle_chunks(size);
 		}
+		if (reused_chunk == nullptr && heap.m_top + size > heap.m_committed)
+			heap.grow(size);
 
-		// If a chunk was recycled, return the old chunk address
-		Chunk *reused_chunk = heap.try_recycle_chunks(size);
 		if (reused_chunk != nullptr)
 		{
-			if (profiler_enabled)
-				Profiler::record(ReusedChunk, reused_chunk);
+			reused_chunk->m_atomic = atomic;
+			reused_chunk->m_type = type;
+			// The events of the chunk get the end time of the
+			// allocation, which is read anyway
 			auto a_end = time_now;
-			auto a_ms = to_us(a_end - a_start);
-			Profiler::record(AllocStart, a_ms);
-			return static_cast<void *>(reused_chunk->m_start);
+			if (profiler_enabled)
+			{
+				Chunk chunk(reused_chunk);
+				uint64_t time = to_ns(a_end.time_since_epoch()).count();
+				Profiler::record(AllocStart, chunk.m_size, time);
+				Profiler::record(ReusedChunk, &chunk, time);
+			}
+			Profiler::record(AllocStart, to_ns(a_end - a_start));
+			return static_cast<void *>(reused_chunk->payload());
+		}
+
+		if (buffered)
+		{
+			size_t end = std::min(heap.m_committed, heap.m_top + BUFFER_MAX);
+			heap.set_buffer(heap.m_heap + heap.m_top, heap.m_heap + end);
+			heap.m_top = end;
+			return timed(heap.bump_buffer(size, atomic, type));
 		}
 
 		// If no free chunks was found (reused_chunk is a nullptr),
-		// then create a new chunk
-		auto new_chunk = new Chunk(size, (uintptr_t *)(heap.m_heap + heap.m_size));
+		// then create a new chunk at the bump offset
+		auto new_chunk = reinterpret_cast<Header *>(heap.m_heap + heap.m_top);
+		*new_chunk = Header {size, false, atomic, type};
+		heap.set_allocated(new_chunk);
 
+		heap.m_top += size;
 		heap.m_size += size;
-		// TODO: handle this below
-		//heap.m_total_size += size;
-		heap.m_allocated_chunks.push_back(new_chunk);
 
+		auto a_end = time_now;
 		if (profiler_enabled)
-			Profiler::record(NewChunk, new_chunk);
+		{
+			Chunk chunk(new_chunk);
+			uint64_t time = to_ns(a_end.time_since_epoch()).count();
+			Profiler::record(AllocStart, chunk.m_size, time);
+			Profiler::record(NewChunk, &chunk, time);
+		}
+		Profiler::record(AllocStart, to_ns(a_end - a_start));
+		return new_chunk->payload();
+	}
 
-		auto a_end = time_now;
-		auto a_ms = to_us(a_end - a_start);
-		Profiler::record(AllocStart, a_ms);
-		return new_chunk->m_start;
+	/**
+	 * Makes a range of free memory the allocation buffer
+	 * of the calling thread, which is handed out by
+	 * bumping cheap_alloc_cursor up to cheap_alloc_limit.
+	 * The chunks allocated in the buffer only get their
+	 * header written, and are registered in the bitmaps
+	 * by flush_buffer(). Since they are only counted
+	 * then, a buffer is at most BUFFER_MAX bytes, which
+	 * bounds how far the inline fast path can overshoot
+	 * the pacing.
+	 *
+	 * No start bit is set within a buffer until its
+	 * chunks are registered, so a stale pointer into the
+	 * part another thread has not used yet is taken for
+	 * a pointer into the chunk before the buffer, and
+	 * never for a chunk whose header is not written.
+	 *
+	 * @param start The start of the free memory.
+	 * @param end   The end of the free memory.
+	 */
+	void Heap::set_buffer(char *start, char *end)
+	{
+		size_t g = (start - m_heap) / GRANULE_SIZE;
+		clear_bits(m_start_bits, g, g + 1);
+		this_mutator->m_buffer = start;
+		this_mutator->m_buffer_end = end;
+		cheap_alloc_cursor = start;
+		cheap_alloc_limit = end;
 	}
 
 	/**
-	 * Tries to recycle used and freed chunks that are
-	 * already allocated objects by the OS but freed
-	 * from our Heap. This reduces the amount of GC
-	 * objects slightly which saves time from malloc'ing
-	 * memory from the OS.
+	 * Cuts an allocation buffer from the next free line
+	 * run of an Immix heap, or else from the largest free
+	 * chunk in m_free_tree, so that the free chunks are
+	 * used up before the bump space. The rest of a chunk
+	 * larger than BUFFER_MAX stays where it was taken
+	 * from. The runs too small for the chunk that the
+	 * buffer is taken for are skipped the way
+	 * take_line_hole() skips them.
 	 *
-	 * @param size  Amount of bytes needed for the object
-	 *              which is about to be allocated.
+	 * @param size  The size of the chunk that is bumped
+	 *              from the buffer first.
 	 *
-	 * @returns If a chunk is found and recycled, a
-	 *          pointer to the allocated memory for
-	 *          the object is returned. If not, a
-	 *          nullptr is returned to signify no
-	 *          chunks were found.
+	 * @returns False if there is no such chunk.
 	 */
-	Chunk *Heap::try_recycle_chunks(size_t size)
+	bool Heap::take_buffer(size_t size)
 	{
-		Heap &heap = Heap::the();
-		// Check if there are any freed chunks large enough for current request
-		for (size_t i = 0; i < heap.m_freed_chunks.size(); i++)
+		for (; m_next_hole < m_line_holes.size(); m_next_hole++)
 		{
-			//auto chunk = Heap::get_at(heap.m_freed_chunks, i);
-			auto chunk = heap.m_freed_chunks[i];
-			auto iter = heap.m_freed_chunks.begin();
-			i++;
-			//advance(iter, i);
-			if (chunk->m_size > size)
-			{
-				// Split the chunk, use one part and add the remaining part to
-				// the list of freed chunks
-				size_t diff = chunk->m_size - size;
-				auto chunk_complement = new Chunk(diff, chunk->m_start + chunk->m_size);
-
-				heap.m_freed_chunks.erase(iter);
-				heap.m_freed_chunks.push_back(chunk_complement);
-				heap.m_allocated_chunks.push_back(chunk);
+			Header *hole = m_line_holes[m_next_hole];
+			if (hole == nullptr)
+				continue;
+			if (hole->m_size >= size)
+				break;
+			if (size > LINE_SIZE)
+				return false;
+			push_free(hole);
+		}
+		bool hole = m_next_hole < m_line_holes.size();
+		if (!hole && m_free_tree.empty())
+			return false;
+		Header *chunk;
+		if (hole)
+		{
+			chunk = m_line_holes[m_next_hole++];
+		}
+		else
+		{
+			auto it = std::prev(m_free_tree.end());
+			chunk = it->second;
+			m_free_tree.erase(it);
+		}
+		*chunk->payload() = 0;
 
-				return chunk;
-			}
-			else if (chunk->m_size == size)
-			{
-				// Reuse the whole chunk
-				heap.m_freed_chunks.erase(iter);
-				heap.m_allocated_chunks.push_back(chunk);
-				return chunk;
-			}
+		auto start = reinterpret_cast<char *>(chunk);
+		size_t length = chunk->m_size;
+		if (length >= BUFFER_MAX + MIN_FREE_CHUNK)
+		{
+			auto rest = reinterpret_cast<Header *>(start + BUFFER_MAX);
+			*rest = Header {length - BUFFER_MAX, true, false, 0};
+			set_start(rest);
+			if (hole)
+				m_line_holes[--m_next_hole] = rest;
+			else
+				push_free(rest);
+			length = BUFFER_MAX;
 		}
-		// If no chunk was found, return nullptr
-		return nullptr;
+		set_buffer(start, start + length);
+		return true;
 	}
 
 	/**
-	 * Returns a bool whether the profiler is enabled
-	 * or not.
-	 * 
-	 * @returns True or false if the profiler is enabled
-	 * 			or disabled respectively.
-	*/
-	bool Heap::profiler_enabled() {
-		Heap &heap = Heap::the();
-		return heap.m_profiler_enable;
+	 * Allocates a chunk in the allocation buffer of the
+	 * calling thread, the same way as the inline fast
+	 * path does. The buffer must have room for it.
+	 *
+	 * @param size    The size of the chunk, including its
+	 *                header.
+	 * @param atomic  If the object contains no pointers.
+	 * @param type    The type of the object.
+	 */
+	void *Heap::bump_buffer(size_t size, bool atomic, uint16_t type)
+	{
+		auto chunk = reinterpret_cast<Header *>(cheap_alloc_cursor);
+		*chunk = Header {size, false, atomic, type};
+		cheap_alloc_cursor += size;
+		return chunk->payload();
 	}
 
 	/**
-	 * Collection phase of the garbage collector. When
-	 * an allocation is requested and there is no space
-	 * left on the heap, a collection is triggered. This
-	 * function is private so that the user cannot trigger
-	 * a collection unneccessarily.
+	 * Registers the chunks that a thread has allocated
+	 * in its allocation buffer since the last flush in
+	 * the bitmaps, and in the profiler while it is
+	 * enabled. It is called by the thread itself or,
+	 * while the thread is stopped, by the collector.
+	 *
+	 * Time complexity: O(N), where N is the number of
+	 * 					chunks allocated since the last flush.
+	 *
+	 * @param mutator   The thread whose buffer is flushed.
 	 */
-	void Heap::collect(uintptr_t *stack_bottom)
+	void Heap::flush_buffer(Mutator &mutator)
 	{
-		auto c_start = time_now;
+		if (mutator.m_buffer == nullptr)
+			return;
+
+		auto chunk = reinterpret_cast<Header *>(mutator.m_buffer);
+		auto cursor = reinterpret_cast<Header *>(*mutator.m_cursor);
+		if (m_profiler_enable)
+			Profiler::record_buffer(chunk, cursor);
+		for (; chunk < cursor; chunk = chunk->next())
+		{
+			set_allocated(chunk);
+			m_size += chunk->m_size;
+		}
+		mutator.m_buffer = *mutator.m_cursor;
+	}
 
-		Heap &heap = Heap::the();
+	/**
+	 * Flushes the allocation buffer of the calling
+	 * thread and frees the rest of it. The rest is given
+	 * back to the bump offset if the buffer ends there.
+	 * This is done before every slow path allocation
+	 * that does not fit in the buffer and before every
+	 * collection, so the heap only sees whole chunks
+	 * outside of the buffers of the other threads.
+	 *
+	 * Time complexity: O(N), where N is the number of
+	 * 					chunks allocated since the last flush.
+	 */
+	void Heap::retire_buffer()
+	{
+		Mutator *mutator = this_mutator;
+		if (mutator == nullptr || mutator->m_buffer == nullptr)
+			return;
+
+		flush_buffer(*mutator);
+		char *end = mutator->m_buffer_end;
+		// While the heap is swept lazily, the sweep may still
+		// have to reach the end of the buffer
+		if (end == m_heap + m_top && !m_sweeping)
+		{
+			m_top = cheap_alloc_cursor - m_heap;
+		}
+		else if (cheap_alloc_cursor < end)
+		{
+			// A rest too small for the free list link stays a
+			// free chunk until the next sweep
+			auto rest = reinterpret_cast<Header *>(cheap_alloc_cursor);
+			*rest = Header {size_t(end - cheap_alloc_cursor), true, false, 0};
+			set_start(rest);
+			if (rest->m_size >= MIN_FREE_CHUNK)
+				push_free(rest);
+		}
 
-		if (heap.profiler_enabled())
-			Profiler::record(CollectStart);
+		mutator->m_buffer = nullptr;
+		mutator->m_buffer_end = nullptr;
+		cheap_alloc_cursor = nullptr;
+		cheap_alloc_limit = nullptr;
+	}
 
-		// get current stack frame
-		stack_bottom = reinterpret_cast<uintptr_t *>(__builtin_frame_address(0));
+	/**
+	 * Allocates a large object in a mapping of its own,
+	 * outside of the heap, so that large objects neither
+	 * fragment the heap nor are visited by the sweep of
+	 * the heap. Large objects count towards the pacing of
+	 * the collections like the chunks on the heap.
+	 *
+	 * @param size      The amount of bytes to be allocated.
+	 * @param atomic    If the object contains no pointers.
+	 *
+	 * @returns A page-aligned header followed by the
+	 *          memory for the object.
+	 *
+	 * @throws  A runtime error if the memory cannot be
+	 *          mapped.
+	 */
+	void *Heap::alloc_large(size_t size, bool atomic)
+	{
+		static const size_t page = sysconf(_SC_PAGESIZE);
+		size = (size + sizeof(Header) + page - 1) & ~(page - 1);
+
+		if (m_marking || allocated() + size > m_next_gc)
+		{
+			__builtin_unwind_init();
+			auto stack_bottom = reinterpret_cast<uintptr_t *>(__builtin_frame_address(0));
+			collect(stack_bottom);
+		}
 
-		if (heap.m_stack_top == nullptr)
+		void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED)
+		{
+			if (m_profiler_enable)
+				Profiler::dispose();
+			throw std::runtime_error(std::string("Error: Heap out of memory"));
+		}
+
+		auto chunk = static_cast<Header *>(addr);
+		*chunk = Header {size, false, atomic, 0};
+		std::lock_guard<std::mutex> lock(m_large_lock);
+		m_large_chunks.emplace(reinterpret_cast<uintptr_t>(chunk->payload()), LargeChunk {chunk, m_marking});
+		m_large_size += size;
+		m_large_min = std::min(m_large_min, reinterpret_cast<uintptr_t>(chunk->payload()));
+		m_large_max = std::max(m_large_max, reinterpret_cast<uintptr_t>(chunk->next()));
+
+		if (m_profiler_enable)
+		{
+			Chunk record(chunk);
+			Profiler::record(NewChunk, &record);
+		}
+		return chunk->payload();
+	}
+
+	/**
+	 * Commits enough segments at the end of the committed
+	 * part of the heap to fit an allocation of the given
+	 * size on top of the current bump offset. At least
+	 * as many bytes as are already committed are added,
+	 * so the number of calls to grow() is logarithmic
+	 * in the size of the heap.
+	 *
+	 * @param size  Amount of bytes that must fit on the
+	 *              heap after growing.
+	 *
+	 * @throws  A runtime error if the reserved address
+	 *          space is exhausted or if the memory cannot
+	 *          be committed.
+	 */
+	void Heap::grow(size_t size)
+	{
+		size_t needed = m_top + size;
+		size_t target = std::max(needed, std::max(2 * m_committed, SEGMENT_SIZE));
+		// Round up to whole segments
+		target = (target + SEGMENT_SIZE - 1) & ~(SEGMENT_SIZE - 1);
+		if (target > m_reserved)
+			target = m_reserved;
+		if (target < needed)
+		{
+			if (m_profiler_enable)
+				Profiler::dispose();
+			throw std::runtime_error(std::string("Error: Heap out of memory"));
+		}
+
+		// The bitmaps and the line table of a segment are a whole
+		// number of pages, and the new pages are zero, so they have
+		// no chunk starts and no marked lines
+		size_t bits_from = bitmap_size(m_committed), bits_to = bitmap_size(target);
+		if (mprotect(m_heap + m_committed, target - m_committed, PROT_READ | PROT_WRITE) != 0
+			|| mprotect(reinterpret_cast<char *>(m_start_bits) + bits_from, bits_to - bits_from, PROT_READ | PROT_WRITE) != 0
+			|| mprotect(reinterpret_cast<char *>(m_mark_bits) + bits_from, bits_to - bits_from, PROT_READ | PROT_WRITE) != 0
+			|| mprotect(reinterpret_cast<char *>(m_pin_bits) + bits_from, bits_to - bits_from, PROT_READ | PROT_WRITE) != 0
+			|| mprotect(m_line_marks + line_table_size(m_committed), line_table_size(target) - line_table_size(m_committed), PROT_READ | PROT_WRITE) != 0)
+			throw std::runtime_error(std::string("Error: Could not commit memory for the heap"));
+		m_committed = target;
+	}
+
+	/**
+	 * Tries to recycle used and freed chunks that are
+	 * already allocated objects by the OS but freed
+	 * from our Heap. A small chunk is taken from the free
+	 * list of the request's size class or, if that list
+	 * is empty, from the next larger class that is not
+	 * empty. A medium chunk, or a small one that no class
+	 * could provide, is the best fit in m_free_tree. The
+	 * remainder of the chunk is freed again.
+	 *
+	 * Time complexity: O(1) for small chunks, finding the
+	 * 					next class is a scan over
+	 * 					NUM_SIZE_CLASSES bits, and O(log N)
+	 * 					for medium ones, where N is the
+	 * 					number of medium free chunks.
+	 *
+	 * @param size  Amount of bytes needed for the object
+	 *              which is about to be allocated, rounded
+	 *              up to its size class if it is small.
+	 *
+	 * @returns If a chunk is found and recycled, a
+	 *          pointer to the allocated memory for
+	 *          the object is returned. If not, a
+	 *          nullptr is returned to signify no
+	 *          chunks were found.
+	 */
+	Header *Heap::try_recycle_chunks(size_t size)
+	{
+		Heap &heap = Heap::the();
+		Header *chunk = nullptr;
+		if (size < MEDIUM_CHUNK_MIN)
+		{
+			size_t cls = heap.next_free_class(size_class(size));
+			if (cls != NUM_SIZE_CLASSES)
+				chunk = heap.pop_free(cls);
+		}
+		if (chunk == nullptr)
+		{
+			// The smallest chunk that fits, and the one with the
+			// lowest address of those
+			auto it = heap.m_free_tree.lower_bound(std::make_pair(size, nullptr));
+			if (it != heap.m_free_tree.end())
+			{
+				chunk = it->second;
+				heap.m_free_tree.erase(it);
+			}
+			else
+			{
+				chunk = heap.take_line_hole(size);
+			}
+			if (chunk == nullptr)
+				return nullptr;
+		}
+
+		// Split the chunk, use one part and free the remaining part.
+		// A remainder too small to hold the free list link is left
+		// in the chunk.
+		if (chunk->m_size - size >= MIN_FREE_CHUNK)
+		{
+			auto complement = reinterpret_cast<Header *>(reinterpret_cast<char *>(chunk) + size);
+			*complement = Header {chunk->m_size - size, true, false, 0};
+			heap.set_start(complement);
+			heap.push_free(complement);
+			chunk->m_size = size;
+		}
+		chunk->m_free = false;
+		heap.set_allocated(chunk);
+		// The free list link would otherwise stay in the object
+		// as a pointer to another chunk, for example next to the
+		// tag byte of a constructor
+		*chunk->payload() = 0;
+
+		heap.m_size += chunk->m_size;
+		return chunk;
+	}
+
+	/**
+	 * Takes the start of the next free line run that a
+	 * chunk fits in, the way an allocation buffer would.
+	 * The runs that a small chunk is skipped over are
+	 * freed, and a chunk larger than a line that does
+	 * not fit the next run is taken from the runs after
+	 * it by take_overflow_hole(), like the overflow
+	 * allocation of Immix, instead of skipping runs for
+	 * it.
+	 *
+	 * @param size  The size of the chunk.
+	 *
+	 * @returns The free chunk at the start of the run,
+	 *          cut to size with the rest left as the
+	 *          next run, or nullptr if there is none.
+	 */
+	Header *Heap::take_line_hole(size_t size)
+	{
+		for (; m_next_hole < m_line_holes.size(); m_next_hole++)
+		{
+			Header *hole = m_line_holes[m_next_hole];
+			if (hole == nullptr)
+				continue;
+			if (hole->m_size >= size)
+				return cut_line_hole(m_next_hole, size);
+			if (size > LINE_SIZE)
+				return take_overflow_hole(size);
+			push_free(hole);
+		}
+		return nullptr;
+	}
+
+	/**
+	 * Takes the start of the first free line run after
+	 * the overflow cursor that a chunk larger than a line
+	 * fits in. The runs it passes stay for the smaller
+	 * chunks, and the cursor never moves back within a
+	 * cycle, so the runs are searched once per cycle.
+	 *
+	 * @param size  The size of the chunk.
+	 *
+	 * @returns The free chunk at the start of the run, or
+	 *          nullptr if there is none, and the chunk
+	 *          goes to the bump space.
+	 */
+	Header *Heap::take_overflow_hole(size_t size)
+	{
+		for (m_overflow_hole = std::max(m_overflow_hole, m_next_hole); m_overflow_hole < m_line_holes.size(); m_overflow_hole++)
+		{
+			Header *hole = m_line_holes[m_overflow_hole];
+			if (hole != nullptr && hole->m_size >= size)
+				return cut_line_hole(m_overflow_hole, size);
+		}
+		return nullptr;
+	}
+
+	/**
+	 * Cuts a chunk from the start of a free line run. The
+	 * rest is left in its place, or the run is used up if
+	 * the rest is too small for the free list link.
+	 *
+	 * @param index The index of the run in m_line_holes.
+	 * @param size  The size of the chunk.
+	 *
+	 * @returns The free chunk at the start of the run.
+	 */
+	Header *Heap::cut_line_hole(size_t index, size_t size)
+	{
+		Header *hole = m_line_holes[index];
+		if (hole->m_size - size < MIN_FREE_CHUNK)
+		{
+			m_line_holes[index] = nullptr;
+			return hole;
+		}
+		auto rest = reinterpret_cast<Header *>(reinterpret_cast<char *>(hole) + size);
+		*rest = Header {hole->m_size - size, true, false, 0};
+		set_start(rest);
+		m_line_holes[index] = rest;
+		hole->m_size = size;
+		return hole;
+	}
+
+	/**
+	 * @param cls   The smallest class that is acceptable.
+	 *
+	 * @returns The smallest class, not smaller than cls,
+	 *          with a non-empty free list or
+	 *          NUM_SIZE_CLASSES if there is none.
+	 */
+	size_t Heap::next_free_class(size_t cls)
+	{
+		for (size_t w = cls / 64; w < NUM_SIZE_CLASSES / 64; w++)
+		{
+			uint64_t bits = m_free_mask[w];
+			if (w == cls / 64)
+				bits &= ~(uint64_t)0 << (cls % 64);
+			if (bits)
+				return w * 64 + __builtin_ctzll(bits);
+		}
+		return NUM_SIZE_CLASSES;
+	}
+
+	/**
+	 * Adds a free chunk to m_free_tree if it is a medium
+	 * chunk, or else to the free list of the largest class
+	 * that fits inside it, so every chunk on a list can
+	 * hold any request of that class. The link to the next
+	 * chunk on the list is stored after the header.
+	 *
+	 * @param chunk The chunk to add, at least
+	 *              MIN_FREE_CHUNK bytes large.
+	 */
+	void Heap::push_free(Header *chunk)
+	{
+		chunk->m_free = true;
+		if (chunk->m_size >= MEDIUM_CHUNK_MIN)
+		{
+			m_free_tree.emplace(size_t(chunk->m_size), chunk);
+			return;
+		}
+
+		size_t cls = floor_class(chunk->m_size);
+		*reinterpret_cast<Header **>(chunk->payload()) = m_free_lists[cls];
+		m_free_lists[cls] = chunk;
+		m_free_mask[cls / 64] |= (uint64_t)1 << (cls % 64);
+	}
+
+	/**
+	 * Removes a chunk from a free list which must not
+	 * be empty.
+	 *
+	 * @param cls   The class of the free list.
+	 *
+	 * @returns The removed chunk.
+	 */
+	Header *Heap::pop_free(size_t cls)
+	{
+		Header *chunk = m_free_lists[cls];
+		m_free_lists[cls] = *reinterpret_cast<Header **>(chunk->payload());
+		if (m_free_lists[cls] == nullptr)
+			m_free_mask[cls / 64] &= ~((uint64_t)1 << (cls % 64));
+		return chunk;
+	}
+
+	/**
+	 * Returns a bool whether the profiler is enabled
+	 * or not.
+	 * 
+	 * @returns True or false if the profiler is enabled
+	 * 			or disabled respectively.
+	*/
+	bool Heap::profiler_enabled() {
+		Heap &heap = Heap::the();
+		return heap.m_profiler_enable;
+	}
+
+	/**
+	 * Collection phase of the garbage collector. When
+	 * an allocation would take the allocated bytes past
+	 * the trigger set by pace(), a collection is
+	 * triggered. This function is private so that the
+	 * user cannot trigger a collection unneccessarily.
+	 *
+	 * The first call of a collection marks the roots.
+	 * Every call then marks for at most m_mark_budget,
+	 * and the call that empties the worklist finishes
+	 * the collection. The other attached threads are
+	 * stopped during every call.
+	 */
+	void Heap::collect(uintptr_t *stack_bottom)
+	{
+		auto c_start = time_now;
+
+		Heap &heap = Heap::the();
+
+		heap.retire_buffer();
+
+		// get current stack frame
+		stack_bottom = reinterpret_cast<uintptr_t *>(__builtin_frame_address(0));
+
+		if (this_mutator == nullptr)
 			throw std::runtime_error(std::string("Error: Heap is not initialized, read the docs!"));
+		heap.stop_world();
 
-		// uintptr_t *stack_top = heap.m_stack_top;
+		// Chunks are only moved if nothing ran during the mark,
+		// so that every ambiguous word has been seen
+		bool stopped_mark = !heap.m_marking;
+		if (!heap.m_marking)
+		{
+			if (heap.profiler_enabled())
+				Profiler::record(CollectStart);
+
+			// The rest of a lazy sweep is done before the mark
+			// bits are used again
+			if (heap.m_sweeping)
+				heap.sweep_step(heap.m_sweep_top);
+
+			// A minor collection keeps the marks of the old
+			// chunks, a major one of a generational heap
+			// starts from none
+			heap.m_minor = heap.m_sticky && heap.m_generational && heap.m_live < heap.m_major_target;
+			if (heap.m_sticky && !heap.m_minor)
+				heap.clear_marks();
+			heap.m_sticky = heap.m_generational;
+
+			heap.m_pinning = heap.m_compact && !heap.m_minor;
+			if (heap.m_pinning)
+				clear_bits(heap.m_pin_bits, 0, heap.m_top / GRANULE_SIZE);
+			// A minor collection adds the lines of the young
+			// survivors to the lines of the old chunks
+			if (!heap.m_minor)
+				heap.m_marking_lines = heap.m_immix;
+			if (heap.m_marking_lines && !heap.m_minor)
+				std::fill(heap.m_line_marks, heap.m_line_marks + (heap.m_top + LINE_SIZE - 1) / LINE_SIZE, 0);
+
+			// The pages written from here on are scanned again
+			// by remark()
+			bool concurrent = heap.m_concurrent && clear_soft_dirty();
+
+			heap.m_cycle_allocated = heap.allocated() - heap.m_live;
+			heap.m_cycle_size = heap.m_size;
+			heap.m_marked_bytes = 0;
+			vector<uintptr_t *> roots;
+			// cout << "\nb4 find_roots\n";
+			find_roots(stack_bottom, roots);
+
+			// cout << "b4 mark\n";''
+			mark(roots);
+			heap.m_marking = true;
+			if (concurrent)
+				heap.start_marker();
+		}
 
-		//auto work_list = heap.m_allocated_chunks;
-		//mark(stack_bottom, stack_top, work_list);
+		// Finish the mark at once if the allocations during the
+		// mark have used up the budget of pace() a second time
+		auto budget = heap.m_mark_budget;
+		bool hurry = heap.allocated() >= 2 * heap.m_next_gc - heap.m_live;
+		if (hurry)
+			budget = std::chrono::microseconds(0);
 
-		// Testing mark_hash, previous woking implementation above
-		// create_table();
-		// mark_hash(stack_bottom, stack_top);
+		// Keep running while the marker thread is busy, and
+		// finish its mark with the program stopped
+		if (!heap.m_marker_running || hurry || heap.m_marker_done.load(std::memory_order_acquire))
+		{
+			auto m_start = time_now;
+			if (heap.m_marker_running)
+			{
+				heap.m_marker.join();
+				heap.m_marker_running = false;
+				heap.m_atomic_bits = false;
+				heap.remark(stack_bottom);
+				budget = std::chrono::microseconds(0);
+			}
+			// A compaction is timed as part of the mark
+			bool marked = heap.mark_slice(budget);
+			if (marked && heap.m_pinning && stopped_mark)
+				heap.m_marking_lines ? heap.evacuate() : heap.compact();
+			Profiler::record(MarkStart, to_ns(time_now - m_start));
+			if (marked)
+				heap.finish_collect();
+		}
 
-		create_table();
-		vector<uintptr_t *> roots;
-		// cout << "\nb4 find_roots\n";
-		find_roots(stack_bottom, roots);
+		heap.start_world();
+		auto c_end = time_now;
+		
+		Profiler::record(CollectStart, to_ns(c_end - c_start));
+	}
 
-		// cout << "b4 mark\n";''
-		mark(roots);
+	/**
+	 * Stops every other attached thread with SIG_SUSPEND
+	 * and waits until each of them has saved where its
+	 * stack ends. The chunks the threads have allocated
+	 * in their buffers are then registered, so that the
+	 * collection sees them.
+	 */
+	void Heap::stop_world()
+	{
+		m_world_stopped.store(true, std::memory_order_release);
+		size_t stopped = 0;
+		for (Mutator *mutator : m_mutators)
+		{
+			if (mutator != this_mutator)
+			{
+				pthread_kill(mutator->m_thread, SIG_SUSPEND);
+				stopped++;
+			}
+		}
+		for (; stopped > 0; stopped--)
+			while (sem_wait(&m_ack) != 0);
+
+		for (Mutator *mutator : m_mutators)
+			if (mutator != this_mutator)
+				flush_buffer(*mutator);
+	}
+
+	/**
+	 * Lets the threads stopped by stop_world() run again,
+	 * and waits until each of them has left its signal
+	 * handler, so that a handler never sees the next stop.
+	 */
+	void Heap::start_world()
+	{
+		m_world_stopped.store(false, std::memory_order_release);
+		size_t stopped = 0;
+		for (Mutator *mutator : m_mutators)
+		{
+			if (mutator != this_mutator)
+			{
+				mutator->m_stack_bottom = nullptr;
+				pthread_kill(mutator->m_thread, SIG_RESUME);
+				stopped++;
+			}
+		}
+		for (; stopped > 0; stopped--)
+			while (sem_wait(&m_ack) != 0);
+	}
+
+	/**
+	 * The handler of SIG_SUSPEND, run by a thread that
+	 * a collection stops. The callee-saved registers are
+	 * spilled into its frame, which is where the stack
+	 * scan of the thread begins, and the thread then
+	 * waits for SIG_RESUME until the collection is done.
+	 * Only async-signal-safe calls are made.
+	 */
+	void Heap::suspend_handler(int)
+	{
+		int saved_errno = errno;
+		Heap &heap = Heap::the();
+
+		__builtin_unwind_init();
+		this_mutator->m_stack_bottom = reinterpret_cast<uintptr_t *>(__builtin_frame_address(0));
+		sem_post(&heap.m_ack);
+
+		sigset_t mask;
+		sigfillset(&mask);
+		sigdelset(&mask, SIG_RESUME);
+		while (heap.m_world_stopped.load(std::memory_order_acquire))
+			sigsuspend(&mask);
+
+		sem_post(&heap.m_ack);
+		errno = saved_errno;
+	}
+
+	/**
+	 * The handler of SIG_RESUME, which only has to
+	 * interrupt the sigsuspend() of suspend_handler().
+	 */
+	void Heap::resume_handler(int) {}
 
+	/**
+	 * Ends a collection once the mark is done, by
+	 * sweeping and freeing the heap and setting the
+	 * trigger of the next collection. With lazy sweeping
+	 * only the large objects are swept, and the bytes
+	 * left on the heap are the marked ones and the ones
+	 * allocated during the mark, plus the old ones that
+	 * a minor collection does not mark.
+	 */
+	void Heap::finish_collect()
+	{
+		m_marking = false;
+
+		if (m_lazy_sweep && !m_marking_lines)
+		{
+			clear_free();
+			m_size = (m_minor ? m_old_size : 0) + m_marked_bytes + (m_size - m_cycle_size);
+			m_sweep_cursor = 0;
+			m_sweep_top = m_top / GRANULE_SIZE;
+			m_sweeping = true;
+			sweep_large();
+			pace(m_cycle_allocated);
+			return;
+		}
+
+		auto s_start = time_now;
 		// cout << "b4 sweep\n";
-		sweep(heap);
+		sweep(*this);
+		Profiler::record(SweepStart, to_ns(time_now - s_start));
 
 		// cout << "b4 free\n";
-		free(heap);
-		
-		auto c_end = time_now;
-		
-		Profiler::record(CollectStart, to_us(c_end - c_start));
+		free(*this);
+
+		pace(m_cycle_allocated);
+	}
+
+	/**
+	 * Sets the trigger of the next collection from the
+	 * bytes that survived this one, which are allowed to
+	 * grow by m_gc_percent percent, so that the work of
+	 * a collection, which is mostly marking the live
+	 * data, is paid for by a proportional amount of
+	 * allocation.
+	 *
+	 * In generational mode that growth is the trigger of
+	 * the next major collection instead, which is set by
+	 * the major ones, and the next collection starts
+	 * once NURSERY_SIZE bytes have been allocated.
+	 *
+	 * @param allocated The bytes allocated since the
+	 *                  last collection.
+	 */
+	void Heap::pace(size_t allocated)
+	{
+		m_live = this->allocated();
+		m_old_size = m_size;
+		size_t target = std::max(m_live + m_live / 100 * m_gc_percent, GC_TRIGGER_MIN);
+		if (!m_minor)
+			m_major_target = target;
+		m_next_gc = m_generational ? m_live + NURSERY_SIZE : target;
+		if (m_profiler_enable)
+			Profiler::record(PacingTarget {m_live, allocated, m_next_gc, m_minor, m_minor ? m_marked_bytes : 0});
+	}
+
+	/**
+	 * Unmarks every chunk on the heap and every large
+	 * object, so that a major collection after minor
+	 * ones traces the whole heap again.
+	 *
+	 * Time complexity: O(H / 64 + N), where H is the number
+	 * 					of granules on the heap and N is the
+	 * 					number of large objects.
+	 */
+	void Heap::clear_marks()
+	{
+		size_t words = (m_top / GRANULE_SIZE + 63) / 64;
+		std::fill(m_mark_bits, m_mark_bits + words, m_mark_epoch ? 0 : ~(uint64_t)0);
+		for (auto &large : m_large_chunks)
+			large.second.m_marked = false;
+	}
+
+	/**
+	 * @returns The granules of the allocation buffers of
+	 *          the other threads that they have not used
+	 *          yet, from where to where, by address.
+	 */
+	vector<std::pair<size_t, size_t>> Heap::buffer_holes() const
+	{
+		vector<std::pair<size_t, size_t>> holes;
+		for (Mutator *mutator : m_mutators)
+			if (mutator->m_buffer != nullptr)
+				holes.emplace_back((mutator->m_buffer - m_heap) / GRANULE_SIZE, (mutator->m_buffer_end - m_heap) / GRANULE_SIZE);
+		std::sort(holes.begin(), holes.end());
+		return holes;
+	}
+
+	/**
+	 * Slides the live chunks that are not pinned down to
+	 * the bottom of the heap, in address order, once a
+	 * pinning mark is done. A chunk moves to the lowest
+	 * place after the chunks before it where it does not
+	 * overlap a pinned chunk or the allocation buffer of
+	 * another thread, so no chunk moves up, and a chunk
+	 * only moves over memory below its end, which holds
+	 * no start bit of a chunk that is still to move.
+	 *
+	 * Time complexity: O(H / 64 + L log M), where H is the
+	 * 					number of granules on the heap, L is
+	 * 					the number of live chunks and M is
+	 * 					the number of chunks that move.
+	 */
+	void Heap::compact()
+	{
+		size_t top = m_top / GRANULE_SIZE, words = (top + 63) / 64;
+
+		vector<std::pair<size_t, size_t>> holes = buffer_holes();
+
+		// The chunks that move, from where to where, by address
+		vector<std::pair<Header *, Header *>> moves;
+		size_t cursor = 0, h = 0;
+		for (size_t w = 0; w < words; w++)
+		{
+			for (uint64_t live = live_bits(w); live; live &= live - 1)
+			{
+				size_t g = w * 64 + __builtin_ctzll(live);
+				auto chunk = reinterpret_cast<Header *>(m_heap + g * GRANULE_SIZE);
+				for (; h < holes.size() && holes[h].first <= g; h++)
+					cursor = std::max(cursor, holes[h].second);
+				if (is_pinned(g))
+					cursor = g;
+				else if (cursor != g)
+					moves.emplace_back(chunk, reinterpret_cast<Header *>(m_heap + cursor * GRANULE_SIZE));
+				cursor += chunk->m_size / GRANULE_SIZE;
+			}
+		}
+		move_chunks(moves);
+	}
+
+	/**
+	 * Moves chunks once a pinning mark is done. The
+	 * pointer words of the typed chunks are changed
+	 * first, at the old places of the chunks, and the
+	 * chunks are then moved together with their bits, in
+	 * the order of the moves. The memory they leave is
+	 * swept like that of dead chunks.
+	 *
+	 * Time complexity: O(H / 64 + P log M), where H is the
+	 * 					number of granules on the heap, P is
+	 * 					the number of pointer words of the
+	 * 					live chunks and M is the number of
+	 * 					chunks that move.
+	 *
+	 * @param moves The chunks that move, from where to
+	 *              where, sorted by where they are.
+	 */
+	void Heap::move_chunks(const vector<std::pair<Header *, Header *>> &moves)
+	{
+		if (moves.empty())
+			return;
+
+		size_t words = (m_top / GRANULE_SIZE + 63) / 64;
+		auto forward = [&](uintptr_t &word)
+		{
+			if (!contains(word))
+				return;
+			Header *target = find_enclosing(word);
+			auto it = std::lower_bound(moves.begin(), moves.end(), std::make_pair(target, (Header *)nullptr));
+			if (target != nullptr && it != moves.end() && it->first == target)
+				word += reinterpret_cast<char *>(it->second) - reinterpret_cast<char *>(target);
+		};
+		for (size_t w = 0; w < words; w++)
+		{
+			for (uint64_t live = live_bits(w); live; live &= live - 1)
+			{
+				auto chunk = reinterpret_cast<Header *>(m_heap + (w * 64 + __builtin_ctzll(live)) * GRANULE_SIZE);
+				uint64_t pointers;
+				if (chunk->m_atomic || !pointer_map(chunk, pointers))
+					continue;
+				uintptr_t *payload = chunk->payload();
+				for (; pointers; pointers &= pointers - 1)
+					forward(payload[__builtin_ctzll(pointers)]);
+			}
+		}
+
+		for (auto [from, to] : moves)
+		{
+			size_t size = from->m_size, g = granule(to);
+			clear_bits(m_start_bits, granule(from), granule(from) + 1);
+			memmove(to, from, size);
+			clear_bits(m_start_bits, g, g + size / GRANULE_SIZE);
+			set_start(to);
+			set_mark(g, m_mark_epoch);
+			if (m_marking_lines)
+				mark_lines(to);
+		}
+	}
+
+	/**
+	 * Evacuates the blocks of an Immix heap that the last
+	 * sweep chose, once a pinning mark is done. The live
+	 * chunks of the blocks that are not pinned are moved
+	 * in address order into the free lines of the other
+	 * blocks, which are bumped through like an allocation
+	 * buffer. A chunk larger than a line that does not
+	 * fit the rest of a run stays where it is, and so do
+	 * the chunks left when the free lines run out. The
+	 * lines of the evacuated blocks are then marked again
+	 * for the chunks that stay, so that the sweep frees
+	 * the rest.
+	 *
+	 * Time complexity: O(H / LINE_SIZE + E / 64 + P log M),
+	 * 					where H is the size of the heap, E
+	 * 					is the number of granules of the
+	 * 					evacuated blocks, P is the number
+	 * 					of pointer words of the live chunks
+	 * 					and M is the number of chunks that
+	 * 					move.
+	 */
+	void Heap::evacuate()
+	{
+		size_t top = m_top / GRANULE_SIZE, lines = (m_top + LINE_SIZE - 1) / LINE_SIZE;
+		size_t blocks = std::min(m_evacuate.size(), (lines + LINES_PER_BLOCK - 1) / LINES_PER_BLOCK);
+		auto evacuated = [&](size_t line) { return line / LINES_PER_BLOCK < blocks && m_evacuate[line / LINES_PER_BLOCK]; };
+		mark_buffer_lines();
+
+		// The next run of free lines outside the evacuated blocks
+		size_t line = 0;
+		char *cursor = nullptr, *limit = nullptr;
+		auto next_run = [&]
+		{
+			while (line < lines && (m_line_marks[line] || evacuated(line)))
+				line++;
+			if (line == lines)
+				return false;
+			cursor = m_heap + line * LINE_SIZE;
+			while (line < lines && !m_line_marks[line] && !evacuated(line))
+				line++;
+			limit = std::min(m_heap + line * LINE_SIZE, m_heap + m_top);
+			return true;
+		};
+
+		vector<std::pair<Header *, Header *>> moves;
+		bool room = next_run();
+		for (size_t b = 0; b < blocks && room; b++)
+		{
+			if (!m_evacuate[b])
+				continue;
+			size_t words = std::min((b + 1) * BLOCK_SIZE / GRANULE_SIZE, top + 63) / 64;
+			for (size_t w = b * BLOCK_SIZE / GRANULE_SIZE / 64; w < words && room; w++)
+			{
+				for (uint64_t live = live_bits(w); live && room; live &= live - 1)
+				{
+					size_t g = w * 64 + __builtin_ctzll(live);
+					auto chunk = reinterpret_cast<Header *>(m_heap + g * GRANULE_SIZE);
+					if (is_pinned(g))
+						continue;
+					size_t size = chunk->m_size;
+					if (cursor + size > limit)
+					{
+						if (size > LINE_SIZE)
+							continue;
+						// A run holds at least a line
+						room = next_run();
+						if (!room)
+							break;
+					}
+					moves.emplace_back(chunk, reinterpret_cast<Header *>(cursor));
+					cursor += size;
+				}
+			}
+		}
+		move_chunks(moves);
+
+		for (size_t b = 0; b < blocks; b++)
+		{
+			if (!m_evacuate[b])
+				continue;
+			size_t first = b * LINES_PER_BLOCK, last = std::min(first + LINES_PER_BLOCK, lines);
+			std::fill(m_line_marks + first, m_line_marks + last, 0);
+			// A chunk that stays may reach into the block from the
+			// one before
+			if (b > 0)
+			{
+				Header *chunk = chunk_at(reinterpret_cast<uintptr_t>(m_heap + first * LINE_SIZE) - 1);
+				if (chunk != nullptr && !chunk->m_free && is_marked(chunk)
+					&& reinterpret_cast<char *>(chunk->next()) > m_heap + first * LINE_SIZE)
+					mark_lines(chunk);
+			}
+			size_t words = std::min((b + 1) * BLOCK_SIZE / GRANULE_SIZE, top + 63) / 64;
+			for (size_t w = b * BLOCK_SIZE / GRANULE_SIZE / 64; w < words; w++)
+				for (uint64_t live = live_bits(w); live; live &= live - 1)
+					mark_lines(reinterpret_cast<Header *>(m_heap + (w * 64 + __builtin_ctzll(live)) * GRANULE_SIZE));
+		}
+		mark_buffer_lines();
 	}
 
+	/**
+	 * Marks the lines of the allocation buffers of the
+	 * other threads, which are in use even though the
+	 * mark found no chunks in them.
+	 */
+	void Heap::mark_buffer_lines()
+	{
+		for (auto [from, to] : buffer_holes())
+			std::fill(m_line_marks + from * GRANULE_SIZE / LINE_SIZE, m_line_marks + (to * GRANULE_SIZE + LINE_SIZE - 1) / LINE_SIZE, 1);
+	}
+
+	/**
+	 * Drains the worklist with m_mark_threads threads,
+	 * the calling one included. The ranges on the worklist,
+	 * which are the objects found from the roots, are dealt
+	 * out to the deques of the threads round robin.
+	 */
+	void Heap::parallel_mark()
+	{
+		size_t threads = m_mark_threads;
+		std::vector<std::unique_ptr<WorkDeque>> deques;
+		for (size_t i = 0; i < threads; i++)
+			deques.emplace_back(new WorkDeque());
+		for (size_t i = 0; !m_worklist.empty(); i++)
+		{
+			deques[i % threads]->push(m_worklist.front());
+			m_worklist.pop();
+		}
+
+		// The marker thread of a concurrent mark already
+		// changes the bitmaps atomically
+		bool atomic_bits = m_atomic_bits;
+		m_atomic_bits = true;
+
+		std::atomic<size_t> idle {0}, marked {0};
+		vector<std::thread> workers;
+		for (size_t i = 1; i < threads; i++)
+			workers.emplace_back(&Heap::mark_worker, this, i, std::ref(deques), std::ref(idle), std::ref(marked));
+		mark_worker(0, deques, idle, marked);
+		for (std::thread &worker : workers)
+			worker.join();
+		m_marked_bytes += marked.load(std::memory_order_relaxed);
+
+		if (!atomic_bits)
+			m_atomic_bits = false;
+	}
+
+	/**
+	 * The loop of a thread of the parallel mark. A thread
+	 * scans the ranges of its own deque, and steals from
+	 * the others once it is empty. A thread that finds no
+	 * work is idle until another deque has ranges again,
+	 * and the mark is done when all threads are idle,
+	 * since only threads that are not idle push ranges.
+	 *
+	 * @param id        The index of the deque of the thread.
+	 * @param deques    The deques of all threads.
+	 * @param idle      The number of idle threads.
+	 * @param marked    The bytes of the heap chunks marked
+	 *                  by all threads.
+	 */
+	void Heap::mark_worker(size_t id, std::vector<std::unique_ptr<WorkDeque>> &deques, std::atomic<size_t> &idle, std::atomic<size_t> &marked)
+	{
+		size_t threads = deques.size();
+		WorkDeque &own = *deques[id];
+		WorkDeque::Range range;
+		size_t own_marked = 0;
+
+		auto steal = [&]
+		{
+			for (size_t i = 1; i < threads; i++)
+				if (deques[(id + i) % threads]->steal(range))
+					return true;
+			return false;
+		};
+
+		while (true)
+		{
+			if (own.pop(range) || steal())
+			{
+				WorkDeque::Range found;
+				if (range.first & TYPED_RANGE)
+				{
+					auto payload = reinterpret_cast<uintptr_t *>(range.first & ~TYPED_RANGE);
+					for (uint64_t pointers = range.second; pointers; pointers &= pointers - 1)
+						if (grey(payload[__builtin_ctzll(pointers)], found, own_marked, false))
+							own.push(found);
+					continue;
+				}
+
+				auto addr_bottom = reinterpret_cast<uintptr_t *>(range.first);
+				auto addr_top = reinterpret_cast<uintptr_t *>(range.second);
+				// Leave the rest of a large object to be stolen
+				if (addr_top - addr_bottom > MARK_STEP)
+				{
+					addr_top = addr_bottom + MARK_STEP;
+					own.push(std::make_pair(reinterpret_cast<uintptr_t>(addr_top), range.second));
+				}
+
+				for (; addr_bottom < addr_top; addr_bottom++)
+					if (grey(*addr_bottom, found, own_marked, true))
+						own.push(found);
+				continue;
+			}
+
+			idle.fetch_add(1, std::memory_order_acq_rel);
+			while (true)
+			{
+				if (idle.load(std::memory_order_acquire) == threads)
+				{
+					marked.fetch_add(own_marked, std::memory_order_relaxed);
+					return;
+				}
+				bool work = false;
+				for (auto &deque : deques)
+					work = work || !deque->empty();
+				if (work)
+				{
+					idle.fetch_sub(1, std::memory_order_acq_rel);
+					break;
+				}
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	/**
+	 * Starts a marker thread that drains the worklist
+	 * while the program keeps running.
+	 */
+	void Heap::start_marker()
+	{
+		m_marker_done.store(false, std::memory_order_relaxed);
+		m_marker_running = true;
+		m_atomic_bits = true;
+		m_marker = std::thread([this]
+		{
+			mark_slice(std::chrono::microseconds(0));
+			m_marker_done.store(true, std::memory_order_release);
+		});
+	}
+
+	/**
+	 * Completes a concurrent mark with the program
+	 * stopped. The objects that the marker thread has
+	 * scanned can only have changed if they are on pages
+	 * written since the mark started, so the stack and
+	 * the marked objects on those pages are scanned
+	 * again. The objects found are added to the worklist.
+	 *
+	 * Time complexity: O(P + D), where P is the number of
+	 * 					pages of the heap and D is the size
+	 * 					of the pages written during the mark.
+	 *
+	 * @throws  A runtime error if the written pages
+	 *          cannot be read.
+	 */
+	void Heap::remark(uintptr_t *stack_bottom)
+	{
+		vector<uintptr_t *> roots;
+		find_roots(stack_bottom, roots);
+		mark(roots);
+
+		int pagemap = open("/proc/self/pagemap", O_RDONLY);
+		if (pagemap < 0)
+			throw std::runtime_error(std::string("Error: Could not read the dirty pages of the heap"));
+		rescan_dirty(pagemap, m_heap, m_heap + m_top);
+		for (auto &large : m_large_chunks)
+		{
+			Header *chunk = large.second.m_header;
+			if (large.second.m_marked && !chunk->m_atomic)
+				rescan_dirty(pagemap, reinterpret_cast<char *>(large.first), reinterpret_cast<char *>(chunk->next()));
+		}
+		close(pagemap);
+	}
+
+	/**
+	 * Scans the marked objects on the soft-dirty pages
+	 * of a range of memory again.
+	 *
+	 * @param pagemap   The open /proc/self/pagemap.
+	 * @param from      The start of the range.
+	 * @param to        The end of the range.
+	 *
+	 * @throws  A runtime error if the pagemap cannot
+	 *          be read.
+	 */
+	void Heap::rescan_dirty(int pagemap, char *from, char *to)
+	{
+		static const uintptr_t page = sysconf(_SC_PAGESIZE);
+		uint64_t entries[512];
+		uintptr_t first = reinterpret_cast<uintptr_t>(from) / page;
+		uintptr_t last = (reinterpret_cast<uintptr_t>(to) + page - 1) / page;
+		for (uintptr_t p = first; p < last; p += 512)
+		{
+			size_t n = std::min<uintptr_t>(512, last - p);
+			if (pread(pagemap, entries, n * sizeof(uint64_t), p * sizeof(uint64_t)) != ssize_t(n * sizeof(uint64_t)))
+				throw std::runtime_error(std::string("Error: Could not read the dirty pages of the heap"));
+			for (size_t i = 0; i < n; i++)
+			{
+				if (entries[i] & PAGEMAP_SOFT_DIRTY)
+				{
+					auto page_start = reinterpret_cast<char *>((p + i) * page);
+					rescan(std::max(from, page_start), std::min(to, page_start + page));
+				}
+			}
+		}
+	}
+
+	/**
+	 * Scans the parts of the marked objects that lie in
+	 * a range again. The range is either inside the heap
+	 * or inside a single large object.
+	 */
+	void Heap::rescan(char *from, char *to)
+	{
+		auto scan = [this](uintptr_t *bottom, uintptr_t *top)
+		{
+			while (bottom < top)
+				find_chunks(bottom++, m_worklist, true);
+		};
+
+		if (!contains(reinterpret_cast<uintptr_t>(from)))
+		{
+			scan(reinterpret_cast<uintptr_t *>(from), reinterpret_cast<uintptr_t *>(to));
+			return;
+		}
+
+		// The chunks are found by their start bits, since the
+		// buffers of other threads have no headers past their
+		// cursors
+		Header *first = chunk_at(reinterpret_cast<uintptr_t>(from));
+		size_t g = first != nullptr ? granule(first) : (from - m_heap) / GRANULE_SIZE;
+		size_t end = (to - m_heap + GRANULE_SIZE - 1) / GRANULE_SIZE;
+		for (size_t w = g / 64; w * 64 < end; w++)
+		{
+			uint64_t starts = m_start_bits[w];
+			if (w == g / 64)
+				starts &= ~(uint64_t)0 << (g % 64);
+			for (; starts; starts &= starts - 1)
+			{
+				size_t start = w * 64 + __builtin_ctzll(starts);
+				if (start >= end)
+					break;
+				auto chunk = reinterpret_cast<Header *>(m_heap + start * GRANULE_SIZE);
+				if (!chunk->m_free && !chunk->m_atomic && is_marked(chunk))
+					scan(std::max(chunk->payload(), reinterpret_cast<uintptr_t *>(from)),
+						 std::min(reinterpret_cast<uintptr_t *>(chunk->next()), reinterpret_cast<uintptr_t *>(to)));
+			}
+		}
+	}
+
+	/**
+	 * Clears the soft-dirty bits of all pages of the
+	 * process, so that the kernel sets them again for
+	 * the pages that are written from now on.
+	 *
+	 * @returns False if the bits cannot be cleared.
+	 */
+	bool Heap::clear_soft_dirty()
+	{
+		int clear_refs = open("/proc/self/clear_refs", O_WRONLY);
+		if (clear_refs < 0)
+			return false;
+		bool cleared = write(clear_refs, "4", 1) == 1;
+		close(clear_refs);
+		return cleared;
+	}
+
+	/**
+	 * Checks if the kernel tracks soft-dirty pages, by
+	 * writing to a page of its own after clearing the
+	 * bits. Kernels built without soft-dirty support
+	 * accept the clear but never set the bit.
+	 */
+	bool Heap::soft_dirty_supported()
+	{
+		static const uintptr_t page = sysconf(_SC_PAGESIZE);
+		void *addr = mmap(nullptr, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED)
+			return false;
+		auto probe = static_cast<volatile char *>(addr);
+		*probe = 1;
+
+		bool supported = false;
+		int pagemap = open("/proc/self/pagemap", O_RDONLY);
+		if (pagemap >= 0)
+		{
+			uint64_t entry;
+			if (clear_soft_dirty())
+			{
+				*probe = 2;
+				supported = pread(pagemap, &entry, sizeof(entry), reinterpret_cast<uintptr_t>(addr) / page * sizeof(entry)) == sizeof(entry)
+					&& (entry & PAGEMAP_SOFT_DIRTY);
+			}
+			close(pagemap);
+		}
+		munmap(addr, page);
+		return supported;
+	}
+
+	/**
+	 * Finds the roots of a collection, the words on the
+	 * stacks of the attached threads that point into the
+	 * heap or into the large objects, or with precise
+	 * roots the slots of their shadow stacks or of the
+	 * frames in the frame table. The time it takes is
+	 * recorded as root scanning time.
+	 *
+	 * @param stack_bottom  The end of the stack of the
+	 *                      collecting thread.
+	 * @param roots         Gets the addresses of the roots.
+	 */
 	void Heap::find_roots(uintptr_t *stack_bottom, vector<uintptr_t *> &roots)
 	{
-		auto heap_bottom = reinterpret_cast<const uintptr_t>(m_heap);
-		auto heap_top = reinterpret_cast<const uintptr_t>(m_heap + HEAP_SIZE);
+		auto r_start = time_now;
+		if (m_precise_roots)
+		{
+			for (Mutator *mutator : m_mutators)
+				visit_gc_roots(*mutator->m_root_chain, roots);
+		}
+		else
+		{
+			// A thread outside of cheap_alloc may be in the
+			// middle of a function, between the safe points
+			// of the frame table
+			for (Mutator *mutator : m_mutators)
+			{
+				auto bottom = mutator == this_mutator ? stack_bottom : mutator->m_stack_bottom;
+				if (m_frame_roots && mutator->m_frame != nullptr)
+					walk_frames(mutator->m_frame, mutator->m_stack_top, roots);
+				else if (bottom != nullptr)
+					scan_stack(bottom, mutator->m_stack_top, roots);
+			}
+		}
+		Profiler::record(RootScan, to_ns(time_now - r_start));
+	}
+
+	/**
+	 * Adds the slots of a shadow stack that hold a
+	 * pointer to roots, from the innermost frame out.
+	 * The metadata of the roots is not used.
+	 *
+	 * Time complexity: O(N), where N is the number of
+	 * 					roots on the shadow stack.
+	 *
+	 * @param chain The innermost entry of the shadow
+	 *              stack of a thread.
+	 * @param roots The roots found so far.
+	 */
+	void Heap::visit_gc_roots(StackEntry *chain, vector<uintptr_t *> &roots)
+	{
+		for (StackEntry *entry = chain; entry != nullptr; entry = entry->Next)
+		{
+			for (int32_t i = 0; i < entry->Map->NumRoots; i++)
+			{
+				auto root = reinterpret_cast<uintptr_t *>(&entry->Roots[i]);
+				if (*root != 0)
+					roots.push_back(root);
+			}
+		}
+	}
+
+	/**
+	 * Adds the slots of the frames of a stack that the
+	 * frame table describes to roots. Every frame starts
+	 * with the frame pointer of its caller and the
+	 * address that it returns to in the caller, which
+	 * is a safe point of the caller if it was compiled
+	 * with gc "gc". The walk ends at a caller without a
+	 * frame pointer, which is the start of the thread.
+	 *
+	 * Time complexity: O(F log T), where F is the number
+	 * 					of frames and T the number of
+	 * 					safe points in the table.
+	 *
+	 * @param frame The frame of cheap_alloc, which the
+	 *              compiled code called.
+	 * @param top   The end of the stack.
+	 * @param roots The roots found so far.
+	 */
+	void Heap::walk_frames(uintptr_t *frame, uintptr_t *top, vector<uintptr_t *> &roots)
+	{
+		while (frame != nullptr && frame < top)
+		{
+			auto caller = reinterpret_cast<uintptr_t *>(frame[0]);
+			if (caller <= frame || caller >= top)
+				break;
 
-		while (stack_bottom < m_stack_top)
+			const FrameDescriptor *descriptor = find_frame(frame[1]);
+			if (descriptor != nullptr)
+			{
+				for (uint32_t i = 0; i < descriptor->NumRoots; i++)
+				{
+					auto root = reinterpret_cast<uintptr_t *>(reinterpret_cast<char *>(caller) + descriptor->Offsets[i]);
+					if (*root != 0)
+						roots.push_back(root);
+				}
+			}
+			frame = caller;
+		}
+	}
+
+	/**
+	 * Looks up the roots of a safe point in the frame
+	 * table.
+	 *
+	 * @param return_address    The address that a call
+	 *                          returns to.
+	 *
+	 * @returns The descriptor of the frame, or nullptr
+	 *          if the address is not a safe point.
+	 */
+	const FrameDescriptor *Heap::find_frame(uintptr_t return_address)
+	{
+		auto iter = std::lower_bound(m_frame_table.begin(), m_frame_table.end(), return_address,
+									 [](const FrameDescriptor *d, uintptr_t address) { return d->ReturnAddress < address; });
+		if (iter == m_frame_table.end() || (*iter)->ReturnAddress != return_address)
+			return nullptr;
+		return *iter;
+	}
+
+	/**
+	 * Adds the words of a stack that point into the heap
+	 * or into the range of the large objects to roots.
+	 *
+	 * @param bottom    The lowest word of the stack.
+	 * @param top       The end of the stack.
+	 * @param roots     The roots found so far.
+	 */
+	void Heap::scan_stack(uintptr_t *bottom, uintptr_t *top, vector<uintptr_t *> &roots)
+	{
+		while (bottom < top)
 		{
-			if (heap_bottom < *stack_bottom && *stack_bottom < heap_top)
+			if (contains(*bottom) || (*bottom >= m_large_min && *bottom < m_large_max))
 			{
-				roots.push_back(stack_bottom);
+				roots.push_back(bottom);
 			}
-			stack_bottom++;
+			bottom++;
 		}
 	}
 	
+	/**
+	 * Marks the chunks that the roots point to and adds
+	 * them to the worklist, which is drained by
+	 * mark_slice().
+	 */
 	void Heap::mark(vector<uintptr_t *> &roots)
 	{
 		bool prof_enabled = m_profiler_enable;
@@ -275,136 +2160,350 @@ namespace GC
 			Profiler::record(MarkStart);
 
 		auto iter = roots.begin(), end = roots.end();
-		std::queue<std::pair<uintptr_t, uintptr_t>> chunk_spaces;
 
-		while (iter != end)
+		while (iter != end)
+		{
+			find_chunks(*iter++, m_worklist, true);
+		}
+	}
+
+	/**
+	 * Scans the objects on the worklist for pointers to
+	 * chunks that are not marked yet, which are marked
+	 * and added to the worklist in turn. At most MARK_STEP
+	 * words of an object are scanned at a time, the rest
+	 * of it is queued again, so a slice can also end in
+	 * the middle of a large object.
+	 *
+	 * @param budget    The time after which the slice
+	 *                  ends, or zero to drain the whole
+	 *                  worklist.
+	 *
+	 * @returns True if the worklist is empty, which
+	 *          means that the mark is done.
+	 */
+	bool Heap::mark_slice(std::chrono::microseconds budget)
+	{
+		if (budget.count() == 0 && m_mark_threads > 1)
 		{
-			find_chunks(*iter++, chunk_spaces);
+			parallel_mark();
+			return true;
 		}
 
-		while (!chunk_spaces.empty())
+		auto s_start = time_now;
+		size_t words = 0;
+
+		while (!m_worklist.empty())
 		{
-			auto range = chunk_spaces.front();
-			chunk_spaces.pop();
+			auto range = m_worklist.front();
+			m_worklist.pop();
+
+			if (range.first & TYPED_RANGE)
+			{
+				auto payload = reinterpret_cast<uintptr_t *>(range.first & ~TYPED_RANGE);
+				for (uint64_t pointers = range.second; pointers; pointers &= pointers - 1)
+					find_chunks(payload + __builtin_ctzll(pointers), m_worklist, false);
+				words += __builtin_popcountll(range.second);
+				continue;
+			}
 
 			auto addr_bottom = reinterpret_cast<uintptr_t *>(range.first);
 			auto addr_top = reinterpret_cast<uintptr_t *>(range.second);
+			if (addr_top - addr_bottom > MARK_STEP)
+			{
+				addr_top = addr_bottom + MARK_STEP;
+				m_worklist.push(std::make_pair(reinterpret_cast<uintptr_t>(addr_top), range.second));
+			}
 
+			words += addr_top - addr_bottom;
 			while (addr_bottom < addr_top)
 			{
-				find_chunks(addr_bottom, chunk_spaces);
+				find_chunks(addr_bottom, m_worklist, true);
 				addr_bottom++;
 			}
+
+			if (budget.count() != 0 && words >= MARK_CLOCK_WORDS)
+			{
+				words = 0;
+				if (time_now - s_start >= budget)
+					return m_worklist.empty();
+			}
 		}
+		return true;
 	}
 
-	void Heap::find_chunks(uintptr_t *stack_addr, std::queue<std::pair<uintptr_t, uintptr_t>> &chunk_spaces)
+	void Heap::find_chunks(uintptr_t *stack_addr, std::queue<std::pair<uintptr_t, uintptr_t>> &chunk_spaces, bool ambiguous)
 	{
-		Heap &heap = Heap::the();
+		WorkDeque::Range range;
+		if (grey(*stack_addr, range, m_marked_bytes, ambiguous))
+			chunk_spaces.push(range);
+	}
 
-		auto it = heap.m_chunk_table.find(*stack_addr);
-		if (it != heap.m_chunk_table.end())
+	/**
+	 * Marks the object that an address points into, if
+	 * there is one that is not marked yet.
+	 *
+	 * @param addr  A possible pointer.
+	 * @param range Set to the memory of the object if it
+	 *              has to be scanned, or for a typed
+	 *              object to its payload tagged with
+	 *              TYPED_RANGE and its pointer map.
+	 * @param marked    Counts the bytes of the chunk if it
+	 *                  is on the heap and was marked.
+	 * @param ambiguous True unless addr is a pointer word
+	 *                  of a typed object, which pins the
+	 *                  chunk if the mark pins.
+	 *
+	 * @returns True if the object was marked by this
+	 *          call and contains pointers.
+	 */
+	bool Heap::grey(uintptr_t addr, WorkDeque::Range &range, size_t &marked, bool ambiguous)
+	{
+		if (!contains(addr))
+			return addr >= m_large_min && addr < m_large_max && find_large_chunk(addr, range);
+
+		Header *chunk = find_enclosing(addr);
+		if (chunk == nullptr)
+			return false;
+		if (ambiguous && m_pinning)
+			pin(granule(chunk));
+		if (!try_mark(granule(chunk)))
+			return false;
+		if (m_marking_lines)
+			mark_lines(chunk);
+		marked += chunk->m_size;
+		if (chunk->m_atomic)
+			return false;
+
+		auto payload = reinterpret_cast<uintptr_t>(chunk->payload());
+		uint64_t pointers;
+		if (pointer_map(chunk, pointers))
 		{
-			auto chunk = it->second;
-
-			if (!chunk->m_marked) 
-			{
-				auto c_start = reinterpret_cast<uintptr_t>(chunk->m_start);
-				auto c_size  = reinterpret_cast<uintptr_t>(chunk->m_size);
-				auto c_end   = reinterpret_cast<uintptr_t>(c_start + c_size);
-
-				chunk->m_marked = true;
-				chunk_spaces.push(std::make_pair(c_start, c_end));
-			}
-			
+			range = std::make_pair(payload | TYPED_RANGE, pointers);
+			return pointers != 0;
 		}
+		range = std::make_pair(payload, reinterpret_cast<uintptr_t>(chunk->next()));
+		return true;
+	}
 
-/* 		auto iter = m_allocated_chunks.begin();
-		auto end = m_allocated_chunks.end();
+	/**
+	 * Looks up the pointer map of a chunk by its type and
+	 * variant.
+	 *
+	 * @param chunk     A chunk that is not atomic.
+	 * @param pointers  Set to the map of the pointer words
+	 *                  of the chunk if it has one.
+	 *
+	 * @returns True if only the words in the map hold
+	 *          pointers, false if the chunk has to be
+	 *          scanned as a whole.
+	 */
+	bool Heap::pointer_map(const Header *chunk, uint64_t &pointers) const
+	{
+		if (chunk->m_type == 0)
+			return false;
+		// The tag of an object in the middle of its
+		// initialisation may not be written yet, then
+		// the object is scanned as a whole
+		const TypeDescriptor *type = m_types[chunk->m_type];
+		auto payload = reinterpret_cast<const uint8_t *>(chunk + 1);
+		uint64_t variant = type->m_variants > 1 ? *payload : 0;
+		if (variant >= type->m_variants)
+			return false;
+		pointers = type->m_pointers[variant];
+		return true;
+	}
 
-		while (iter != end)
-		{
-			auto chunk = *iter++;
-			
-			if (chunk->m_marked)
-				continue;
+	/**
+	 * Marks the large object that an address points into,
+	 * if there is one.
+	 *
+	 * Time complexity: O(log N), where N is the number
+	 * 					of large objects.
+	 *
+	 * @returns True if the object was marked by this
+	 *          call and contains pointers.
+	 */
+	bool Heap::find_large_chunk(uintptr_t addr, WorkDeque::Range &range)
+	{
+		std::lock_guard<std::mutex> lock(m_large_lock);
+		auto it = m_large_chunks.upper_bound(addr);
+		if (it == m_large_chunks.begin())
+			return false;
+		LargeChunk &large = (--it)->second;
+		auto c_start = it->first;
+		auto c_end   = reinterpret_cast<uintptr_t>(large.m_header->next());
+		if (addr >= c_end || large.m_marked)
+			return false;
+
+		large.m_marked = true;
+		range = std::make_pair(c_start, c_end);
+		return !large.m_header->m_atomic;
+	}
 
-			auto c_start = reinterpret_cast<uintptr_t>(chunk->m_start);
-			auto c_size  = reinterpret_cast<uintptr_t>(chunk->m_size);
-			auto c_end   = reinterpret_cast<uintptr_t>(c_start + c_size);
+	/**
+	 * Finds the object that an address points into, which
+	 * need not be the start of the object. Pointers into
+	 * the fields of an object, as derived by LLVM, keep the
+	 * whole object alive. The header of the object is found
+	 * by scanning the start bitmap backwards from the granule
+	 * of the address, a word of 64 granules at a time.
+	 *
+	 * Time complexity: O(1) for objects smaller than 64
+	 * 					granules, O(S / 512) for an object
+	 * 					of S bytes.
+	 *
+	 * @param addr  An address on the heap, below m_top.
+	 *
+	 * @returns The header of the allocated object that
+	 *          contains addr, or nullptr if addr points
+	 *          into free memory or into a header.
+	 */
+	Header *Heap::find_enclosing(uintptr_t addr) const
+	{
+		Header *chunk = chunk_at(addr);
+		if (chunk == nullptr || chunk->m_free || addr < reinterpret_cast<uintptr_t>(chunk->payload()))
+			return nullptr;
+		return chunk;
+	}
 
-			if (c_start < *stack_addr && *stack_addr < c_end)
-			{
-				chunk->m_marked = true;
-				chunk_spaces.push(std::make_pair(c_start, c_end));
-			}
-		} */
+	/**
+	 * Finds the chunk, allocated or free, whose memory
+	 * contains an address, by scanning the start bitmap
+	 * backwards from the granule of the address.
+	 *
+	 * @param addr  An address on the heap, below m_top.
+	 *
+	 * @returns The header of the chunk, or nullptr if
+	 *          addr lies in an allocation buffer at the
+	 *          bottom of the heap.
+	 */
+	Header *Heap::chunk_at(uintptr_t addr) const
+	{
+		size_t g = (addr - reinterpret_cast<uintptr_t>(m_heap)) / GRANULE_SIZE;
+		size_t w = g / 64;
+		uint64_t starts = m_start_bits[w] & (~(uint64_t)0 >> (63 - g % 64));
+		while (!starts)
+		{
+			if (w == 0)
+				return nullptr;
+			starts = m_start_bits[--w];
+		}
 
+		return reinterpret_cast<Header *>(m_heap + (w * 64 + 63 - __builtin_clzll(starts)) * GRANULE_SIZE);
 	}
 
-	void Heap::create_table() 
+	/**
+	 * Finds the first word of the bitmaps with a live
+	 * chunk, which is a chunk that starts and is marked.
+	 * The bitmaps are scanned a word at a time, and with
+	 * AVX2 four words at a time, so dead and free memory
+	 * is skipped without touching the heap itself.
+	 *
+	 * @param from  The first word to look at.
+	 * @param to    The end of the bitmaps.
+	 *
+	 * @returns The first word with a live chunk, or to
+	 *          if there is none.
+	 */
+	size_t Heap::next_live_word(size_t from, size_t to) const
 	{
-		Heap &heap = Heap::the();
-		unordered_map<uintptr_t, Chunk*> chunk_table;
-		for (auto chunk : heap.m_allocated_chunks) {
-			auto pair = std::make_pair(reinterpret_cast<uintptr_t>(chunk->m_start), chunk);
-			heap.m_chunk_table.insert(pair);		
+		size_t w = from;
+#ifdef __AVX2__
+		// Turns the mark bits into bits that are set if marked
+		const __m256i flip = _mm256_set1_epi64x(m_mark_epoch ? 0 : ~(uint64_t)0);
+		for (; w + 4 <= to; w += 4)
+		{
+			__m256i starts = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(m_start_bits + w));
+			__m256i marks = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(m_mark_bits + w));
+			if (!_mm256_testz_si256(starts, _mm256_xor_si256(marks, flip)))
+				break;
 		}
+#endif
+		while (w < to && !live_bits(w))
+			w++;
+		return w;
 	}
 
-	void Heap::mark_hash(uintptr_t *start, const uintptr_t* const end) 
+	/**
+	 * Clears the bits from one index up to another.
+	 */
+	void Heap::clear_bits(uint64_t *bits, size_t from, size_t to)
 	{
-		Heap &heap = Heap::the();
-
-		bool profiler_enabled = heap.m_profiler_enable;
-		if (profiler_enabled)
-			Profiler::record(MarkStart);
+		if (from >= to)
+			return;
+		size_t w = from / 64, last = (to - 1) / 64;
+		uint64_t head = ~(uint64_t)0 << (from % 64);
+		uint64_t tail = ~(uint64_t)0 >> (63 - (to - 1) % 64);
+		if (w == last)
+		{
+			bits[w] &= ~(head & tail);
+			return;
+		}
+		bits[w] &= ~head;
+		std::fill(bits + w + 1, bits + last, 0);
+		bits[last] &= ~tail;
+	}
 
-		for (; start <= end; start++) 
+	/**
+	 * Turns the memory between two live chunks into one
+	 * free run. The run keeps only the start bit of its
+	 * first chunk, and its mark bit reads as unmarked
+	 * after the next flip, or right away if the marks
+	 * are sticky.
+	 *
+	 * @param from  The granule where the run starts.
+	 * @param to    The granule where the next live chunk
+	 *              starts.
+	 *
+	 * @returns The header of the free run.
+	 */
+	Header *Heap::sweep_run(size_t from, size_t to)
+	{
+		auto run = reinterpret_cast<Header *>(m_heap + from * GRANULE_SIZE);
+		// The headers of the dead chunks are only read if their
+		// events are logged
+		if (m_profiler_enable && (Profiler::log_options() & int(ChunkSwept)))
 		{
-			auto search = heap.m_chunk_table.find(*start);
-			if (search != heap.m_chunk_table.end())
+			// The dead chunks are found by their start bits, since
+			// a compaction leaves no headers between them, and
+			// share the time of their run
+			uint64_t time = Profiler::now();
+			for (size_t w = from / 64; w * 64 < to; w++)
 			{
-				Chunk *chunk = search->second;
-				auto c_start = reinterpret_cast<uintptr_t>(chunk->m_start);
-				auto c_size = reinterpret_cast<uintptr_t>(chunk->m_size);
-				auto c_end = reinterpret_cast<uintptr_t*>(c_start + c_size);
-				if (!chunk->m_marked) 
+				for (uint64_t starts = m_start_bits[w]; starts; starts &= starts - 1)
 				{
-					chunk->m_marked = true;
-
-					if (profiler_enabled)
-						Profiler::record(ChunkMarked, chunk);
-
-					//mark_hash(chunk->m_start, c_end);
-					Chunk *next = find_pointer_hash((uintptr_t *) c_start, (uintptr_t *) c_end);
-					while (next != NULL) 
+					size_t g = w * 64 + __builtin_ctzll(starts);
+					auto chunk = reinterpret_cast<Header *>(m_heap + g * GRANULE_SIZE);
+					if (g >= from && g < to && !chunk->m_free)
 					{
-						if (!next->m_marked) 
-						{
-							next->m_marked = true;
-
-							if (profiler_enabled)
-								Profiler::record(ChunkMarked, chunk);
-
-							auto c_start = reinterpret_cast<uintptr_t>(next->m_start);
-							auto c_size  = reinterpret_cast<uintptr_t>(next->m_size);
-							auto c_end   = reinterpret_cast<uintptr_t>(c_start + c_size);
-							next = find_pointer_hash((uintptr_t *) c_start, (uintptr_t *) c_end);
-						}
+						Chunk swept(chunk);
+						Profiler::record(ChunkSwept, &swept, time);
 					}
 				}
 			}
 		}
+
+		clear_bits(m_start_bits, from + 1, to);
+		*run = Header {(to - from) * GRANULE_SIZE, true, false, 0};
+		set_mark(from, m_sticky ? !m_mark_epoch : m_mark_epoch);
+		return run;
 	}
 
 	/**
-	 * Sweeps the heap, unmarks the marked chunks for the next cycle,
-	 * adds the unmarked nodes to the list of freed chunks; to be freed.
+	 * Sweeps the heap by scanning the bitmaps for the live
+	 * chunks, a word at a time. The memory between two live chunks, dead and
+	 * already free chunks alike, becomes one free run that
+	 * is moved to m_freed_chunks; to be freed. A free run
+	 * at the end of the heap is given back to the bump
+	 * offset. The marks of the live chunks are not cleared,
+	 * instead the meaning of the mark bits is flipped for
+	 * the next collection.
 	 *
-	 * Time complexity: O(N^2), where N is the number of allocated chunks. 
-	 * 					It is quadratic, in the worst case, 
-	 * 					since each call to erase() is linear.  
+	 * Time complexity: O(H / 64 + L), where H is the number
+	 * 					of granules on the heap and L is the
+	 * 					number of live chunks, whose headers
+	 * 					are the only part of the heap read.
 	 *
 	 * @param heap Pointer to the heap singleton instance.
 	 */
@@ -413,176 +2512,400 @@ namespace GC
 		bool profiler_enabled = heap.m_profiler_enable;
 		if (profiler_enabled)
 			Profiler::record(SweepStart);
-		auto iter = heap.m_allocated_chunks.begin();
-		// std::cout << "Chunks alloced: " << heap.m_allocated_chunks.size() << std::endl;
-		// This cannot "iter != stop", results in seg fault, since the end gets updated, I think.
-		while (iter != heap.m_allocated_chunks.end())
+
+		heap.clear_free();
+		heap.m_sweep_cursor = 0;
+		heap.m_sweep_top = heap.m_top / GRANULE_SIZE;
+
+		if (heap.m_marking_lines)
+		{
+			// The live bytes have been counted by the mark
+			heap.m_size = (heap.m_minor ? heap.m_old_size : 0) + heap.m_marked_bytes + (heap.m_size - heap.m_cycle_size);
+			heap.sweep_lines();
+		}
+		else
+		{
+			size_t live_size = 0;
+			heap.sweep_chunks(heap.m_sweep_top, live_size);
+			heap.finish_sweep();
+			heap.m_size = live_size;
+		}
+		heap.sweep_large();
+	}
+
+	/**
+	 * Sweeps an Immix heap by its line table. The dead
+	 * chunks lose their start bits, since the ones in
+	 * lines that stay in use are not freed, and every run
+	 * of lines that no marked chunk covers becomes a free
+	 * chunk in m_line_holes, in address order. A run at
+	 * the end of the heap is given back to the bump
+	 * offset instead. The holes and free lines of every
+	 * block are counted on the way, for the choice of the
+	 * blocks to evacuate.
+	 *
+	 * Time complexity: O(H / 64 + H / LINE_SIZE), where H is
+	 * 					the number of granules on the heap.
+	 * 					No header on the heap is read.
+	 */
+	void Heap::sweep_lines()
+	{
+		size_t top = m_top / GRANULE_SIZE, words = (top + 63) / 64;
+		bool swept_events = m_profiler_enable && (Profiler::log_options() & int(ChunkSwept));
+		// The events of the sweep share one time
+		uint64_t time = m_profiler_enable ? Profiler::now() : 0;
+		for (size_t w = 0; w < words; w++)
+		{
+			uint64_t dead = m_start_bits[w] & ~live_bits(w);
+			for (uint64_t bits = dead; swept_events && bits; bits &= bits - 1)
+			{
+				auto chunk = reinterpret_cast<Header *>(m_heap + (w * 64 + __builtin_ctzll(bits)) * GRANULE_SIZE);
+				if (!chunk->m_free)
+				{
+					Chunk swept(chunk);
+					Profiler::record(ChunkSwept, &swept, time);
+				}
+			}
+			m_start_bits[w] &= ~dead;
+		}
+
+		mark_buffer_lines();
+		size_t lines = (m_top + LINE_SIZE - 1) / LINE_SIZE, line = 0, free_lines = 0;
+		// The holes and the free lines of every block
+		vector<std::pair<size_t, size_t>> blocks((lines + LINES_PER_BLOCK - 1) / LINES_PER_BLOCK);
+		m_sweep_cursor = top;
+		while (line < lines)
 		{
-			Chunk *chunk = *iter;
+			while (line < lines && m_line_marks[line])
+				line++;
+			size_t start = line;
+			while (line < lines && !m_line_marks[line])
+				line++;
+			if (start == lines)
+				break;
+			if (line == lines)
+			{
+				m_sweep_cursor = start * LINE_SIZE / GRANULE_SIZE;
+				break;
+			}
 
-			// Unmark the marked chunks for the next iteration.
-			if (chunk->m_marked)
+			for (size_t l = start; l < line; l = (l / LINES_PER_BLOCK + 1) * LINES_PER_BLOCK)
 			{
-				chunk->m_marked = false;
-				++iter;
+				auto &block = blocks[l / LINES_PER_BLOCK];
+				block.first++;
+				block.second += std::min(line, (l / LINES_PER_BLOCK + 1) * LINES_PER_BLOCK) - l;
 			}
-			else
+			free_lines += line - start;
+
+			Header *run = sweep_run(start * LINE_SIZE / GRANULE_SIZE, line * LINE_SIZE / GRANULE_SIZE);
+			if (m_profiler_enable)
 			{
-				// Add the unmarked chunks to freed chunks and remove from
-				// the list of allocated chunks
-				if (profiler_enabled)
-					Profiler::record(ChunkSwept, chunk);
-				heap.m_freed_chunks.push_back(chunk);
-				iter = heap.m_allocated_chunks.erase(iter);
-				heap.m_size -= chunk->m_size;
-				// cout << "Decremented total heap size with: " << chunk->m_size << endl;
-				// cout << "Total size is: " << heap.m_size << endl;
+				Chunk freed(run);
+				Profiler::record(ChunkFreed, &freed, time);
 			}
+			m_line_holes.push_back(run);
+			release(reinterpret_cast<char *>(run), reinterpret_cast<char *>(run->next()));
 		}
-		// std::cout << "Chunks left: " << heap.m_allocated_chunks.size() << std::endl;
+		finish_sweep();
+
+		if (m_compact)
+			select_evacuation(blocks, free_lines);
 	}
 
 	/**
-	 * Frees chunks that was moved to the list m_freed_chunks
-	 * by the sweep phase. If there are more than a certain
-	 * amount of free chunks, delete the free chunks to
-	 * avoid cluttering.
-	 * 
-	 * Time complexity: O(N^2), where N is the freed chunks.
-	 * 					If free_overlap() is called, it runs in O(N^2),
-	 * 					otherwise O(N).
+	 * Chooses the blocks that the next full collection of
+	 * an Immix heap evacuates: the blocks with the most
+	 * holes first, as long as their marked lines still fit
+	 * in the free lines of the blocks that are not chosen.
+	 * A block with a single hole is not fragmented, and
+	 * one that is more than half marked is not worth the
+	 * copying, so neither is ever chosen.
 	 *
-	 * @param heap  Heap singleton instance, only for avoiding
-	 *              redundant calls to the singleton get
+	 * @param blocks        The holes and the free lines of
+	 *                      every block.
+	 * @param free_lines    The free lines of all blocks.
 	 */
-	void Heap::free(Heap &heap)
+	void Heap::select_evacuation(const vector<std::pair<size_t, size_t>> &blocks, size_t free_lines)
 	{
-		bool profiler_enabled = heap.m_profiler_enable;
-		if (profiler_enabled)
-			Profiler::record(FreeStart);
-		if (heap.m_freed_chunks.size() > FREE_THRESH)
-		{
-			bool profiler_enabled = heap.profiler_enabled();
-			while (heap.m_freed_chunks.size())
-			{
-				auto chunk = heap.m_freed_chunks.back();
-				heap.m_freed_chunks.pop_back();
-				if (profiler_enabled)
-					Profiler::record(ChunkFreed, chunk);
-				// heap.m_size -= chunk->m_size;
-				// cout << "Decremented total heap size with: " << chunk->m_size << endl;
-				// cout << "Total size is: " << heap.m_size << endl;
-				delete chunk;
-			}
-		}
-		// if there are chunks but not more than FREE_THRESH
-		else if (heap.m_freed_chunks.size())
+		vector<size_t> fragmented;
+		for (size_t b = 0; b < blocks.size(); b++)
+			if (blocks[b].first > 1 && 2 * blocks[b].second >= LINES_PER_BLOCK)
+				fragmented.push_back(b);
+		std::stable_sort(fragmented.begin(), fragmented.end(), [&](size_t a, size_t b) { return blocks[a].first > blocks[b].first; });
+
+		m_evacuate.assign(blocks.size(), false);
+		size_t needed = 0;
+		for (size_t b : fragmented)
 		{
-			// essentially, always check for overlap between
-			// chunks before finishing the allocation
-			free_overlap(heap);
+			size_t marked = LINES_PER_BLOCK - blocks[b].second;
+			if (needed + marked > free_lines - blocks[b].second)
+				break;
+			needed += marked;
+			free_lines -= blocks[b].second;
+			m_evacuate[b] = true;
 		}
 	}
 
 	/**
-	 * Checks for overlaps between freed chunks of memory
-	 * and removes overlapping chunks while prioritizing
-	 * the chunks at lower addresses.
-	 * 
-	 * Time complexity: O(N^2), where N is the number of freed chunks.
-	 * 					At each iteration get_at() is called, which is linear.
+	 * Sweeps the heap from m_sweep_cursor on, up to the
+	 * end of the last live chunk that starts before a
+	 * granule. The free runs found are moved to
+	 * m_freed_chunks. Free memory that reaches past the
+	 * granule is cut there, so that a lazy sweep step
+	 * never frees more than a step of the heap, and the
+	 * rest becomes a dead chunk that the next step sweeps.
+	 * The allocation buffers of other threads are skipped
+	 * like live chunks.
 	 *
-	 * @param heap  Heap singleton instance, only for avoiding
-	 *              redundant calls to the singleton get
+	 * @param limit     The granule to sweep up to.
+	 * @param live_size Counts the bytes of the live chunks.
 	 *
-	 * @note Maybe this should be changed to prioritizing
-	 *       larger chunks. Should remove get_at() to indexing,
-	 * 		 since that's constant.
+	 * @returns True if there are no live chunks left
+	 *          between the cursor and m_sweep_top.
 	 */
-	void Heap::free_overlap(Heap &heap) // borde göra en record(ChunkFreed) på onödiga chunks
+	bool Heap::sweep_chunks(size_t limit, size_t &live_size)
 	{
-		std::vector<Chunk *> filtered;
-		size_t i = 0;
-		//auto prev = Heap::get_at(heap.m_freed_chunks, i++);
-		auto prev = heap.m_freed_chunks[i++];
-		prev->m_marked = true;
-		filtered.push_back(prev);
-		// cout << filtered.back()->m_start << endl;
-		for (; i < heap.m_freed_chunks.size(); i++)
+		size_t top = m_sweep_top, words = (top + 63) / 64;
+		size_t cursor = m_sweep_cursor, w = cursor / 64;
+		// The live chunks below the cursor have been swept
+		uint64_t live = w < words ? live_bits(w) & (~(uint64_t)0 << (cursor % 64)) : 0;
+
+		vector<std::pair<size_t, size_t>> holes = buffer_holes();
+		size_t h = 0;
+		while (h < holes.size() && holes[h].second <= cursor)
+			h++;
+
+		while (cursor < limit)
 		{
-			prev = filtered.back();
-			//auto next = Heap::get_at(heap.m_freed_chunks, i);
-			auto next = heap.m_freed_chunks[i];
-			auto p_start = (uintptr_t)(prev->m_start);
-			auto p_size = (uintptr_t)(prev->m_size);
-			auto n_start = (uintptr_t)(next->m_start);
-			if (n_start >= (p_start + p_size))
+			while (!live && w < words)
 			{
-				next->m_marked = true;
-				filtered.push_back(next);
+				w = next_live_word(w + 1, words);
+				if (w < words)
+					live = live_bits(w);
 			}
-		}
-		heap.m_freed_chunks.swap(filtered);
-		
-		bool profiler_enabled = heap.m_profiler_enable;
-		// After swap m_freed_chunks contains still available chunks
-		// and filtered contains all the chunks, so delete unused chunks
-		for (Chunk *chunk : filtered)
-		{
-			// if chunk was filtered away, delete it
-			if (!chunk->m_marked)
+			size_t start = live ? w * 64 + __builtin_ctzll(live) : top;
+			bool hole = h < holes.size() && holes[h].first <= start;
+			if (hole)
+				start = holes[h].first;
+
+			if (start >= limit && limit < top)
+			{
+				Header *run = sweep_run(cursor, limit);
+				if (run->m_size >= MIN_FREE_CHUNK)
+					m_freed_chunks.push_back(run);
+				if (start > limit)
+				{
+					auto rest = reinterpret_cast<Header *>(m_heap + limit * GRANULE_SIZE);
+					*rest = Header {(start - limit) * GRANULE_SIZE, true, false, 0};
+					m_start_bits[limit / 64] |= (uint64_t)1 << (limit % 64);
+					set_mark(limit, !m_mark_epoch);
+				}
+				cursor = limit;
+				break;
+			}
+			if (!live && !hole)
 			{
-				if (profiler_enabled)
-					Profiler::record(ChunkFreed, chunk);
-				heap.m_size -= chunk->m_size;
-				cout << "Decremented total heap size with: " << chunk->m_size << endl;
-				cout << "Total size is: " << heap.m_size << endl;
-				delete chunk;
+				m_sweep_cursor = cursor;
+				return true;
 			}
-			else
+
+			// A run too small for the free list link is left as
+			// a free chunk until the next sweep
+			if (start > cursor)
+			{
+				Header *run = sweep_run(cursor, start);
+				if (run->m_size >= MIN_FREE_CHUNK)
+					m_freed_chunks.push_back(run);
+			}
+
+			if (hole)
 			{
-				chunk->m_marked = false;
+				cursor = holes[h++].second;
+				w = cursor / 64;
+				live = w < words ? live_bits(w) & (~(uint64_t)0 << (cursor % 64)) : 0;
+				continue;
 			}
+
+			// The headers of the live chunks in a word are read
+			// independently of each other, only the free runs
+			// between them depend on their sizes
+			live &= live - 1;
+
+			auto chunk = reinterpret_cast<Header *>(m_heap + start * GRANULE_SIZE);
+			live_size += chunk->m_size;
+			cursor = start + chunk->m_size / GRANULE_SIZE;
 		}
+		m_sweep_cursor = cursor;
+		return cursor >= top;
 	}
 
-	void Heap::set_profiler(bool mode)
+	/**
+	 * Sweeps the heap lazily up to a granule and frees
+	 * the free runs found, which finishes the sweep if
+	 * no live chunks are left after them. The time of the
+	 * step is recorded as sweep time, apart from the time
+	 * of freeing the runs.
+	 *
+	 * @param limit The granule to sweep up to, the end of
+	 *              the part to sweep for the whole rest.
+	 */
+	void Heap::sweep_step(size_t limit)
 	{
-		Heap &heap = Heap::the();
-		heap.m_profiler_enable = mode;
+		auto s_start = time_now;
+		if (m_profiler_enable)
+			Profiler::record(SweepStart);
+
+		// The live bytes have been counted by the mark
+		size_t live_size = 0;
+		if (sweep_chunks(limit, live_size))
+			finish_sweep();
+		Profiler::record(SweepStart, to_ns(time_now - s_start));
+		free(*this);
 	}
 
-	Chunk* find_pointer(uintptr_t *start, const uintptr_t* const end, vector<Chunk *> &worklist) {
-		for (; start <= end; start++) {
-			auto it = worklist.begin();
-			auto stop = worklist.end();
-			while (it != stop)
-			{
-				Chunk *chunk = *it;
-				auto c_start = reinterpret_cast<uintptr_t>(chunk->m_start);
-				auto c_size  = reinterpret_cast<uintptr_t>(chunk->m_size);
-				auto c_end   = reinterpret_cast<uintptr_t>(c_start + c_size);
+	/**
+	 * Ends a sweep once no live chunks are left after
+	 * the cursor. The free run up to the end of the swept
+	 * part is given back to the bump offset, which has
+	 * not moved during a lazy sweep, since allocations
+	 * sweep until they find a free chunk. The meaning of
+	 * the mark bits is then flipped, unless the marks of
+	 * the survivors are sticky.
+	 */
+	void Heap::finish_sweep()
+	{
+		size_t cursor = m_sweep_cursor, top = m_sweep_top;
+		if (cursor < top)
+		{
+			sweep_run(cursor, top);
+			clear_bits(m_start_bits, cursor, cursor + 1);
+			m_top = cursor * GRANULE_SIZE;
+			release(m_heap + cursor * GRANULE_SIZE, m_heap + top * GRANULE_SIZE);
+		}
+
+		m_sweeping = false;
+		if (!m_sticky)
+			m_mark_epoch = !m_mark_epoch;
+	}
+
+	/**
+	 * Empties the free lists, m_free_tree and the free
+	 * line runs before a sweep, since every chunk that was
+	 * free before the collection becomes part of a free
+	 * run.
+	 */
+	void Heap::clear_free()
+	{
+		std::fill(std::begin(m_free_lists), std::end(m_free_lists), nullptr);
+		std::fill(std::begin(m_free_mask), std::end(m_free_mask), 0);
+		m_free_tree.clear();
+		m_line_holes.clear();
+		m_next_hole = 0;
+		m_overflow_hole = 0;
+	}
 
-				// Check if the stack pointer points to something within the chunk
-				if (c_start <= *start && *start < c_end)
+	/**
+	 * Sweeps the large objects by unmapping the unmarked
+	 * ones and unmarking the others, unless the marks are
+	 * sticky.
+	 *
+	 * Time complexity: O(N), where N is the number of
+	 * 					large objects.
+	 */
+	void Heap::sweep_large()
+	{
+		m_large_size = 0;
+		m_large_min = UINTPTR_MAX;
+		m_large_max = 0;
+		uint64_t time = m_profiler_enable ? Profiler::now() : 0;
+		for (auto it = m_large_chunks.begin(); it != m_large_chunks.end();)
+		{
+			Header *chunk = it->second.m_header;
+			if (!it->second.m_marked)
+			{
+				if (m_profiler_enable)
 				{
-					return chunk;	
+					Chunk swept(chunk);
+					Profiler::record(ChunkSwept, &swept, time);
 				}
-				return NULL;
+				munmap(chunk, chunk->m_size);
+				it = m_large_chunks.erase(it);
+				continue;
 			}
+
+			if (!m_sticky)
+				it->second.m_marked = false;
+			m_large_size += chunk->m_size;
+			m_large_min = std::min(m_large_min, it->first);
+			m_large_max = std::max(m_large_max, reinterpret_cast<uintptr_t>(chunk->next()));
+			it++;
 		}
 	}
 
-	// Checks if a given chunk points to another chunk and returns it
-	Chunk* Heap::find_pointer_hash(uintptr_t *start, const uintptr_t* const end) {
-		Heap &heap = Heap::the();
-		for (; start <= end; start++) {
-			auto search = heap.m_chunk_table.find(*start);
-			if (search != heap.m_chunk_table.end()) {
-				return search->second;
+	/**
+	 * Frees the free runs that were moved to m_freed_chunks
+	 * by the sweep phase by adding them to the free lists
+	 * of their size classes, where try_recycle_chunks()
+	 * can find them. The free lists have been emptied by
+	 * the start of the sweep, see clear_free().
+	 *
+	 * Time complexity: O(N), where N is the number of free runs.
+	 *
+	 * @param heap  Heap singleton instance, only for avoiding
+	 *              redundant calls to the singleton get
+	 */
+	void Heap::free(Heap &heap)
+	{
+		auto f_start = time_now;
+		bool profiler_enabled = heap.m_profiler_enable;
+		if (profiler_enabled)
+			Profiler::record(FreeStart);
+
+		// The freed chunks share one time
+		uint64_t time = profiler_enabled ? Profiler::now() : 0;
+		for (Header *chunk : heap.m_freed_chunks)
+		{
+			if (profiler_enabled)
+			{
+				Chunk freed(chunk);
+				Profiler::record(ChunkFreed, &freed, time);
 			}
-			return NULL;
+			heap.push_free(chunk);
+			heap.release(reinterpret_cast<char *>(chunk), reinterpret_cast<char *>(chunk->next()));
 		}
+		heap.m_freed_chunks.clear();
+		Profiler::record(FreeStart, to_ns(time_now - f_start));
+	}
+
+	/**
+	 * Gives the pages of a large free run back to the
+	 * system. The run stays committed, and its pages are
+	 * backed by zeroed memory again when the run is used.
+	 * The header and the free list link at the start of
+	 * the run are kept.
+	 *
+	 * @param from  The start of the free run.
+	 * @param to    The end of the free run.
+	 */
+	void Heap::release(char *from, char *to)
+	{
+		static const uintptr_t page = sysconf(_SC_PAGESIZE);
+		uintptr_t start = (reinterpret_cast<uintptr_t>(from) + MIN_FREE_CHUNK + page - 1) & ~(page - 1);
+		uintptr_t end = reinterpret_cast<uintptr_t>(to) & ~(page - 1);
+		if (end > start && end - start >= RELEASE_MIN)
+			madvise(reinterpret_cast<void *>(start), end - start, MADV_DONTNEED);
+	}
+
+	void Heap::set_profiler(bool mode)
+	{
+		Heap &heap = Heap::the();
+		// The chunks of the allocation buffer are recorded when
+		// it is flushed, so the ones from before the switch go
+		// by the old mode
+		std::lock_guard<std::mutex> lock(heap.m_lock);
+		heap.retire_buffer();
+		heap.m_profiler_enable = mode;
+		Profiler::set_enabled(mode);
 	}
 
 #ifdef HEAP_DEBUG
@@ -594,7 +2917,7 @@ namespace GC
 	{
 		Heap &heap = Heap::the();
 		cout << "Heap addr:\t" << &heap << "\n";
-		cout << "GC m_stack_top:\t" << heap.m_stack_top << "\n";
+		cout << "GC m_stack_top:\t" << (this_mutator != nullptr ? this_mutator->m_stack_top : nullptr) << "\n";
 		auto stack_bottom = reinterpret_cast<uintptr_t *>(__builtin_frame_address(0));
 		cout << "GC stack_bottom:\t" << stack_bottom << endl;
 	}
@@ -613,6 +2936,8 @@ namespace GC
 		if (heap.m_profiler_enable)
 			Profiler::record(CollectStart);
 
+		heap.retire_buffer();
+
 		cout << "DEBUG COLLECT\nFLAGS: ";
 		if (flags & MARK)
 			cout << "\n - MARK";
@@ -623,15 +2948,18 @@ namespace GC
 		cout << "\n";
 
 		// get the frame adress, whwere local variables and saved registers are located
+		__builtin_unwind_init();
 		auto stack_bottom = reinterpret_cast<uintptr_t *>(__builtin_frame_address(0));
 		cout << "Stack bottom in collect:\t" << stack_bottom << "\n";
-		uintptr_t *stack_top = heap.m_stack_top;
-
-		cout << "Stack end in collect:\t " << stack_top << endl;
-		auto work_list = heap.m_allocated_chunks;
+		cout << "Stack end in collect:\t " << this_mutator->m_stack_top << endl;
 
 		if (flags & MARK)
-			mark(stack_bottom, stack_top, work_list);
+		{
+			vector<uintptr_t *> roots;
+			find_roots(stack_bottom, roots);
+			mark(roots);
+			mark_slice(std::chrono::microseconds(0));
+		}
 
 		if (flags & SWEEP)
 			sweep(heap);
@@ -640,74 +2968,37 @@ namespace GC
 			free(heap);
 	}
 
-	// Mark child references from the root references
-	void mark_test(vector<Chunk *> &worklist)
-	{
-		while (worklist.size() > 0)
-		{
-			Chunk *ref = worklist.back();
-			worklist.pop_back();
-			Chunk *child = (Chunk *)ref; // this is probably not correct
-			if (child != nullptr && !child->m_marked)
-			{
-				child->m_marked = true;
-				worklist.push_back(child);
-				mark_test(worklist);
-			}
-		}
-	}
-
-	// Mark the root references and look for child references to them
-	void mark_from_roots(uintptr_t *start, const uintptr_t *end)
-	{
-		vector<Chunk *> worklist;
-		for (; start > end; start--)
-		{
-			if (*start % 8 == 0)
-			{ // all pointers must be aligned as double words
-				Chunk *ref = (Chunk *)*start;
-				if (ref != nullptr && !ref->m_marked)
-				{
-					ref->m_marked = true;
-					worklist.push_back(ref);
-					mark_test(worklist);
-				}
-			}
-		}
-	}
-
 	// For testing purposes
-	void Heap::print_line(Chunk *chunk)
+	void Heap::print_line(Header *chunk)
 	{
-		cout << "Marked: " << chunk->m_marked << "\nStart adr: " << chunk->m_start << "\nSize: " << chunk->m_size << " B\n"
+		cout << "Marked: " << is_marked(chunk) << "\nStart adr: " << chunk->payload() << "\nSize: " << chunk->m_size << " B\n"
 			 << endl;
 	}
 
-	void Heap::print_worklist(std::vector<Chunk *> &list)
-	{
-		for (auto cp : list)
-			cout << "Chunk at:\t" << cp->m_start << "\nSize:\t\t" << cp->m_size << "\n";
-		cout << endl;
-	}
-
 	void Heap::print_contents()
 	{
 		Heap &heap = Heap::the();
-		if (heap.m_allocated_chunks.size())
+		heap.retire_buffer();
+		size_t allocated = 0, freed = 0;
+		auto end = reinterpret_cast<Header *>(heap.m_heap + heap.m_top);
+		for (auto chunk = reinterpret_cast<Header *>(heap.m_heap); chunk < end; chunk = chunk->next())
+			chunk->m_free ? freed++ : allocated++;
+
+		if (allocated)
 		{
-			cout << "\nALLOCATED CHUNKS #" << dec << heap.m_allocated_chunks.size() << endl;
-			for (auto chunk : heap.m_allocated_chunks)
-				print_line(chunk);
+			cout << "\nALLOCATED CHUNKS #" << dec << allocated << endl;
+			print_allocated_chunks(&heap);
 		}
 		else
 		{
 			cout << "NO ALLOCATIONS\n" << endl;
 		}
-		if (heap.m_freed_chunks.size())
+		if (freed)
 		{
-			cout << "\nFREED CHUNKS #" << dec << heap.m_freed_chunks.size() << endl;
-			for (auto fchunk : heap.m_freed_chunks)
-				print_line(fchunk);
+			cout << "\nFREED CHUNKS #" << dec << freed << endl;
+			for (auto chunk = reinterpret_cast<Header *>(heap.m_heap); chunk < end; chunk = chunk->next())
+				if (chunk->m_free)
+					print_line(chunk);
 		}
 		else
 		{
@@ -718,17 +3009,23 @@ namespace GC
 	void Heap::print_summary()
 	{
 		Heap &heap = Heap::the();
-		if (heap.m_allocated_chunks.size())
+		heap.retire_buffer();
+		size_t allocated = 0, freed = 0;
+		auto end = reinterpret_cast<Header *>(heap.m_heap + heap.m_top);
+		for (auto chunk = reinterpret_cast<Header *>(heap.m_heap); chunk < end; chunk = chunk->next())
+			chunk->m_free ? freed++ : allocated++;
+
+		if (allocated)
 		{
-			cout << "\nALLOCATED CHUNKS #" << dec << heap.m_allocated_chunks.size() << endl;
+			cout << "\nALLOCATED CHUNKS #" << dec << allocated << endl;
 		}
 		else
 		{
 			cout << "NO ALLOCATIONS\n" << endl;
 		}
-		if (heap.m_freed_chunks.size())
+		if (freed)
 		{
-			cout << "\nFREED CHUNKS #" << dec << heap.m_freed_chunks.size() << endl;
+			cout << "\nFREED CHUNKS #" << dec << freed << endl;
 		}
 		else
 		{
@@ -738,87 +3035,11 @@ namespace GC
 
 	void Heap::print_allocated_chunks(Heap *heap) {
 		cout << "--- Allocated Chunks ---\n" << endl;
-		for (auto chunk : heap->m_allocated_chunks) {
-			print_line(chunk);
-		}
-	}
-
-	Chunk *Heap::try_recycle_chunks_new(size_t size)
-	{
-		Heap &heap = Heap::the();
-		// Check if there are any freed chunks large enough for current request
-		for (size_t i = 0; i < heap.m_freed_chunks.size(); i++)
-		{
-			auto chunk = heap.m_freed_chunks[i]; //Heap::get_at(heap.m_freed_chunks, i);
-			auto iter = heap.m_freed_chunks.begin();
-			//advance(iter, i);
-			i++;
-			if (chunk->m_size > size)
-			{
-				// Split the chunk, use one part and add the remaining part to
-				// the list of freed chunks
-				size_t diff = chunk->m_size - size;
-				auto chunk_complement = new Chunk(diff, chunk->m_start + chunk->m_size);
-
-				heap.m_freed_chunks.erase(iter);
-				heap.m_freed_chunks.push_back(chunk_complement);
-				heap.m_allocated_chunks.push_back(chunk);
-
-				return chunk;
-			}
-			else if (chunk->m_size == size)
-			{
-				// Reuse the whole chunk
-				heap.m_freed_chunks.erase(iter);
-				heap.m_allocated_chunks.push_back(chunk);
-				return chunk;
-			}
-		}
-		// If no chunk was found, return nullptr
-		return nullptr;
-	}
-
-	void Heap::free_overlap_new(Heap &heap) // borde göra en record(ChunkFreed) på onödiga chunks
-	{
-		std::vector<Chunk *> filtered;
-		size_t i = 0;
-		auto prev = heap.m_freed_chunks[i++]; //Heap::get_at(heap.m_freed_chunks, i++);
-		prev->m_marked = true;
-		filtered.push_back(prev);
-		cout << filtered.back()->m_start << endl;
-		for (; i < heap.m_freed_chunks.size(); i++)
-		{
-			prev = filtered.back();
-			auto next = heap.m_freed_chunks[i]; //Heap::get_at(heap.m_freed_chunks, i);
-			auto p_start = (uintptr_t)(prev->m_start);
-			auto p_size = (uintptr_t)(prev->m_size);
-			auto n_start = (uintptr_t)(next->m_start);
-			if (n_start >= (p_start + p_size))
-			{
-				next->m_marked = true;
-				filtered.push_back(next);
-			}
-		}
-		heap.m_freed_chunks.swap(filtered);
-		
-		bool profiler_enabled = heap.m_profiler_enable;
-		// After swap m_freed_chunks contains still available chunks
-		// and filtered contains all the chunks, so delete unused chunks
-		for (Chunk *chunk : filtered)
-		{
-			// if chunk was filtered away, delete it
-			if (!chunk->m_marked)
-			{
-				if (profiler_enabled)
-					Profiler::record(ChunkFreed, chunk);
-				delete chunk;
-			}
-			else
-			{
-				chunk->m_marked = false;
-			}
+		auto end = reinterpret_cast<Header *>(heap->m_heap + heap->m_top);
+		for (auto chunk = reinterpret_cast<Header *>(heap->m_heap); chunk < end; chunk = chunk->next()) {
+			if (!chunk->m_free)
+				print_line(chunk);
 		}
 	}
-
 #endif
-}
\ No newline at end of file
+}
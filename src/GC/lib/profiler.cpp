@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <ctime>
 #include <cstring>
 #include <iostream>
@@ -15,6 +16,9 @@
 
 namespace GC
 {
+    // The phases of a collection, in the order of m_phase_times
+    static uint64_t PhaseTimes::*const phase_fields[] = {&PhaseTimes::m_roots, &PhaseTimes::m_mark, &PhaseTimes::m_sweep, &PhaseTimes::m_free};
+
     Profiler& Profiler::the()
     {
         static Profiler instance;
@@ -33,18 +37,58 @@ namespace GC
         prof.flags = flags;
     }
 
-    void Profiler::record_data(GCEvent *event)
+    /**
+     * @returns The nanoseconds of the steady clock.
+    */
+    uint64_t Profiler::now()
+    {
+        auto time = std::chrono::steady_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+    }
+
+    /**
+     * Tells the profiler if the heap has it enabled. The
+     * histograms only count the pauses and allocations
+     * while it is, since the allocations are not all seen
+     * otherwise.
+     *
+     * @param mode  If the profiler is enabled.
+    */
+    void Profiler::set_enabled(bool mode)
     {
         Profiler &prof = Profiler::the();
-        prof.m_events.push_back(event);
+        if (!mode)
+            prof.close_cycle();
+        prof.m_enabled = mode;
+    }
 
-        if (prof.m_last_prof_event->m_type == event->get_type())
-            prof.m_last_prof_event->m_n++;
-        else
-        {
-            prof.m_prof_events.push_back(prof.m_last_prof_event);
-            prof.m_last_prof_event = new ProfilerEvent(event->get_type());
-        }
+    /**
+     * Adds the phase times of the last collection to the
+     * histograms of the phases, once no more time can be
+     * added to it.
+    */
+    void Profiler::close_cycle()
+    {
+        if (!m_cycle_open)
+            return;
+        const PhaseTimes &last = m_phases[(m_cycles - 1) % PROFILER_HISTORY];
+        for (int p = 0; p < 4; p++)
+            m_phase_times[p].record(last.*phase_fields[p]);
+        m_cycle_open = false;
+    }
+
+    /**
+     * Counts an event and pushes it onto the ring buffer,
+     * where it overwrites the oldest event once the buffer
+     * is full. Nothing is allocated.
+    */
+    void Profiler::record_data(GCEvent event)
+    {
+        Profiler &prof = Profiler::the();
+        prof.m_events.push(event);
+        prof.m_counts[__builtin_ctz(event.m_type)]++;
+        if (prof.m_trace != nullptr)
+            prof.m_trace->write(EventRecord, &event, sizeof(event));
     }
 
     /**
@@ -55,11 +99,8 @@ namespace GC
     void Profiler::record(GCEventType type)
     {
         Profiler &prof = Profiler::the();
-        if (prof.flags & type)
-            Profiler::record_data(new GCEvent(type));
-        // auto event = new GCEvent(type);
-        // auto profiler = Profiler::the();
-        // profiler.m_events.push_back(event);
+        if (prof.flags & int(type))
+            Profiler::record_data(GCEvent {now(), 0, 0, uint64_t(type)});
     }
 
     /**
@@ -73,11 +114,75 @@ namespace GC
     void Profiler::record(GCEventType type, size_t size)
     {
         Profiler &prof = Profiler::the();
-        if (prof.flags & type)
-            Profiler::record_data(new GCEvent(type, size));
-        // auto event = new GCEvent(type, size);
-        // auto profiler = Profiler::the();
-        // profiler.m_events.push_back(event);
+        Profiler::record(type, size, prof.flags & int(type) ? now() : 0);
+    }
+
+    /**
+     * Records an AllocStart event at a given time, so that
+     * the slow path of alloc() can give it and the event
+     * of its chunk the end time of the allocation, which
+     * it reads anyway, instead of reading the clock again.
+     *
+     * @param type  The type of event to record.
+     *
+     * @param size  The size of requested to alloc().
+     *
+     * @param time  The nanoseconds of the steady clock.
+    */
+    void Profiler::record(GCEventType type, size_t size, uint64_t time)
+    {
+        Profiler &prof = Profiler::the();
+        if (prof.m_enabled)
+            prof.m_alloc_sizes.record(size);
+        if (prof.flags & int(type))
+            Profiler::record_data(GCEvent {time, 0, size, uint64_t(type)});
+    }
+
+    /**
+     * Records the chunks that a thread bumped from its
+     * allocation buffer, when the buffer is flushed, as
+     * an AllocStart event with the size of each and a
+     * NewChunk event. The fast path does not call the
+     * profiler, so the events get the time of the flush
+     * and the sizes are the payloads of the chunks.
+     *
+     * Time complexity: O(N), where N is the number of
+     *                  chunks.
+     *
+     * @param from  The first chunk.
+     *
+     * @param to    The end of the last chunk.
+    */
+    void Profiler::record_buffer(Header *from, Header *to)
+    {
+        Profiler &prof = Profiler::the();
+        bool allocs = prof.flags & int(AllocStart), chunks = prof.flags & int(NewChunk);
+        if (!allocs && !chunks)
+        {
+            // The runs of chunks of the same size, like the
+            // cells of a list, are counted at once
+            while (prof.m_enabled && from < to)
+            {
+                size_t size = from->m_size;
+                uint64_t times = 0;
+                for (; from < to && from->m_size == size; from = from->next())
+                    times++;
+                prof.m_alloc_sizes.record(size - sizeof(Header), times);
+            }
+            return;
+        }
+
+        uint64_t time = now();
+        for (Header *chunk = from; chunk < to; chunk = chunk->next())
+        {
+            size_t size = chunk->m_size - sizeof(Header);
+            if (prof.m_enabled)
+                prof.m_alloc_sizes.record(size);
+            if (allocs)
+                Profiler::record_data(GCEvent {time, 0, size, uint64_t(AllocStart)});
+            if (chunks)
+                Profiler::record_data(GCEvent {time, reinterpret_cast<uintptr_t>(chunk->payload()), size, uint64_t(NewChunk)});
+        }
     }
 
     void Profiler::dump_trace()
@@ -101,68 +206,511 @@ namespace GC
     */
     void Profiler::record(GCEventType type, Chunk *chunk)
     {
-        // Create a copy of chunk to store in the profiler
-        // because in free() chunks are deleted and cannot
-        // be referenced by the profiler. These copied
-        // chunks are deleted by the profiler on dispose().
         Profiler &prof = Profiler::the();
-        if (prof.flags & type)
+        if (prof.flags & int(type))
+            Profiler::record(type, chunk, now());
+    }
+
+    /**
+     * Records an event related to a chunk at a given time.
+     * The sweep and the freeing record their chunks with
+     * one time for a whole batch, like record_buffer(),
+     * since reading the clock for each chunk costs more
+     * than recording its event.
+     *
+     * @param type  The type of event to record.
+     *
+     * @param chunk The chunk the event is connected
+     *              to.
+     *
+     * @param time  The nanoseconds of the steady clock,
+     *              from now().
+    */
+    void Profiler::record(GCEventType type, Chunk *chunk, uint64_t time)
+    {
+        // The address and size are copied into the event,
+        // since the chunk may be freed or reused before the
+        // history is dumped
+        Profiler &prof = Profiler::the();
+        if (prof.flags & int(type))
         {
-            auto chunk_copy = new Chunk(chunk);
-            auto event = new GCEvent(type, chunk_copy);
-            Profiler::record_data(event);
+            auto address = reinterpret_cast<uintptr_t>(chunk->m_start);
+            Profiler::record_data(GCEvent {time, address, chunk->m_size, uint64_t(type)});
         }
-        // auto profiler = Profiler::the();
-        // profiler.m_events.push_back(event);
     }
 
-    void Profiler::record(GCEventType type, std::chrono::microseconds time)
+    /**
+     * Adds the duration of a call to the total of its
+     * type. The phases are also added to the times of the
+     * collection they belong to, which starts with its
+     * root scan, so that the steps of a lazy sweep count
+     * for the collection before. The times of a collection
+     * go into the histograms of the phases once the next
+     * one starts, and only the last PROFILER_HISTORY
+     * collections are kept one by one.
+     *
+     * @param type  AllocStart, CollectStart, RootScan,
+     *              MarkStart, SweepStart or FreeStart.
+     *
+     * @param time  The duration of the call.
+    */
+    void Profiler::record(GCEventType type, std::chrono::nanoseconds time)
     {
         Profiler &prof = Profiler::the();
+        if (type == RootScan && prof.m_enabled)
+        {
+            prof.close_cycle();
+            prof.m_phases[prof.m_cycles++ % PROFILER_HISTORY] = PhaseTimes {};
+            prof.m_cycle_open = true;
+        }
+        PhaseTimes *phases = prof.m_cycle_open ? &prof.m_phases[(prof.m_cycles - 1) % PROFILER_HISTORY] : nullptr;
+
         if (type == AllocStart)
         {
             prof.alloc_time += time;
+            if (prof.m_enabled)
+                prof.m_alloc_latencies.record(time.count());
         }
         else if (type == CollectStart)
         {
             prof.collect_time += time;
+            prof.max_collect_time = std::max(prof.max_collect_time, time);
+            if (prof.m_enabled)
+                prof.m_pauses.record(time.count());
+        }
+        else if (type == MarkStart)
+        {
+            prof.mark_time += time;
+            if (phases != nullptr)
+                phases->m_mark += time.count();
+        }
+        else if (type == SweepStart)
+        {
+            prof.sweep_time += time;
+            prof.max_sweep_time = std::max(prof.max_sweep_time, time);
+            if (phases != nullptr)
+                phases->m_sweep += time.count();
+        }
+        else if (type == RootScan)
+        {
+            prof.root_time += time;
+            if (phases != nullptr)
+                phases->m_roots += time.count();
+        }
+        else if (type == FreeStart)
+        {
+            prof.free_time += time;
+            if (phases != nullptr)
+                phases->m_free += time.count();
+        }
+
+        // The phases are spans of the trace, the allocations
+        // are too many and too short to be worth one
+        if (prof.m_trace != nullptr && type != AllocStart)
+        {
+            uint64_t end = now();
+            uint64_t duration = time.count();
+            TraceSpan span {uint64_t(type), end - duration, duration};
+            prof.m_trace->write(SpanRecord, &span, sizeof(span));
+            if (type == CollectStart)
+                prof.m_trace->flush_if_due(end);
         }
     }
 
-    void Profiler::dump_prof_trace(bool timing_only)
+    /**
+     * Starts writing the events and the phases that are
+     * recorded from now on to a trace file, which
+     * tools/trace2json converts for a trace viewer.
+     * The trace is closed by dispose().
+     *
+     * @param path      The path of the trace file, which
+     *                  is replaced if it exists.
+     *
+     * @param mapped    If the file is written through a
+     *                  mapping instead of a buffer.
+     *
+     * @throws  A runtime error if the file cannot be
+     *          opened.
+    */
+    void Profiler::open_trace(const std::string &path, bool mapped)
     {
         Profiler &prof = Profiler::the();
-        prof.m_prof_events.push_back(prof.m_last_prof_event);
-        auto start = prof.m_prof_events.begin();
-        auto end = prof.m_prof_events.end();
-        int allocs = 0, collects = 0;
+        close_trace();
+        prof.m_trace = new TraceWriter(path, mapped, prof.m_start);
+    }
 
-        char buffer[22];
-        std::ofstream fstr = prof.create_file_stream();
+    /**
+     * Writes out the rest of the trace and closes the
+     * file, if a trace is open.
+    */
+    void Profiler::close_trace()
+    {
+        Profiler &prof = Profiler::the();
+        delete prof.m_trace;
+        prof.m_trace = nullptr;
+    }
+
+    /**
+     * Records the pacing chosen at the end of a
+     * collection. It is added to the totals, and only the
+     * last PROFILER_HISTORY targets are kept one by one.
+     *
+     * @param target    The live bytes, the bytes allocated
+     *                  since the last collection and the
+     *                  trigger of the next collection.
+    */
+    void Profiler::record(PacingTarget target)
+    {
+        Profiler &prof = Profiler::the();
+        PacingTotals &pacing = prof.m_pacing;
+        prof.m_targets[pacing.m_collections++ % PROFILER_HISTORY] = target;
+        if (target.m_minor)
+        {
+            pacing.m_minors++;
+            pacing.m_promoted += target.m_promoted;
+            pacing.m_nursery += target.m_allocated;
+        }
+        pacing.m_last = target;
+    }
+
+    /**
+     * @returns The totals of the pacing chosen by the
+     *          collections while the profiler was enabled,
+     *          and the pacing of the last one.
+    */
+    const PacingTotals &Profiler::pacing()
+    {
+        Profiler &prof = Profiler::the();
+        return prof.m_pacing;
+    }
+
+    /**
+     * @param phase RootScan, MarkStart, SweepStart or
+     *              FreeStart.
+     *
+     * @returns The times of a phase per collection, of
+     *          the collections run while the profiler was
+     *          enabled, but the last one while its lazy
+     *          sweep may still go on.
+    */
+    const Histogram &Profiler::phase_times(GCEventType phase)
+    {
+        Profiler &prof = Profiler::the();
+        switch (phase)
+        {
+            case RootScan:      return prof.m_phase_times[0];
+            case MarkStart:     return prof.m_phase_times[1];
+            case SweepStart:    return prof.m_phase_times[2];
+            case FreeStart:     return prof.m_phase_times[3];
+            default:
+                throw std::runtime_error(std::string("Error: Not a phase of a collection"));
+        }
+    }
+
+    /**
+     * @returns The durations of the collections, each of
+     *          which keeps the program stopped.
+    */
+    const Histogram &Profiler::pauses()
+    {
+        Profiler &prof = Profiler::the();
+        return prof.m_pauses;
+    }
+
+    /**
+     * @returns The durations of the allocations that
+     *          took the slow path. The ones bumped from
+     *          an allocation buffer are not timed.
+    */
+    const Histogram &Profiler::alloc_latencies()
+    {
+        Profiler &prof = Profiler::the();
+        return prof.m_alloc_latencies;
+    }
+
+    /**
+     * @returns The payload sizes of the chunks that were
+     *          allocated while the profiler was enabled,
+     *          and the requested sizes of the large ones.
+    */
+    const Histogram &Profiler::alloc_sizes()
+    {
+        Profiler &prof = Profiler::the();
+        return prof.m_alloc_sizes;
+    }
+
+    /**
+     * @param type  The type of event.
+     *
+     * @returns The number of events of the type recorded
+     *          while the profiler was enabled, including
+     *          the ones that the ring buffer has lost.
+    */
+    uint64_t Profiler::recorded(GCEventType type)
+    {
+        Profiler &prof = Profiler::the();
+        return prof.m_counts[__builtin_ctz(type)];
+    }
+
+    /**
+     * @returns The number of events that were overwritten
+     *          in the ring buffer before they were dumped.
+    */
+    uint64_t Profiler::lost()
+    {
+        Profiler &prof = Profiler::the();
+        return prof.m_events.lost();
+    }
+
+    /**
+     * @returns The time the collections have spent
+     *          marking with the program stopped.
+    */
+    std::chrono::microseconds Profiler::marking_time()
+    {
+        Profiler &prof = Profiler::the();
+        return std::chrono::duration_cast<std::chrono::microseconds>(prof.mark_time);
+    }
+
+    /**
+     * @returns The time spent sweeping, at the end of the
+     *          collections or in the lazy sweep steps of
+     *          the allocations, without freeing the free
+     *          runs found.
+    */
+    std::chrono::microseconds Profiler::sweeping_time()
+    {
+        Profiler &prof = Profiler::the();
+        return std::chrono::duration_cast<std::chrono::microseconds>(prof.sweep_time);
+    }
+
+    /**
+     * @returns The longest time a single sweep has kept
+     *          the program stopped, a whole sweep or one
+     *          lazy sweep step, without freeing.
+    */
+    std::chrono::microseconds Profiler::max_sweeping_time()
+    {
+        Profiler &prof = Profiler::the();
+        return std::chrono::duration_cast<std::chrono::microseconds>(prof.max_sweep_time);
+    }
+
+    /**
+     * @returns The time the collections have spent
+     *          finding the roots on the stacks.
+    */
+    std::chrono::microseconds Profiler::root_scanning_time()
+    {
+        Profiler &prof = Profiler::the();
+        return std::chrono::duration_cast<std::chrono::microseconds>(prof.root_time);
+    }
+
+    /**
+     * @returns The time spent adding the free runs found
+     *          by the sweeps to the free lists.
+    */
+    std::chrono::microseconds Profiler::freeing_time()
+    {
+        Profiler &prof = Profiler::the();
+        return std::chrono::duration_cast<std::chrono::microseconds>(prof.free_time);
+    }
 
-        while (start != end)
+    void Profiler::dump_targets(std::ofstream &fstr)
+    {
+        Profiler &prof = Profiler::the();
+        uint64_t collections = prof.m_pacing.m_collections;
+        if (collections == 0)
+            return;
+
+        fstr << "\n\nCollection targets of the last " << std::min<uint64_t>(collections, PROFILER_HISTORY)
+             << " collections (live / allocated / next trigger / promoted by a minor, bytes):";
+        for (uint64_t i = collections - std::min<uint64_t>(collections, PROFILER_HISTORY); i < collections; i++)
         {
-            auto event = *start++;
+            const PacingTarget &target = prof.m_targets[i % PROFILER_HISTORY];
+            fstr << "\n" << target.m_live
+                 << "\t" << target.m_allocated
+                 << "\t" << target.m_target;
+            if (target.m_minor)
+                fstr << "\t" << target.m_promoted;
+        }
+        fstr << "\n--------------------------------";
+    }
 
-            if (event->m_type == AllocStart)
-                allocs += event->m_n;
-            else if (event->m_type == CollectStart)
-                collects += event->m_n;
+    /**
+     * Prints the minimum, average and maximum time of each
+     * phase over the collections, with its median, 99th
+     * percentile and share of the time of all phases, and
+     * then the times of the last collections.
+    */
+    void Profiler::dump_phases(std::ofstream &fstr)
+    {
+        Profiler &prof = Profiler::the();
+        uint64_t cycles = prof.m_cycles;
+        if (cycles == 0)
+            return;
+
+        // The last collection is only in the histograms once
+        // it is closed
+        const char *names[] = {"Root scanning", "Marking", "Sweeping", "Freeing"};
+        std::vector<Histogram> times(prof.m_phase_times, prof.m_phase_times + 4);
+        const PhaseTimes &last = prof.m_phases[(cycles - 1) % PROFILER_HISTORY];
+        uint64_t all = 0;
+        for (int p = 0; p < 4; p++)
+        {
+            if (prof.m_cycle_open)
+                times[p].record(last.*phase_fields[p]);
+            all += times[p].total();
+        }
+
+        fstr << "\n\nPhase times per collection (min / avg / max / p50 / p99, nanoseconds, share of all phases):";
+        for (int p = 0; p < 4; p++)
+        {
+            fstr << "\n" << names[p] << ":\t" << times[p].min()
+                 << "\t" << uint64_t(times[p].mean())
+                 << "\t" << times[p].max()
+                 << "\t" << times[p].percentile(50)
+                 << "\t" << times[p].percentile(99)
+                 << "\t" << (all ? 100.0 * times[p].total() / all : 0.0) << " %";
+        }
+        fstr << "\n--------------------------------";
+
+        fstr << "\n\nPhase times of the last " << std::min<uint64_t>(cycles, PROFILER_HISTORY)
+             << " collections (roots / mark / sweep / free, nanoseconds):";
+        for (uint64_t i = cycles - std::min<uint64_t>(cycles, PROFILER_HISTORY); i < cycles; i++)
+        {
+            const PhaseTimes &phases = prof.m_phases[i % PROFILER_HISTORY];
+            fstr << "\n" << phases.m_roots
+                 << "\t" << phases.m_mark
+                 << "\t" << phases.m_sweep
+                 << "\t" << phases.m_free;
+        }
+        fstr << "\n--------------------------------";
+    }
 
-            if (!timing_only)
+    /**
+     * Prints the percentiles of the pauses, the allocation
+     * latencies and the allocation sizes.
+    */
+    void Profiler::dump_histograms(std::ofstream &fstr)
+    {
+        Profiler &prof = Profiler::the();
+        const char *names[] = {"Collection pauses (ns)", "Allocation latencies (ns)", "Allocation sizes (B)"};
+        const Histogram *histograms[] = {&prof.m_pauses, &prof.m_alloc_latencies, &prof.m_alloc_sizes};
+
+        fstr << "\n\nPercentiles (count / p50 / p90 / p99 / p99.9 / max):";
+        for (int h = 0; h < 3; h++)
+        {
+            const Histogram &histogram = *histograms[h];
+            fstr << "\n" << names[h] << ":\t" << histogram.count();
+            for (double percent : {50.0, 90.0, 99.0, 99.9})
+                fstr << "\t" << histogram.percentile(percent);
+            fstr << "\t" << histogram.max();
+        }
+        fstr << "\n--------------------------------";
+    }
+
+    /**
+     * Writes the histograms of the pauses, the allocation
+     * latencies and the allocation sizes as JSON: for
+     * each the count, the mean, the percentiles and the
+     * buckets that are not empty, as the lowest and the
+     * highest value of the bucket and its count. The dump
+     * writes it to a .json file next to the log file.
+     *
+     * @param out   The stream to write to.
+    */
+    void Profiler::export_histograms(std::ostream &out)
+    {
+        Profiler &prof = Profiler::the();
+        const char *names[] = {"pauses_ns", "alloc_latencies_ns", "alloc_sizes_bytes"};
+        const Histogram *histograms[] = {&prof.m_pauses, &prof.m_alloc_latencies, &prof.m_alloc_sizes};
+
+        out << "{";
+        for (int h = 0; h < 3; h++)
+        {
+            const Histogram &histogram = *histograms[h];
+            out << (h ? ",\n" : "\n") << "\"" << names[h] << "\": {\"count\": " << histogram.count()
+                << ", \"mean\": " << histogram.mean()
+                << ", \"p50\": " << histogram.percentile(50)
+                << ", \"p90\": " << histogram.percentile(90)
+                << ", \"p99\": " << histogram.percentile(99)
+                << ", \"p99.9\": " << histogram.percentile(99.9)
+                << ", \"max\": " << histogram.max()
+                << ", \"buckets\": [";
+            const char *separator = "";
+            for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++)
             {
-                fstr << "\n--------------------------------\n"
-                << Profiler::type_to_string(event->m_type) << " "
-                << event->m_n << " times:"; 
+                if (histogram.count(b) == 0)
+                    continue;
+                out << separator << "[" << Histogram::lowest(b) << ", " << Histogram::highest(b) << ", " << histogram.count(b) << "]";
+                separator = ", ";
             }
+            out << "]}";
+        }
+        out << "\n}" << std::endl;
+    }
+
+    void Profiler::dump_prof_trace(bool timing_only)
+    {
+        Profiler &prof = Profiler::the();
+        uint64_t allocs = recorded(AllocStart), collects = recorded(CollectStart);
+
+        std::ofstream fstr = prof.create_file_stream();
+
+        // The runs of events of the same type, of the
+        // events that the ring buffer still holds
+        uint64_t n = prof.m_events.size();
+        for (uint64_t i = 0, j; !timing_only && i < n; i = j)
+        {
+            GCEventType type = prof.m_events[i].get_type();
+            for (j = i + 1; j < n && prof.m_events[j].get_type() == type; j++)
+                ;
+            fstr << "\n--------------------------------\n"
+            << Profiler::type_to_string(type) << " "
+            << j - i << " times:";
         }
         fstr << "\n--------------------------------";
+        if (!timing_only)
+        {
+            // The events cost more than the timing, see profiler_bench
+            fstr << "\nEvents recorded:\t" << prof.m_events.written()
+                 << "\nEvents lost to the ring buffer:\t" << prof.m_events.lost()
+                 << "\nNote: recording events slows the allocations down, use TimingInfo in production";
+        }
 
-        fstr << "\n\nTime spent on allocations:\t" << prof.alloc_time.count() << " microseconds"
+        auto us = [](std::chrono::nanoseconds time)
+        {
+            return std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+        };
+        fstr << "\n\nTime spent on allocations:\t" << us(prof.alloc_time) << " microseconds"
             << "\nAllocation cycles:\t" << allocs
-            << "\nTime spent on collections:\t" << prof.collect_time.count() << " microseconds"
+            << "\nTime spent on collections:\t" << us(prof.collect_time) << " microseconds"
             << "\nCollection cycles:\t" << collects
+            << "\nTime spent on marking:\t" << us(prof.mark_time) << " microseconds"
+            << "\nLongest collection pause:\t" << us(prof.max_collect_time) << " microseconds"
+            << "\nTime spent on sweeping:\t" << us(prof.sweep_time) << " microseconds"
+            << "\nLongest sweep pause:\t" << us(prof.max_sweep_time) << " microseconds"
+            << "\nTime spent on freeing:\t" << us(prof.free_time) << " microseconds"
+            << "\nTime spent on root scanning:\t" << us(prof.root_time) << " microseconds"
             << "\n--------------------------------";
+
+        // The promotion rate is the share of the bytes allocated
+        // before the minor collections that survived them
+        const PacingTotals &pacing = prof.m_pacing;
+        if (pacing.m_minors > 0)
+        {
+            fstr << "\nMinor collections:\t" << pacing.m_minors
+                 << "\nMajor collections:\t" << pacing.m_collections - pacing.m_minors
+                 << "\nPromotion rate:\t" << (pacing.m_nursery ? 100.0 * pacing.m_promoted / pacing.m_nursery : 0.0) << " %"
+                 << "\n--------------------------------";
+        }
+
+        dump_phases(fstr);
+        dump_histograms(fstr);
+        dump_targets(fstr);
+
+        std::ofstream json = prof.create_file_stream(".json");
+        export_histograms(json);
     }
 
     /**
@@ -172,72 +720,59 @@ namespace GC
     void Profiler::dump_chunk_trace()
     {
         Profiler &prof = Profiler::the();
-        auto start = prof.m_events.begin();
-        auto end = prof.m_events.end();
 
         // Buffer for timestamp
         char buffer[22];
 
-        while (start != end)
-        {
-            auto event = *start++;
-            auto e_type = event->get_type();
-
-            prof.print_chunk_event(event, buffer);
-        }
+        std::ofstream fstr = prof.create_file_stream();
+        for (uint64_t i = 0, n = prof.m_events.size(); i < n; i++)
+            prof.print_chunk_event(fstr, prof.m_events[i], buffer);
     }
 
-    void Profiler::print_chunk_event(GCEvent *event, char buffer[22])
+    void Profiler::print_chunk_event(std::ofstream &fstr, const GCEvent &event, char buffer[22])
     {
         Profiler &prof = Profiler::the();
-        // File output stream
-        std::ofstream fstr = prof.create_file_stream(); 
-        std::time_t tt = event->get_time_stamp(); 
-        std::tm *btm = std::localtime(&tt);
-        std::strftime(buffer, 22, "%a %T", btm);
+        // Seconds since the profiler started
+        snprintf(buffer, 22, "%.9f s", (event.m_time - prof.m_start) / 1e9);
 
         fstr << "--------------------------------\n"
              << buffer
-             << "\nEvent:\t" << Profiler::type_to_string(event->get_type());
-             // event->type_to_string(); 
-        
-
-
-        const Chunk *chunk = event->get_chunk(); 
+             << "\nEvent:\t" << Profiler::type_to_string(event.get_type());
 
-        if (event->get_type() == AllocStart)
+        if (event.get_type() == AllocStart)
         {
-            fstr << "\nSize: " << event->get_size();
+            fstr << "\nSize: " << event.m_size;
         }
-        else if (chunk)
+        else if (event.m_address != 0)
         {
-            fstr << "\nChunk:  " << chunk->m_start
-                 << "\n  Size: " << chunk->m_size
-                 << "\n  Mark: " << chunk->m_marked;
+            fstr << "\nChunk:  " << reinterpret_cast<void *>(event.m_address)
+                 << "\n  Size: " << event.m_size;
         }
         fstr << "\n";
     }
 
     /**
-     * Deletes the profiler singleton and all
-     * the events recorded after recording
-     * the ProfilerDispose event and dumping
-     * the history to a log file.
+     * Records the ProfilerDispose event, dumps
+     * the history to a log file and closes the
+     * trace file, if one is open.
     */
     void Profiler::dispose()
     {
         Profiler::record(ProfilerDispose);
         Profiler::dump_trace();
+        Profiler::close_trace();
     }
 
     /**
      * Creates a filestream for the future
      * log file to print the history to in
      * dump_trace().
+     *
+     * @param extension The extension of the file name.
      * 
      * @returns The output stream to the file.
     */
-    std::ofstream Profiler::create_file_stream()
+    std::ofstream Profiler::create_file_stream(const char *extension)
     {
         // get current time
         std::time_t tt = std::time(NULL);
@@ -245,8 +780,8 @@ namespace GC
 
         // format to string
         char buffer[32];
-        std::strftime(buffer, 32, "/log_%a_%H_%M_%S.txt", ptm);
-        std::string filename(buffer);
+        std::strftime(buffer, 32, "/log_%a_%H_%M_%S", ptm);
+        std::string filename = std::string(buffer) + extension;
         
         // const std::string ABS_PATH = "/home/virre/dev/systemF/org/language/src/GC/";
         // // const std::string ABS_PATH = "/Users/valtermiari/Desktop/DV/Bachelors/code/language/src/GC";
@@ -310,6 +845,7 @@ namespace GC
             case ProfilerDispose:   return "ProfilerDispose";
             case SweepStart:        return "SweepStart";
             case FreeStart:         return "FreeStart";
+            case RootScan:          return "RootScan";
             default:                return "[Unknown]";
         }
     }
@@ -0,0 +1,183 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.hpp"
+
+namespace GC
+{
+    /**
+     * Creates or truncates the trace file and writes its
+     * header.
+     *
+     * @param path      The path of the trace file.
+     *
+     * @param mapped    If the file is written through a
+     *                  mapping instead of a buffer.
+     *
+     * @param start     The nanoseconds of the steady clock
+     *                  that the times of the records are
+     *                  relative to.
+     *
+     * @throws  A runtime error if the file cannot be
+     *          opened or mapped.
+    */
+    TraceWriter::TraceWriter(const std::string &path, bool mapped, uint64_t start)
+        : m_mapped(mapped), m_flushed(start)
+    {
+        m_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (m_fd == -1)
+            throw std::runtime_error(std::string("Error: Could not open the trace file '") + path + "'");
+
+        if (m_mapped)
+            map_window(0);
+        else
+            m_buffer = new char[TRACE_BUFFER];
+
+        TraceHeader header {TRACE_MAGIC, start};
+        std::memcpy(m_buffer, &header, sizeof(header));
+        m_used = sizeof(header);
+    }
+
+    /**
+     * Writes out the records that are left and cuts a
+     * mapped file down to the bytes that were written.
+    */
+    TraceWriter::~TraceWriter()
+    {
+        if (m_mapped)
+        {
+            munmap(m_buffer, TRACE_WINDOW);
+            // If the file cannot be cut, a reader stops at
+            // the zeros after the last record
+            bool cut = ftruncate(m_fd, m_offset + m_used) == 0;
+            static_cast<void>(cut);
+        }
+        else
+        {
+            write_out();
+            delete[] m_buffer;
+        }
+        close(m_fd);
+    }
+
+    /**
+     * Appends a record to the trace.
+     *
+     * @param kind      The kind of the record.
+     *
+     * @param payload   The bytes of the record.
+     *
+     * @param size      The number of bytes of the record.
+     *
+     * @throws  A runtime error if the buffer or window
+     *          that is full cannot be written out.
+    */
+    void TraceWriter::write(TraceKind kind, const void *payload, uint32_t size)
+    {
+        size_t capacity = m_mapped ? TRACE_WINDOW : TRACE_BUFFER;
+        if (m_used + sizeof(TraceRecord) + size > capacity)
+            advance();
+
+        TraceRecord record {uint32_t(sizeof(record.m_kind) + size), kind};
+        std::memcpy(m_buffer + m_used, &record, sizeof(record));
+        std::memcpy(m_buffer + m_used + sizeof(record), payload, size);
+        m_used += sizeof(record) + size;
+    }
+
+    /**
+     * Writes the buffer out to the file, or schedules the
+     * written part of the window to be, so that a crash
+     * of the program loses nothing from before.
+     *
+     * @param now   The nanoseconds of the steady clock.
+     *
+     * @throws  A runtime error if the buffer cannot be
+     *          written.
+    */
+    void TraceWriter::flush(uint64_t now)
+    {
+        m_flushed = now;
+        if (m_mapped)
+            msync(m_buffer, m_used, MS_ASYNC);
+        else if (!write_out())
+            throw std::runtime_error(std::string("Error: Could not write the trace file"));
+    }
+
+    /**
+     * Flushes the trace if it has not been flushed for
+     * TRACE_FLUSH_MS, which the profiler checks at the
+     * end of every collection.
+     *
+     * @param now   The nanoseconds of the steady clock.
+    */
+    void TraceWriter::flush_if_due(uint64_t now)
+    {
+        if (now - m_flushed >= uint64_t(TRACE_FLUSH_MS) * 1000000)
+            flush(now);
+    }
+
+    /**
+     * Maps the window of the file that contains a
+     * position, from the page that the position is on,
+     * and continues writing at the position.
+     *
+     * @param position  The offset in the file of the
+     *                  next record.
+     *
+     * @throws  A runtime error if the file cannot be
+     *          extended or mapped.
+    */
+    void TraceWriter::map_window(off_t position)
+    {
+        static const off_t page = sysconf(_SC_PAGESIZE);
+        m_offset = position & ~(page - 1);
+        m_used = position - m_offset;
+        void *addr = MAP_FAILED;
+        if (ftruncate(m_fd, m_offset + TRACE_WINDOW) == 0)
+            addr = mmap(nullptr, TRACE_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, m_offset);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error(std::string("Error: Could not map the trace file"));
+        m_buffer = static_cast<char *>(addr);
+    }
+
+    /**
+     * Makes room for a record when the buffer or the
+     * window is full, by writing the buffer out or by
+     * mapping the next window.
+    */
+    void TraceWriter::advance()
+    {
+        if (m_mapped)
+        {
+            munmap(m_buffer, TRACE_WINDOW);
+            map_window(m_offset + m_used);
+        }
+        else if (!write_out())
+            throw std::runtime_error(std::string("Error: Could not write the trace file"));
+    }
+
+    /**
+     * Writes the buffer to the end of the file and
+     * empties it.
+     *
+     * @returns False if the file cannot be written.
+    */
+    bool TraceWriter::write_out()
+    {
+        for (size_t done = 0; done < m_used;)
+        {
+            ssize_t n = ::write(m_fd, m_buffer + done, m_used - done);
+            if (n == -1 && errno != EINTR)
+                return false;
+            if (n > 0)
+                done += n;
+        }
+        m_offset += m_used;
+        m_used = 0;
+        return true;
+    }
+}
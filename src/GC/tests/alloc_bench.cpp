@@ -0,0 +1,155 @@
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include <vector>
+
+#include "cheap.h"
+#include "heap.hpp"
+
+#define POOL_SIZE   10000     // freed chunks waiting to be recycled
+#define REQUESTS    200000    // recycle requests per run
+#define CELLS       10000000  // cells allocated in the heap benchmark
+#define LIST_LENGTH 1000      // cells per garbage list
+
+using std::cout, std::endl;
+using GC::Chunk;
+using Clock = std::chrono::high_resolution_clock;
+
+/*
+ * Allocation throughput benchmark.
+ *
+ * The first part compares recycling freed chunks with the linear
+ * first-fit scan that Heap::try_recycle_chunks() used before the
+ * size-class free lists, on the same pool of freed chunks. Every
+ * recycled chunk is freed again, so the pool keeps its size.
+ *
+ * The second part measures GC::Heap::alloc() on the list cells that
+ * churf emits, including the collections it triggers, and the inline
+ * fast path cheap_alloc_inline() that churf emits instead of a call.
+ */
+
+struct Node
+{
+    long value;
+    Node *next;
+};
+
+// Sizes of constructor cells as emitted by cheap_alloc(i64 N)
+static size_t request_size(size_t i)
+{
+    static const size_t sizes[] = {16, 16, 24, 16, 32, 16, 24, 48};
+    return sizes[i % 8];
+}
+
+double first_fit(std::vector<Chunk *> pool)
+{
+    auto start = Clock::now();
+    for (size_t r = 0; r < REQUESTS; r++)
+    {
+        size_t size = request_size(r);
+        for (size_t i = 0; i < pool.size(); i++)
+        {
+            if (pool[i]->m_size >= size)
+            {
+                Chunk *chunk = pool[i];
+                pool.erase(pool.begin() + i);
+                pool.push_back(chunk);
+                break;
+            }
+        }
+    }
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+double size_classes(std::vector<Chunk *> &pool)
+{
+    std::vector<Chunk *> lists[NUM_SIZE_CLASSES];
+    uint64_t mask[NUM_SIZE_CLASSES / 64] {};
+    for (Chunk *chunk : pool)
+    {
+        size_t cls = GC::floor_class(chunk->m_size);
+        lists[cls].push_back(chunk);
+        mask[cls / 64] |= (uint64_t)1 << (cls % 64);
+    }
+
+    auto start = Clock::now();
+    for (size_t r = 0; r < REQUESTS; r++)
+    {
+        size_t cls = GC::size_class(request_size(r));
+        for (size_t w = cls / 64; w < NUM_SIZE_CLASSES / 64; w++)
+        {
+            uint64_t bits = mask[w] & (w == cls / 64 ? ~(uint64_t)0 << (cls % 64) : ~(uint64_t)0);
+            if (bits)
+            {
+                cls = w * 64 + __builtin_ctzll(bits);
+                break;
+            }
+        }
+        Chunk *chunk = lists[cls].back();
+        lists[cls].pop_back();
+        if (lists[cls].empty())
+            mask[cls / 64] &= ~((uint64_t)1 << (cls % 64));
+        // Free it again
+        lists[cls].push_back(chunk);
+        mask[cls / 64] |= (uint64_t)1 << (cls % 64);
+    }
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+template <void *(*Alloc)(unsigned long)>
+Node *create_list(size_t length)
+{
+    Node *head = nullptr;
+    for (size_t i = 0; i < length; i++)
+    {
+        Node *node = static_cast<Node *>(Alloc(sizeof(Node)));
+        node->value = i;
+        node->next = head;
+        head = node;
+    }
+    return head;
+}
+
+void *heap_alloc(unsigned long size)
+{
+    return GC::Heap::alloc(size);
+}
+
+template <void *(*Alloc)(unsigned long)>
+double list_alloc()
+{
+    auto start = Clock::now();
+    for (size_t i = 0; i < CELLS / LIST_LENGTH; i++)
+        create_list<Alloc>(LIST_LENGTH);
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+int main()
+{
+    GC::Heap::init();
+
+    // Mostly small chunks, as left behind by list programs, with
+    // the chunks large enough for the requests at the end
+    std::vector<Chunk *> pool;
+    for (size_t i = 0; i < POOL_SIZE; i++)
+        pool.push_back(new Chunk(i < POOL_SIZE * 9 / 10 ? 8 : 64, nullptr));
+
+    double ff = first_fit(pool);
+    double sc = size_classes(pool);
+    cout << "Recycling " << REQUESTS << " chunks from a pool of " << POOL_SIZE << ":\n"
+         << "  first-fit scan:\t" << ff * 1e9 / REQUESTS << " ns/request\n"
+         << "  size classes:  \t" << sc * 1e9 / REQUESTS << " ns/request\n";
+
+    double ha = list_alloc<heap_alloc>();
+    double ia = list_alloc<cheap_alloc_inline>();
+    cout << "Allocating " << CELLS << " cells of " << sizeof(Node) << " B:\n"
+         << "  Heap::alloc:       \t" << CELLS / ha / 1e6 << " M allocations/s\t"
+         << CELLS * sizeof(Node) / ha / (1 << 20) << " MB/s\n"
+         << "  cheap_alloc_inline:\t" << CELLS / ia / 1e6 << " M allocations/s\t"
+         << CELLS * sizeof(Node) / ia / (1 << 20) << " MB/s" << endl;
+
+    for (Chunk *chunk : pool)
+        delete chunk;
+    GC::Heap::dispose();
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "heap.hpp"
+
+#define LIVE_CELLS  200000   // cells of the list that stays alive
+#define GARBAGE     1        // garbage objects allocated after each cell
+#define NEW_CELLS   200000   // cells of the list allocated after the collection
+
+using std::cout, std::endl;
+
+/*
+ * Compaction benchmark.
+ *
+ * Builds a list whose cells are allocated between garbage objects, so
+ * that a collection leaves the live cells scattered over the heap with
+ * holes between them that are too small for the larger cells of a second
+ * list. Without compaction the heap grows for the second list, with it
+ * the first list is slid to the bottom of the heap and the second one is
+ * bump allocated above it. Reported are the footprint of the heap after
+ * the collection and after the second list, the time of the collection
+ * and whether the first list survived the moves. Each mode runs in a
+ * process of its own. A chunk that the stack scan finds a pointer to is
+ * pinned, and one pinned at the top of the heap keeps the footprint where
+ * it was, which is why the list is only reachable through a cell below it.
+ */
+
+struct Cell
+{
+    long value;
+    Cell *next;
+};
+
+struct BigCell
+{
+    long value;
+    BigCell *next;
+    long payload[8];
+};
+
+// The layouts of the cells, as TypeDescriptors with a single variant
+struct CellLayout
+{
+    uint64_t variants;
+    uint64_t pointers[1];
+};
+
+static const CellLayout cell_layout = {1, {1 << 1}};
+
+// The time spent in the phases of the collections
+static std::chrono::microseconds gc_time()
+{
+    return GC::Profiler::marking_time() + GC::Profiler::sweeping_time() + GC::Profiler::freeing_time();
+}
+
+// Allocates garbage until the heap has been collected once. The garbage
+// is large, so that a stale pointer to the last of it, which the stack
+// scan takes for a root, does not pin a chunk at the top of the heap
+static void collect_now()
+{
+    size_t before = GC::Profiler::pacing().m_collections;
+    while (GC::Profiler::pacing().m_collections == before)
+        GC::Heap::alloc_atomic(LARGE_CHUNK_MIN);
+}
+
+static Cell *__attribute__((noinline)) build()
+{
+    Cell *head = nullptr;
+    for (long i = 0; i < LIVE_CELLS; i++)
+    {
+        Cell *cell = static_cast<Cell *>(GC::Heap::alloc_typed(sizeof(Cell), 1));
+        cell->value = i;
+        cell->next = head;
+        head = cell;
+        for (int k = 0; k < GARBAGE; k++)
+            GC::Heap::alloc_atomic(5 * sizeof(long));
+    }
+    return head;
+}
+
+static BigCell *build_big()
+{
+    BigCell *head = nullptr;
+    for (long i = 0; i < NEW_CELLS; i++)
+    {
+        BigCell *cell = static_cast<BigCell *>(GC::Heap::alloc_typed(sizeof(BigCell), 1));
+        cell->value = i;
+        cell->next = head;
+        head = cell;
+    }
+    return head;
+}
+
+static bool intact(Cell *cell)
+{
+    long total = 0;
+    for (; cell != nullptr; cell = cell->next)
+        total += cell->value;
+    return total == (long)LIVE_CELLS * (LIVE_CELLS - 1) / 2;
+}
+
+// Clears the stack below the caller, where the frames of the allocations
+// left pointers to the last chunks, which are at the top of the heap
+static void __attribute__((noinline)) clear_stack()
+{
+    volatile char words[1 << 16];
+    for (size_t i = 0; i < sizeof(words); i++)
+        words[i] = 0;
+}
+
+// Builds the list and collects on a new heap, and writes the footprint
+// after the collection to a pipe
+static void work(bool compact, int out)
+{
+    GC::Heap::init();
+    GC::Heap &heap = GC::Heap::the();
+    // Only the pacing of the collections is recorded
+    heap.set_profiler_log_options(GC::TimingInfo);
+    heap.set_profiler(true);
+    GC::Heap::set_compact(compact);
+
+    auto layout = reinterpret_cast<const GC::TypeDescriptor *>(&cell_layout);
+    GC::Heap::set_types(&layout, 1);
+
+    // The stack only points to a cell allocated before the list, so
+    // that no pinned chunk is left at the top of the heap
+    Cell *volatile holder = static_cast<Cell *>(GC::Heap::alloc_typed(sizeof(Cell), 1));
+    holder->next = build();
+    clear_stack();
+    auto before = gc_time();
+    collect_now();
+    auto gc = gc_time() - before;
+    size_t collected = GC::Heap::footprint();
+
+    BigCell *volatile big = build_big();
+    cout << "\tafter gc " << collected / 1024 << " KB\tafter new list " << GC::Heap::footprint() / 1024
+         << " KB\tgc " << gc.count() / 1000 << " ms"
+         << (intact(holder->next) && big->value == NEW_CELLS - 1 ? "" : "\tlist corrupted!") << endl;
+    if (write(out, &collected, sizeof(collected)) != sizeof(collected))
+        exit(1);
+
+    heap.set_profiler(false);
+    GC::Heap::dispose();
+}
+
+// Runs a mode in a process of its own, so that the modes start from
+// empty heaps, and returns the footprint after the collection
+static size_t run(const char *name, bool compact)
+{
+    cout << "  " << name << std::flush;
+    int fds[2];
+    size_t collected = 0;
+    if (pipe(fds) != 0)
+        return 0;
+    pid_t child = fork();
+    if (child == 0)
+    {
+        work(compact, fds[1]);
+        exit(0);
+    }
+    waitpid(child, nullptr, 0);
+    if (read(fds[0], &collected, sizeof(collected)) != sizeof(collected))
+        collected = 0;
+    close(fds[0]);
+    close(fds[1]);
+    return collected;
+}
+
+int main()
+{
+    cout << "Collecting " << LIVE_CELLS << " live cells between garbage, then allocating "
+         << NEW_CELLS << " cells of " << sizeof(BigCell) << " B:" << endl;
+    size_t non_moving = run("non-moving:", false);
+    size_t compacting = run("compacting:", true);
+    if (compacting >= non_moving)
+        cout << "  the compaction did not shrink the heap!" << endl;
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+
+#include "heap.hpp"
+
+#define LIVE_CELLS  500000   // cells of the list that stays alive
+#define SORT_CELLS  2000     // cells of a list that is sorted
+#define SORTS       200      // lists sorted per collection mode
+
+using std::cout, std::endl;
+using Clock = std::chrono::high_resolution_clock;
+
+/*
+ * Generational collection benchmark.
+ *
+ * Sorts lists with a quicksort that filters immutable lists into new
+ * ones, like churf code does, while a long list stays alive. Almost
+ * every cell dies young, so a minor collection only traces the few
+ * that are still being sorted, where a full one traces the long list
+ * every time. Reported are the time of the sorts, the time spent
+ * marking and sweeping, the collections and the share of the bytes
+ * allocated before a minor collection that it promoted.
+ */
+
+struct Node
+{
+    long value;
+    Node *next;
+};
+
+static Node *cons(long value, Node *next)
+{
+    Node *node = static_cast<Node *>(GC::Heap::alloc(sizeof(Node)));
+    node->value = value;
+    node->next = next;
+    return node;
+}
+
+static Node *append(Node *xs, Node *ys)
+{
+    if (xs == nullptr)
+        return ys;
+    return cons(xs->value, append(xs->next, ys));
+}
+
+static Node *filter(Node *xs, long pivot, bool less)
+{
+    if (xs == nullptr)
+        return nullptr;
+    Node *rest = filter(xs->next, pivot, less);
+    return (xs->value < pivot) == less ? cons(xs->value, rest) : rest;
+}
+
+static Node *quicksort(Node *xs)
+{
+    if (xs == nullptr)
+        return nullptr;
+    Node *smaller = quicksort(filter(xs->next, xs->value, true));
+    Node *larger = quicksort(filter(xs->next, xs->value, false));
+    return append(smaller, cons(xs->value, larger));
+}
+
+static bool sorted(Node *xs, long length)
+{
+    for (; xs != nullptr && xs->next != nullptr; xs = xs->next, length--)
+        if (xs->value > xs->next->value)
+            return false;
+    return length == 1;
+}
+
+// The time spent in the phases of the collections
+static std::chrono::microseconds gc_time()
+{
+    return GC::Profiler::marking_time() + GC::Profiler::sweeping_time() + GC::Profiler::freeing_time();
+}
+
+static void run(const char *name)
+{
+    GC::PacingTotals before = GC::Profiler::pacing();
+    auto gc_before = gc_time();
+    bool ok = true;
+    auto start = Clock::now();
+    for (long i = 0; i < SORTS; i++)
+    {
+        Node *list = nullptr;
+        for (long k = 0; k < SORT_CELLS; k++)
+            list = cons(rand() % 100000, list);
+        ok = ok && sorted(quicksort(list), SORT_CELLS);
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    auto gc = gc_time() - gc_before;
+
+    const GC::PacingTotals &after = GC::Profiler::pacing();
+    size_t minors = after.m_minors - before.m_minors;
+    size_t promoted = after.m_promoted - before.m_promoted, nursery = after.m_nursery - before.m_nursery;
+    cout << "  " << name << "\t" << seconds << " s\tgc " << gc.count() / 1000 << " ms\tminor " << minors << "\tmajor "
+         << after.m_collections - before.m_collections - minors << "\tpromoted "
+         << (nursery ? 100.0 * promoted / nursery : 0.0) << " %" << (ok ? "" : "\tnot sorted!") << endl;
+}
+
+int main()
+{
+    GC::Heap::init();
+    GC::Heap &heap = GC::Heap::the();
+    // Only the pacing of the collections is recorded
+    heap.set_profiler_log_options(GC::TimingInfo);
+    heap.set_profiler(true);
+
+    Node *live = nullptr;
+    for (long i = 0; i < LIVE_CELLS; i++)
+        live = cons(i, live);
+
+    cout << "Sorting " << SORTS << " lists of " << SORT_CELLS << " cells next to "
+         << LIVE_CELLS << " live cells:" << endl;
+    run("full:        ");
+    GC::Heap::set_generational(true);
+    run("generational:");
+
+    long total = 0;
+    for (Node *node = live; node != nullptr; node = node->next)
+        total += node->value;
+    if (total != (long)LIVE_CELLS * (LIVE_CELLS - 1) / 2)
+        cout << "The live list was corrupted!" << endl;
+
+    heap.set_profiler(false);
+    GC::Heap::dispose();
+    return 0;
+}
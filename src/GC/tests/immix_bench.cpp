@@ -0,0 +1,176 @@
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "heap.hpp"
+
+#define SLOTS       (1 << 16)   // lists that are alive at a time
+#define ROW         32          // slots of a row of the table
+#define STEPS       500000      // lists replaced per run
+#define LIST_MAX    8           // cells of the longest list
+#define STRING_MAX  1000        // bytes of the longest string
+
+using std::cout, std::endl;
+using Clock = std::chrono::high_resolution_clock;
+
+/*
+ * Immix benchmark.
+ *
+ * Keeps a table of short lists alive and replaces random ones, like a
+ * churf program that builds and drops lists, so that the survivors end
+ * up scattered between dead cells. Then again with strings of random
+ * sizes allocated next to the cells, which die young, so that the
+ * survivors are scattered between dead objects of other sizes. The
+ * strings are filled, so that one placed over a live cell breaks its
+ * list, and every list is checked against its length at the end. Run for
+ * the free lists, for an Immix heap and for an Immix heap that evacuates
+ * its fragmented blocks, each in a process of its own. Reported are the
+ * allocations per second outside of collections, the time spent in
+ * collections, and the largest heap of the run over the live data.
+ */
+
+struct Cell
+{
+    long value;
+    Cell *next;
+};
+
+struct Row
+{
+    Cell *slots[ROW];
+};
+
+// The layouts of a cell and a row, as TypeDescriptors with a single variant
+struct CellLayout
+{
+    uint64_t variants;
+    uint64_t pointers[1];
+};
+
+static const CellLayout cell_layout = {1, {1 << 1}};
+static const CellLayout row_layout = {1, {~(uint64_t)0 >> (64 - ROW)}};
+
+// The length of the list in each slot, off the heap
+static long lengths[SLOTS];
+
+// The time spent in the phases of the collections
+static std::chrono::microseconds gc_time()
+{
+    return GC::Profiler::marking_time() + GC::Profiler::sweeping_time() + GC::Profiler::freeing_time();
+}
+
+static Cell *list(long length, bool strings, size_t &allocations)
+{
+    Cell *head = nullptr;
+    for (long i = 0; i < length; i++)
+    {
+        Cell *cell = static_cast<Cell *>(GC::Heap::alloc_typed(sizeof(Cell), 1));
+        cell->value = i;
+        cell->next = head;
+        head = cell;
+        allocations++;
+        if (strings)
+        {
+            size_t size = 1 + rand() % STRING_MAX;
+            memset(GC::Heap::alloc_atomic(size), 0xff, size);
+            allocations++;
+        }
+    }
+    return head;
+}
+
+// If a list still holds the values list() gave it
+static bool intact(Cell *cell, long length)
+{
+    for (long i = length - 1; i >= 0; i--, cell = cell->next)
+        if (cell == nullptr || cell->value != i)
+            return false;
+    return cell == nullptr;
+}
+
+static void work(bool strings, bool immix, bool evacuate)
+{
+    GC::Heap::init();
+    GC::Heap &heap = GC::Heap::the();
+    // Only the pacing of the collections is recorded
+    heap.set_profiler_log_options(GC::TimingInfo);
+    heap.set_profiler(true);
+    const GC::TypeDescriptor *layouts[] = {
+        reinterpret_cast<const GC::TypeDescriptor *>(&cell_layout),
+        reinterpret_cast<const GC::TypeDescriptor *>(&row_layout),
+    };
+    GC::Heap::set_types(layouts, 2);
+    GC::Heap::set_immix(immix);
+    GC::Heap::set_compact(evacuate);
+
+    srand(1);
+    size_t allocations = 0;
+    // The rows are typed, so the lists in them can move
+    auto table = static_cast<Row **>(GC::Heap::alloc(SLOTS / ROW * sizeof(Row *)));
+    for (size_t r = 0; r < SLOTS / ROW; r++)
+    {
+        table[r] = static_cast<Row *>(GC::Heap::alloc_typed(sizeof(Row), 2));
+        for (size_t k = 0; k < ROW; k++)
+        {
+            lengths[r * ROW + k] = 1 + rand() % LIST_MAX;
+            table[r]->slots[k] = list(lengths[r * ROW + k], strings, allocations);
+        }
+    }
+
+    size_t footprint = 0;
+    size_t collections = GC::Profiler::pacing().m_collections;
+    auto gc_before = gc_time();
+    auto start = Clock::now();
+    for (long i = 0; i < STEPS; i++)
+    {
+        long slot = rand() % SLOTS;
+        lengths[slot] = 1 + rand() % LIST_MAX;
+        table[slot / ROW]->slots[slot % ROW] = list(lengths[slot], strings, allocations);
+        if (GC::Profiler::pacing().m_collections != collections)
+        {
+            collections = GC::Profiler::pacing().m_collections;
+            footprint = std::max(footprint, GC::Heap::footprint());
+        }
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    auto gc = gc_time() - gc_before;
+
+    bool ok = true;
+    for (size_t slot = 0; slot < SLOTS; slot++)
+        ok = ok && intact(table[slot / ROW]->slots[slot % ROW], lengths[slot]);
+    size_t live = GC::Profiler::pacing().m_last.m_live;
+    double mutator = seconds - gc.count() / 1e6;
+    cout << "\t" << allocations / mutator / 1e6 << " M allocs/s\tgc " << gc.count() / 1000 << " ms\theap/live "
+         << (double)footprint / live << (ok ? "" : "\tlists corrupted!") << endl;
+
+    heap.set_profiler(false);
+    GC::Heap::dispose();
+}
+
+static void run(const char *name, bool strings, bool immix, bool evacuate)
+{
+    cout << "  " << name << std::flush;
+    pid_t child = fork();
+    if (child == 0)
+    {
+        work(strings, immix, evacuate);
+        exit(0);
+    }
+    waitpid(child, nullptr, 0);
+}
+
+int main()
+{
+    cout << "Replacing " << STEPS << " of " << SLOTS << " lists of up to " << LIST_MAX << " cells:" << endl;
+    run("free lists:", false, false, false);
+    run("immix:     ", false, true, false);
+    run("evacuating:", false, true, true);
+    cout << "With a string of up to " << STRING_MAX << " B next to every cell:" << endl;
+    run("free lists:", true, false, false);
+    run("immix:     ", true, true, false);
+    run("evacuating:", true, true, true);
+    return 0;
+}
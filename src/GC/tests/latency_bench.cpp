@@ -0,0 +1,94 @@
+#include <iostream>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "heap.hpp"
+
+#define LIVE_CELLS  1000000     // cells of the list that stays alive
+#define SLOTS       (1 << 14)   // short lists that are replaced
+#define STEPS       1000000     // lists replaced per run
+#define LIST_MAX    8           // cells of the longest short list
+
+using std::cout, std::endl;
+
+/*
+ * Latency benchmark.
+ *
+ * Keeps a long list alive and replaces random short lists, with full
+ * collections, with an incremental mark of 500 us slices, with a
+ * concurrent mark and with generational collection, each in a process
+ * of its own. Reported are the percentiles of the collection pauses
+ * and the 99.9th percentile and maximum of the latencies of the
+ * allocations that take the slow path, in microseconds, from the
+ * histograms of the profiler.
+ */
+
+struct Cell
+{
+    long value;
+    Cell *next;
+};
+
+static Cell *list(long length)
+{
+    Cell *head = nullptr;
+    for (long i = 0; i < length; i++)
+    {
+        Cell *cell = static_cast<Cell *>(GC::Heap::alloc(sizeof(Cell)));
+        cell->value = i;
+        cell->next = head;
+        head = cell;
+    }
+    return head;
+}
+
+static void work(void (*mode)())
+{
+    GC::Heap::init();
+    GC::Heap &heap = GC::Heap::the();
+    heap.set_profiler_log_options(GC::TimingInfo);
+    mode();
+
+    srand(1);
+    Cell *volatile live = list(LIVE_CELLS);
+    auto table = static_cast<Cell **>(GC::Heap::alloc(SLOTS * sizeof(Cell *)));
+    for (size_t s = 0; s < SLOTS; s++)
+        table[s] = list(1 + rand() % LIST_MAX);
+
+    // Only the steps are measured
+    heap.set_profiler(true);
+    for (long i = 0; i < STEPS; i++)
+        table[rand() % SLOTS] = list(1 + rand() % LIST_MAX);
+    heap.set_profiler(false);
+
+    const GC::Histogram &pauses = GC::Profiler::pauses();
+    const GC::Histogram &allocs = GC::Profiler::alloc_latencies();
+    cout << "\t" << pauses.count() << "\t" << pauses.percentile(50) / 1000 << "\t" << pauses.percentile(99) / 1000
+         << "\t" << pauses.max() / 1000 << "\t" << allocs.percentile(99.9) / 1000 << "\t" << allocs.max() / 1000
+         << (live->value == LIVE_CELLS - 1 ? "" : "\tlist corrupted!") << endl;
+    GC::Heap::dispose();
+}
+
+static void run(const char *name, void (*mode)())
+{
+    cout << "  " << name << std::flush;
+    pid_t child = fork();
+    if (child == 0)
+    {
+        work(mode);
+        exit(0);
+    }
+    waitpid(child, nullptr, 0);
+}
+
+int main()
+{
+    cout << "Replacing " << STEPS << " of " << SLOTS << " lists next to " << LIVE_CELLS << " live cells:" << endl
+         << "  mode        \tpauses\tp50\tp99\tmax\talloc p99.9\talloc max (us)" << endl;
+    run("full:        ", [] {});
+    run("incremental: ", [] { GC::Heap::set_mark_budget(500); });
+    run("concurrent:  ", [] { GC::Heap::set_concurrent(true); });
+    run("generational:", [] { GC::Heap::set_generational(true); });
+    return 0;
+}
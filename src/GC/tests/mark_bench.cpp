@@ -0,0 +1,72 @@
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+
+#include "heap.hpp"
+
+#define TREE_DEPTH  21   // a complete binary tree of 2^21 - 1 nodes
+#define ROUNDS      5    // collections per thread count
+
+using std::cout, std::endl;
+
+/*
+ * Parallel mark benchmark.
+ *
+ * Builds a large binary tree, which unlike a list gives the mark
+ * threads work to steal from each other, and then collects the
+ * heap ROUNDS times for 1, 2, 4 and 8 mark threads. With a growth
+ * percent of zero every allocation triggers a collection. The time
+ * is the time spent marking as recorded by the profiler.
+ */
+
+struct Node
+{
+    Node *left;
+    Node *right;
+    long value;
+};
+
+Node *create_tree(int depth)
+{
+    Node *node = static_cast<Node *>(GC::Heap::alloc(sizeof(Node)));
+    node->value = depth;
+    node->left = depth > 1 ? create_tree(depth - 1) : nullptr;
+    node->right = depth > 1 ? create_tree(depth - 1) : nullptr;
+    return node;
+}
+
+long count(Node *node)
+{
+    return node == nullptr ? 0 : 1 + count(node->left) + count(node->right);
+}
+
+int main()
+{
+    GC::Heap::init();
+
+    Node *tree = create_tree(TREE_DEPTH);
+    long nodes = count(tree);
+    double live_mb = (double)nodes * GC::class_round(sizeof(Node) + sizeof(GC::Header)) / (1 << 20);
+    cout << "Marking a tree of " << nodes << " nodes, " << live_mb << " MB:" << endl;
+
+    GC::Heap::set_gc_percent(0);
+    for (size_t threads : {1, 2, 4, 8})
+    {
+        GC::Heap::set_mark_threads(threads);
+        auto before = GC::Profiler::marking_time();
+        for (int i = 0; i < ROUNDS; i++)
+            GC::Heap::alloc(sizeof(Node));
+        double seconds = std::chrono::duration<double>(GC::Profiler::marking_time() - before).count() / ROUNDS;
+        cout << "  " << threads << " threads:\t" << seconds * 1e3 << " ms\t"
+             << live_mb / seconds << " MB/s\t"
+             << live_mb / seconds / threads << " MB/s per thread" << endl;
+    }
+
+    if (count(tree) != nodes)
+    {
+        cout << "Error: the tree was collected" << endl;
+        return 1;
+    }
+    GC::Heap::dispose();
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "heap.hpp"
+
+#define SLOTS       (1 << 14)   // lists that are alive at a time
+#define STEPS       400000      // lists replaced per run
+#define LIST_MAX    8           // cells of the longest list
+
+using std::cout, std::endl;
+using Clock = std::chrono::high_resolution_clock;
+
+/*
+ * Profiler benchmark.
+ *
+ * Replaces random lists of a table, like a list-heavy churf program,
+ * with the profiler off, recording only the timing, the function calls
+ * or every chunk operation, each in a process of its own. Reported are
+ * the allocations per second, the peak resident memory of the process,
+ * and the events recorded and overwritten in the ring buffer.
+ */
+
+struct Cell
+{
+    long value;
+    Cell *next;
+};
+
+static Cell *list(long length)
+{
+    Cell *head = nullptr;
+    for (long i = 0; i < length; i++)
+    {
+        Cell *cell = static_cast<Cell *>(GC::Heap::alloc(sizeof(Cell)));
+        cell->value = i;
+        cell->next = head;
+        head = cell;
+    }
+    return head;
+}
+
+static void work(bool profile, GC::RecordOption options)
+{
+    GC::Heap::init();
+    GC::Heap &heap = GC::Heap::the();
+    heap.set_profiler_log_options(options);
+    heap.set_profiler(profile);
+
+    srand(1);
+    auto table = static_cast<Cell **>(GC::Heap::alloc(SLOTS * sizeof(Cell *)));
+    for (size_t s = 0; s < SLOTS; s++)
+        table[s] = list(1 + rand() % LIST_MAX);
+
+    size_t cells = 0;
+    auto start = Clock::now();
+    for (long i = 0; i < STEPS; i++)
+    {
+        long length = 1 + rand() % LIST_MAX;
+        table[rand() % SLOTS] = list(length);
+        cells += length;
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    cout << "\t" << cells / seconds / 1e6 << " M allocs/s\t" << usage.ru_maxrss / 1024 << " MB\tevents "
+         << GC::Profiler::recorded(GC::AllocStart) + GC::Profiler::recorded(GC::NewChunk)
+            + GC::Profiler::recorded(GC::ReusedChunk) + GC::Profiler::recorded(GC::ChunkSwept)
+         << " lost " << GC::Profiler::lost() << endl;
+
+    // Nothing is dumped
+    heap.set_profiler(false);
+    GC::Heap::dispose();
+}
+
+static void run(const char *name, bool profile, GC::RecordOption options)
+{
+    cout << "  " << name << std::flush;
+    pid_t child = fork();
+    if (child == 0)
+    {
+        work(profile, options);
+        exit(0);
+    }
+    waitpid(child, nullptr, 0);
+}
+
+int main()
+{
+    cout << "Replacing " << STEPS << " of " << SLOTS << " lists of up to " << LIST_MAX << " cells:" << endl;
+    run("off:           ", false, GC::TimingInfo);
+    run("timing:        ", true, GC::TimingInfo);
+    run("function calls:", true, GC::FunctionCalls);
+    run("chunk ops:     ", true, GC::ChunkOps);
+    run("all:           ", true, GC::AllOps);
+    return 0;
+}
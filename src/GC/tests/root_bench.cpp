@@ -0,0 +1,117 @@
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+
+#include "heap.hpp"
+
+#define DEPTH       50000    // frames on the stack when the heap is collected
+#define LIVE_CELLS  100000   // cells of the list that stays alive
+#define ROUNDS      5        // collections per root mode
+
+using std::cout, std::endl;
+
+/*
+ * Root finding benchmark.
+ *
+ * Recurses DEPTH frames deep like sum in the README, with a boxed
+ * temporary in every frame that is dead before the recursive call but
+ * whose word stays on the stack, and collects the heap at the bottom.
+ * The conservative scan reads every word of the stack and keeps the
+ * temporaries alive. With precise roots only the live list is a root,
+ * in the shadow stack entry of main, since code compiled with gc
+ * "shadow-stack" only pushes entries for frames with live pointers.
+ * Reported are the time spent finding the roots and the bytes that
+ * survive the collection.
+ */
+
+struct Node
+{
+    long value;
+    Node *next;
+};
+
+// A shadow stack entry with one root, as LLVM lays it out
+struct Frame
+{
+    StackEntry *next;
+    const FrameMap *map;
+    void *roots[1];
+};
+
+static const FrameMap one_root = {1, 0, {}};
+
+// Allocates garbage until the heap has been collected once
+static void collect_now()
+{
+    size_t before = GC::Profiler::pacing().m_collections;
+    while (GC::Profiler::pacing().m_collections == before)
+        GC::Heap::alloc(sizeof(Node));
+}
+
+long sum(long n)
+{
+    if (n == 0)
+    {
+        collect_now();
+        return 0;
+    }
+
+    Node *volatile boxed = static_cast<Node *>(GC::Heap::alloc(sizeof(Node)));
+    boxed->value = n;
+    long value = boxed->value;
+
+    long result = sum(n - 1);
+    // Keeps the call from becoming a loop
+    asm volatile("" : "+r"(result));
+    return result + value;
+}
+
+void run(const char *name)
+{
+    auto before = GC::Profiler::root_scanning_time();
+    size_t retained = 0;
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        sum(DEPTH);
+        retained += GC::Profiler::pacing().m_last.m_live;
+    }
+    auto scan = GC::Profiler::root_scanning_time() - before;
+    cout << "  " << name << "\troot scan " << scan.count() / ROUNDS << " us\tretained "
+         << retained / ROUNDS / 1024 << " KB" << endl;
+}
+
+int main()
+{
+    GC::Heap::init();
+    GC::Heap &heap = GC::Heap::the();
+    // Only the pacing of the collections is recorded
+    heap.set_profiler_log_options(GC::TimingInfo);
+    heap.set_profiler(true);
+
+    Node *live = nullptr;
+    for (long i = 0; i < LIVE_CELLS; i++)
+    {
+        auto node = static_cast<Node *>(GC::Heap::alloc(sizeof(Node)));
+        node->value = i;
+        node->next = live;
+        live = node;
+    }
+    Frame frame {llvm_gc_root_chain, &one_root, {live}};
+    llvm_gc_root_chain = reinterpret_cast<StackEntry *>(&frame);
+
+    cout << "Collecting at a depth of " << DEPTH << " frames with " << LIVE_CELLS << " live cells:" << endl;
+    run("conservative:");
+    GC::Heap::set_precise_roots(true);
+    run("precise:     ");
+
+    long total = 0;
+    for (Node *node = live; node != nullptr; node = node->next)
+        total += node->value;
+    if (total != (long)LIVE_CELLS * (LIVE_CELLS - 1) / 2)
+        cout << "The live list was corrupted!" << endl;
+
+    llvm_gc_root_chain = frame.next;
+    heap.set_profiler(false);
+    GC::Heap::dispose();
+    return 0;
+}
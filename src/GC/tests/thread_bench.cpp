@@ -0,0 +1,94 @@
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#include "cheap.h"
+#include "heap.hpp"
+
+#define CELLS       4000000   // cells allocated by every thread
+#define LIST_LENGTH 1000      // cells per garbage list
+
+using std::cout, std::endl;
+using Clock = std::chrono::high_resolution_clock;
+
+/*
+ * Allocation scaling benchmark.
+ *
+ * Every thread attaches to the heap and allocates CELLS list cells
+ * with the inline fast path cheap_alloc_inline(), keeping the list
+ * it builds alive across the collections that the allocations
+ * trigger. The total throughput is reported for 1 to 16 threads,
+ * which shows how far the thread-local allocation buffers let the
+ * allocations scale, including the stops of the collections.
+ */
+
+struct Node
+{
+    long value;
+    Node *next;
+};
+
+// The sum of the values of a list, to check that it survived
+static long sum(Node *node)
+{
+    long total = 0;
+    for (; node != nullptr; node = node->next)
+        total += node->value;
+    return total;
+}
+
+static void mutator(bool &ok)
+{
+    GC::Heap::attach_thread();
+    Node *head = nullptr;
+    for (size_t i = 0; i < CELLS; i++)
+    {
+        if (i % LIST_LENGTH == 0)
+        {
+            ok = ok && sum(head) == (long)LIST_LENGTH * (LIST_LENGTH - 1) / 2 * (head != nullptr);
+            head = nullptr;
+        }
+        Node *node = static_cast<Node *>(cheap_alloc_inline(sizeof(Node)));
+        node->value = i % LIST_LENGTH;
+        node->next = head;
+        head = node;
+    }
+    GC::Heap::detach_thread();
+}
+
+int main()
+{
+    GC::Heap::init();
+
+    cout << "Allocating " << CELLS << " cells of " << sizeof(Node) << " B per thread:" << endl;
+    double base = 0;
+    for (size_t threads : {1, 2, 4, 8, 16})
+    {
+        std::vector<std::thread> workers;
+        std::unique_ptr<bool[]> ok(new bool[threads]);
+        auto start = Clock::now();
+        for (size_t t = 0; t < threads; t++)
+        {
+            ok[t] = true;
+            workers.emplace_back(mutator, std::ref(ok[t]));
+        }
+        for (auto &worker : workers)
+            worker.join();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        bool intact = true;
+        for (size_t t = 0; t < threads; t++)
+            intact = intact && ok[t];
+        double rate = threads * CELLS / seconds / 1e6;
+        if (threads == 1)
+            base = rate;
+        cout << "  " << threads << " threads:\t" << rate << " M allocations/s\t"
+             << rate / base << "x" << (intact ? "" : "\tlists corrupted!") << endl;
+    }
+
+    GC::Heap::dispose();
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "event.hpp"
+#include "trace.hpp"
+
+using std::cerr, std::endl;
+
+/*
+ * Converts a trace file of the profiler (CHEAP_TRACE) to the JSON of
+ * the Chrome trace event format, which chrome://tracing and Perfetto
+ * (ui.perfetto.dev) show as a timeline. The phases of the collections
+ * become complete events with their durations, and the events on the
+ * chunks become instant events with the address and size as arguments.
+ * The times are in microseconds since the profiler started.
+ *
+ * Usage: trace2json.out <trace file> [<json file>]
+ * The JSON is written to stdout if no json file is given.
+ */
+
+// The name of an event type without "Start", which the phases end in
+static std::string name(uint64_t type)
+{
+    std::string name = GC::GCEvent {0, 0, 0, type}.type_to_string();
+    if (name.size() > 5 && name.compare(name.size() - 5, 5, "Start") == 0)
+        name.erase(name.size() - 5);
+    return name;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        cerr << "Usage: " << argv[0] << " <trace file> [<json file>]" << endl;
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    std::vector<char> trace((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    GC::TraceHeader header;
+    if (trace.size() < sizeof(header) || (std::memcpy(&header, trace.data(), sizeof(header)), header.m_magic != TRACE_MAGIC))
+    {
+        cerr << argv[1] << ": not a trace file" << endl;
+        return 1;
+    }
+
+    std::ofstream file;
+    if (argc == 3)
+        file.open(argv[2]);
+    std::ostream &out = argc == 3 ? file : std::cout;
+    out.precision(3);
+    out << std::fixed << "{\"traceEvents\":[";
+
+    const char *separator = "\n";
+    size_t events = 0, spans = 0;
+    size_t at = sizeof(header);
+    GC::TraceRecord record;
+    while (at + sizeof(record) <= trace.size())
+    {
+        std::memcpy(&record, trace.data() + at, sizeof(record));
+        // A mapped trace that was not cut ends in zeros
+        size_t end = at + sizeof(record.m_length) + record.m_length;
+        if (record.m_length == 0 || end > trace.size())
+            break;
+        const char *payload = trace.data() + at + sizeof(record);
+        size_t size = end - at - sizeof(record);
+        at = end;
+
+        if (record.m_kind == GC::EventRecord && size >= sizeof(GC::GCEvent))
+        {
+            GC::GCEvent event;
+            std::memcpy(&event, payload, sizeof(event));
+            out << separator << "{\"name\":\"" << name(event.m_type)
+                << "\",\"cat\":\"heap\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":1,\"ts\":"
+                << (event.m_time - header.m_start) / 1e3;
+            // An allocation has the requested size, a chunk
+            // its address as well
+            if (event.m_address != 0)
+                out << ",\"args\":{\"address\":\"0x" << std::hex << event.m_address << std::dec
+                    << "\",\"size\":" << event.m_size << "}";
+            else if (event.m_size != 0)
+                out << ",\"args\":{\"size\":" << event.m_size << "}";
+            out << "}";
+            events++;
+        }
+        else if (record.m_kind == GC::SpanRecord && size >= sizeof(GC::TraceSpan))
+        {
+            GC::TraceSpan span;
+            std::memcpy(&span, payload, sizeof(span));
+            out << separator << "{\"name\":\"" << name(span.m_type)
+                << "\",\"cat\":\"gc\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":"
+                << (span.m_start - header.m_start) / 1e3 << ",\"dur\":" << span.m_duration / 1e3 << "}";
+            spans++;
+        }
+        else
+            continue;
+        separator = ",\n";
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}" << endl;
+
+    cerr << events << " events and " << spans << " phases" << endl;
+    return 0;
+}
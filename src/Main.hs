@@ -3,7 +3,7 @@
 module Main where
 
 import           AnnForall                   (annotateForall)
-import           Codegen.Codegen             (generateCode)
+import           Codegen.Codegen             (Roots (..), generateCode)
 import           Compiler                    (compile)
 import           Control.Monad               (when, (<=<))
 import           Data.List.Extra             (isSuffixOf)
@@ -21,7 +21,7 @@ import           Monomorphizer.Monomorphizer (monomorphize)
 import           OrderDefs                   (orderDefs)
 import           Renamer.Renamer             (rename)
 import           ReportForall                (reportForall)
-import           System.Console.GetOpt       (ArgDescr (NoArg, ReqArg),
+import           System.Console.GetOpt       (ArgDescr (NoArg, OptArg, ReqArg),
                                               ArgOrder (RequireOrder),
                                               OptDescr (Option), getOpt,
                                               usageInfo)
@@ -47,6 +47,9 @@ parseArgs argv = case getOpt RequireOrder flags argv of
         | opts.help || isNothing opts.typechecker -> do
             hPutStrLn stderr (usageInfo header flags)
             exitSuccess
+        | Just r <- opts.badRoots -> do
+            hPutStrLn stderr ("Invalid precise roots '" ++ r ++ "', expected shadow-stack or frame-table\n" ++ usageInfo header flags)
+            exitWith (ExitFailure 1)
         | otherwise -> do
             let name = dropExtensions $ takeFileName f
             pure (opts, name, f)
@@ -56,13 +59,14 @@ parseArgs argv = case getOpt RequireOrder flags argv of
         hPutStrLn stderr (concat errs ++ usageInfo header flags)
         exitWith (ExitFailure 1)
   where
-    header = "Usage: churf [--help] [-l|--log-intermediate] [-d|--debug] [-m|--disable-gc] [-t|--type-checker bi/hm] [-p|--disable-prelude] <FILE> \n"
+    header = "Usage: churf [--help] [-l|--log-intermediate] [-d|--debug] [-m|--disable-gc] [-r|--precise-roots[=shadow-stack/frame-table]] [-t|--type-checker bi/hm] [-p|--disable-prelude] <FILE> \n"
 
 flags :: [OptDescr (Options -> Options)]
 flags =
     [ Option ['d'] ["debug"] (NoArg $ enableDebug . logIntermediate) "Print debug messages. --debug implies --log-intermediate"
     , Option ['t'] ["type-checker"] (ReqArg chooseTypechecker "bi/hm") "Choose type checker. Possible options are bi and hm"
     , Option ['m'] ["disable-gc"] (NoArg disableGC) "Disables the garbage collector and uses malloc instead."
+    , Option ['r'] ["precise-roots"] (OptArg choosePreciseRoots "shadow-stack/frame-table") "Find the roots of the garbage collector on a shadow stack (the default) or in a frame table instead of scanning the stack. The frame table needs src/Accurate_GC/gc.so"
     , Option ['p'] ["disable-prelude"] (NoArg disablePrelude) "Do not include the prelude"
     , Option ['l'] ["log-intermediate"] (NoArg logIntermediate) "Log intermediate languages"
     , Option [] ["help"] (NoArg enableHelp) "Print this help message"
@@ -74,6 +78,8 @@ initOpts =
         { help = False
         , debug = False
         , gc = True
+        , precise = Nothing
+        , badRoots = Nothing
         , typechecker = Nothing
         , preludeOpt = False
         , logIL = False
@@ -88,6 +94,13 @@ enableDebug opts = opts{debug = True}
 disableGC :: Options -> Options
 disableGC opts = opts{gc = False}
 
+choosePreciseRoots :: Maybe String -> Options -> Options
+choosePreciseRoots s opts = case s of
+    Nothing             -> opts{precise = pure ShadowStack}
+    Just "shadow-stack" -> opts{precise = pure ShadowStack}
+    Just "frame-table"  -> opts{precise = pure FrameTable}
+    Just r              -> opts{badRoots = pure r}
+
 disablePrelude :: Options -> Options
 disablePrelude opts = opts{preludeOpt = True}
 
@@ -107,6 +120,8 @@ data Options = Options
     { help        :: Bool
     , debug       :: Bool
     , gc          :: Bool
+    , precise     :: Maybe Roots
+    , badRoots    :: Maybe String
     , typechecker :: Maybe TypeChecker
     , preludeOpt  :: Bool
     , logIL       :: Bool
@@ -152,7 +167,7 @@ main' opts name s =
             when opts.logIL (printToErr "\n -- Monomorphizer --" >> log monomorphized)
 
 
-            generatedCode <- fromErr $ generateCode monomorphized (gc opts)
+            generatedCode <- fromErr $ generateCode monomorphized (gc opts) (if gc opts then precise opts else Nothing)
 
             check <- doesPathExist "output"
             when check (removeDirectoryRecursive "output")
@@ -163,7 +178,7 @@ main' opts name s =
                 printToErr "\n -- Compiler --"
                 writeFile "output/llvm.ll" generatedCode
 
-            compile name generatedCode (gc opts)
+            compile name generatedCode (gc opts) (gc opts && precise opts == Just FrameTable)
             printToErr "Compilation done!"
             printToErr "\n-- Program output --"
             print =<< spawnWait ("./output/" <> name)